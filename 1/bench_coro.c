@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcoro.h"
+
+/**
+ * Micro benchmarks of the coroutine library. Build and run with
+ * each backend to compare them:
+ *
+ * $> make bench
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static int
+bench_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static int
+bench_yield_once_f(void *arg)
+{
+	(void)arg;
+	coro_yield();
+	return 0;
+}
+
+static void
+bench_print_stack_stats(void)
+{
+	struct coro_stack_stats stats;
+	coro_stack_stats(&stats);
+	long long total = stats.hits + stats.misses;
+	printf("stack pool: hit rate %.1f%% (%lld of %lld), used %lld, "
+	       "free %lld, unguarded %lld\n",
+	       total > 0 ? stats.hits * 100.0 / total : 0, stats.hits,
+	       total, stats.used_count, stats.free_count,
+	       stats.unguarded_count);
+	printf("stack memory: mapped %zu MB, committed %zu MB\n",
+	       stats.mapped_bytes >> 20, stats.committed_bytes >> 20);
+}
+
+/** Nanoseconds per coro_yield() with @a coro_count coroutines. */
+static double
+bench_yield(int coro_count, long yield_count, size_t stack_size)
+{
+	for (int i = 0; i < coro_count; ++i)
+		coro_new_ex(bench_yield_f, &yield_count, stack_size);
+	double start = bench_now();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	return (bench_now() - start) / ((double)coro_count * yield_count);
+}
+
+/**
+ * Nanoseconds per coro_new() and per coro_delete() of a finished
+ * coroutine, including its run to completion.
+ */
+static void
+bench_create(int batch, int rounds, double *new_ns, double *delete_ns)
+{
+	double new_total = 0, delete_total = 0;
+	for (int r = 0; r < rounds; ++r) {
+		double start = bench_now();
+		for (int i = 0; i < batch; ++i)
+			coro_new(bench_empty_f, NULL);
+		double mid = bench_now();
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		new_total += mid - start;
+		delete_total += bench_now() - mid;
+	}
+	*new_ns = new_total / ((double)batch * rounds);
+	*delete_ns = delete_total / ((double)batch * rounds);
+}
+
+/**
+ * Nanoseconds per item processed by a pool of @a coro_count
+ * coroutines, including the push and the join.
+ */
+static double
+bench_pool(int coro_count, int item_count)
+{
+	double start = bench_now();
+	struct coro_pool *pool = coro_pool_new(coro_count, bench_empty_f,
+					       16 * 1024);
+	for (int i = 0; i < item_count; ++i)
+		coro_pool_push(pool, NULL);
+	coro_pool_join(pool);
+	coro_pool_delete(pool);
+	return (bench_now() - start) / item_count;
+}
+
+static int
+bench_work_f(void *arg)
+{
+	long count = *(long *)arg;
+	volatile unsigned x = 1;
+	for (long i = 0; i < count; ++i) {
+		for (int j = 0; j < 1000; ++j)
+			x = x * 1103515245 + 12345;
+		coro_yield_if_expired();
+	}
+	return 0;
+}
+
+/**
+ * Milliseconds to run CPU bound coroutines in @a thread_count
+ * worker threads. 0 means the single thread mode.
+ */
+static double
+bench_threads(int thread_count, int coro_count, long work_count)
+{
+	coro_sched_init_threads(thread_count);
+	coro_sched_set_quantum(100);
+	double start = bench_now();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(bench_work_f, &work_count);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double res = (bench_now() - start) / 1e6;
+	coro_sched_destroy();
+	return res;
+}
+
+/**
+ * Keep @a count coroutines with small stacks alive at once, and
+ * show how much memory they take.
+ */
+static void
+bench_many(int count, size_t stack_size)
+{
+	for (int i = 0; i < count; ++i)
+		coro_new_ex(bench_yield_once_f, NULL, stack_size);
+	struct coro *c = coro_sched_wait();
+	printf("%d coroutines with %zu KB stacks:\n", count,
+	       stack_size >> 10);
+	bench_print_stack_stats();
+	for (; c != NULL; c = coro_sched_wait())
+		coro_delete(c);
+}
+
+int
+main(int argc, char **argv)
+{
+	long yield_count = argc > 1 ? atol(argv[1]) : 1000000;
+	int batch = argc > 2 ? atoi(argv[2]) : 1000;
+	int many = argc > 3 ? atoi(argv[3]) : 100000;
+	int rounds = 10;
+	coro_sched_init();
+
+	printf("backend: %s\n", coro_backend());
+	double ns = bench_yield(2, yield_count, 0);
+	printf("coro_yield: %.1f ns\n", ns);
+	coro_trace_start(1 << 16);
+	ns = bench_yield(2, yield_count, 0);
+	coro_trace_stop();
+	printf("coro_yield with tracing: %.1f ns\n", ns);
+	/*
+	 * The same total number of switches spread over more and more
+	 * coroutines. The cost should not depend on their count, except
+	 * for cache misses on the stacks.
+	 */
+	for (int count = 10; count <= many; count *= 10) {
+		long per_coro = yield_count / count;
+		if (per_coro < 100)
+			per_coro = 100;
+		ns = bench_yield(count, per_coro, 16 * 1024);
+		printf("coro_yield with %d coroutines: %.1f ns\n", count, ns);
+	}
+	double new_ns, delete_ns;
+	bench_create(batch, rounds, &new_ns, &delete_ns);
+	printf("coro_new: %.1f ns\n", new_ns);
+	printf("coro_delete (with run): %.1f ns\n", delete_ns);
+	printf("coro_new + coro_delete: %.1f ns\n", new_ns + delete_ns);
+	printf("coro_pool item: %.1f ns\n", bench_pool(16, batch * rounds));
+	bench_print_stack_stats();
+	bench_many(many, 16 * 1024);
+	coro_sched_destroy();
+
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	double base = bench_threads(0, 64, 2000);
+	printf("CPU bound work, single thread: %.1f ms\n", base);
+	for (int threads = 1; threads <= cpu_count; threads *= 2) {
+		double ms = bench_threads(threads, 64, 2000);
+		printf("CPU bound work, %d threads: %.1f ms, speedup %.2f\n",
+		       threads, ms, base / ms);
+	}
+	return 0;
+}
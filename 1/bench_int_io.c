@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "int_io.h"
+
+/**
+ * Throughput of loading and saving integer text files: the
+ * fscanf()/fprintf() loop the sorter used to have against int_io.
+ *
+ * $> make bench
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t
+bench_file_size(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+/** Read numbers one by one, growing the array by one element. */
+static int *
+bench_load_stdio(const char *path, size_t *count)
+{
+	FILE *f = fopen(path, "r");
+	int *array = NULL;
+	size_t size = 0;
+	int number;
+	while (fscanf(f, "%d", &number) == 1) {
+		array = realloc(array, (size + 1) * sizeof(int));
+		array[size++] = number;
+	}
+	fclose(f);
+	*count = size;
+	return array;
+}
+
+static void
+bench_save_stdio(const char *path, const int *array, size_t count)
+{
+	FILE *f = fopen(path, "w");
+	for (size_t i = 0; i < count; ++i)
+		fprintf(f, "%d ", array[i]);
+	fclose(f);
+}
+
+static void
+bench_load_int_io(const char *path, struct int_array *arr)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || int_array_load(arr, fd) != 0) {
+		perror("load");
+		exit(1);
+	}
+	close(fd);
+}
+
+static void
+bench_save_int_io(const char *path, const int *array, size_t count)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || int_io_write(fd, array, count) != 0) {
+		perror("save");
+		exit(1);
+	}
+	close(fd);
+}
+
+static void
+bench_report(const char *what, size_t bytes, double ns)
+{
+	printf("%s: %.1f MB/s\n", what, bytes / (ns / 1e9) / (1 << 20));
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t count = argc > 1 ? atol(argv[1]) : 10000000;
+	char path[] = "/tmp/bench_int_io.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	int *numbers = malloc(count * sizeof(int));
+	unsigned seed = 1;
+	for (size_t i = 0; i < count; ++i)
+		numbers[i] = rand_r(&seed) - RAND_MAX / 2;
+
+	double start = bench_now();
+	bench_save_stdio(path, numbers, count);
+	double ns = bench_now() - start;
+	size_t bytes = bench_file_size(path);
+	printf("%zu numbers, %zu MB of text\n", count, bytes >> 20);
+	bench_report("fprintf save", bytes, ns);
+
+	start = bench_now();
+	bench_save_int_io(path, numbers, count);
+	bench_report("int_io save", bytes, bench_now() - start);
+	if (bench_file_size(path) != bytes) {
+		printf("int_io wrote %zu bytes instead of %zu\n",
+		       bench_file_size(path), bytes);
+		return 1;
+	}
+
+	size_t stdio_count;
+	start = bench_now();
+	int *stdio_numbers = bench_load_stdio(path, &stdio_count);
+	bench_report("fscanf load", bytes, bench_now() - start);
+
+	struct int_array arr;
+	int_array_create(&arr);
+	start = bench_now();
+	bench_load_int_io(path, &arr);
+	bench_report("int_io load", bytes, bench_now() - start);
+	if (arr.size != count || stdio_count != count ||
+	    memcmp(arr.data, numbers, count * sizeof(int)) != 0 ||
+	    memcmp(stdio_numbers, numbers, count * sizeof(int)) != 0) {
+		printf("loaded numbers differ from the saved ones\n");
+		return 1;
+	}
+	int_array_destroy(&arr);
+	free(stdio_numbers);
+	free(numbers);
+	unlink(path);
+	return 0;
+}
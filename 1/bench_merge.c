@@ -0,0 +1,139 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "int_bin.h"
+#include "int_io.h"
+#include "int_merge.h"
+
+/**
+ * K-way merge of sorted files for different k with the same total
+ * count of numbers. Cost per number should grow as log(k). The runs
+ * are text, or binary files of int_bin.h, raw or compressed.
+ *
+ * $> make bench
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+enum {
+	/** Format of text runs, besides enum int_bin_format. */
+	BENCH_TEXT = -1,
+};
+
+/**
+ * Nanoseconds per number to merge @a k runs of @a total numbers in
+ * @a format.
+ */
+static double
+bench_merge(int k, size_t total, int format)
+{
+	char (*paths)[32] = malloc(k * sizeof(*paths));
+	size_t run_size = total / k;
+	int *run = malloc(run_size * sizeof(int));
+	unsigned seed = k;
+	for (int i = 0; i < k; ++i) {
+		for (size_t j = 0; j < run_size; ++j)
+			run[j] = rand_r(&seed);
+		qsort(run, run_size, sizeof(int), bench_cmp);
+		snprintf(paths[i], sizeof(paths[i]), "/tmp/bench_merge.XXXXXX");
+		int fd = mkstemp(paths[i]);
+		int rc = fd < 0 ? -1 : format == BENCH_TEXT ?
+			 int_io_write(fd, run, run_size) :
+			 int_bin_write(fd, run, run_size, format);
+		if (rc != 0) {
+			perror("write run");
+			exit(1);
+		}
+		close(fd);
+	}
+	free(run);
+	struct int_reader *runs = malloc(k * sizeof(*runs));
+	struct int_bin_reader *bin_runs = malloc(k * sizeof(*bin_runs));
+	char out_path[] = "/tmp/bench_merge_out.XXXXXX";
+	int out_fd = mkstemp(out_path);
+	double start = bench_now();
+	for (int i = 0; i < k; ++i) {
+		int fd = open(paths[i], O_RDONLY);
+		int rc = fd < 0 ? -1 : format == BENCH_TEXT ?
+			 int_reader_create(&runs[i], fd, 64 * 1024) :
+			 int_bin_reader_open(&bin_runs[i], fd);
+		if (rc != 0) {
+			perror("open run");
+			exit(1);
+		}
+		if (format != BENCH_TEXT)
+			close(fd);
+	}
+	struct int_writer out;
+	int_writer_create(&out, out_fd, 0);
+	int rc = format == BENCH_TEXT ? int_merge(runs, k, &out) :
+		 int_merge_bin(bin_runs, k, &out);
+	if (rc != 0) {
+		perror("merge");
+		exit(1);
+	}
+	double ns = (bench_now() - start) / (run_size * k);
+	int_writer_destroy(&out);
+	for (int i = 0; i < k; ++i) {
+		if (format == BENCH_TEXT) {
+			close(runs[i].fd);
+			int_reader_destroy(&runs[i]);
+		} else {
+			int_bin_reader_close(&bin_runs[i]);
+		}
+		unlink(paths[i]);
+	}
+	free(runs);
+	free(bin_runs);
+	free(paths);
+
+	/* The output should be sorted and complete. */
+	lseek(out_fd, 0, SEEK_SET);
+	struct int_array merged;
+	int_array_create(&merged);
+	int_array_load(&merged, out_fd);
+	close(out_fd);
+	unlink(out_path);
+	if (merged.size != run_size * k) {
+		printf("merged %zu numbers instead of %zu\n", merged.size,
+		       run_size * k);
+		exit(1);
+	}
+	for (size_t i = 1; i < merged.size; ++i) {
+		if (merged.data[i - 1] > merged.data[i]) {
+			printf("merged numbers are not sorted\n");
+			exit(1);
+		}
+	}
+	int_array_destroy(&merged);
+	return ns;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t total = argc > 1 ? atol(argv[1]) : 4000000;
+	printf("merging %zu numbers\n", total);
+	for (int k = 2; k <= 1024; k *= 4) {
+		printf("k = %d: text %.1f, raw %.1f, varint %.1f ns per number\n",
+		       k, bench_merge(k, total, BENCH_TEXT),
+		       bench_merge(k, total, INT_BIN_RAW),
+		       bench_merge(k, total, INT_BIN_VARINT));
+	}
+	return 0;
+}
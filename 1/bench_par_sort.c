@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "int_io.h"
+#include "int_par_sort.h"
+
+/**
+ * Scaling of the parallel sort from 1 to N workers, as processes and
+ * as threads. The output goes to /dev/null, so the merge is measured
+ * without the disk.
+ *
+ * $> make bench
+ * $> ./bench_par_sort [<max workers> [<files> [<numbers per file>]]]
+ */
+
+static void
+bench_generate(const char *path, size_t count, unsigned seed)
+{
+	int *data = malloc(count * sizeof(int));
+	for (size_t i = 0; i < count; ++i)
+		data[i] = rand_r(&seed) - RAND_MAX / 2;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || int_io_write(fd, data, count) != 0) {
+		perror("generate");
+		exit(1);
+	}
+	close(fd);
+	free(data);
+}
+
+static void
+bench_run(char **paths, int path_count, int workers, bool is_threads,
+	  double *base)
+{
+	struct int_par_sort_opts opts = {
+		.worker_count = workers,
+		.is_threads = is_threads,
+		.coro_count = 0,
+		.sort = int_sort_radix,
+		.unit = 1024,
+	};
+	int fd = open("/dev/null", O_WRONLY);
+	struct int_writer out;
+	int_writer_create(&out, fd, 0);
+	struct int_par_sort_stats stats;
+	if (int_par_sort(paths, path_count, &opts, &out, &stats) != 0) {
+		perror("sort");
+		exit(1);
+	}
+	int_writer_destroy(&out);
+	close(fd);
+	double sort = stats.sort_time / 1e9;
+	double merge = stats.merge_time / 1e9;
+	if (*base == 0)
+		*base = sort;
+	printf("%-9s %2d: sort %.3f s (x%.2f), merge %.3f s, total %.3f s\n",
+	       is_threads ? "threads" : "processes", workers, sort,
+	       *base / sort, merge, sort + merge);
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_workers = argc > 1 ? atoi(argv[1]) :
+			  sysconf(_SC_NPROCESSORS_ONLN);
+	int path_count = argc > 2 ? atoi(argv[2]) : 16;
+	size_t count = argc > 3 ? atol(argv[3]) : 1000000;
+	if (max_workers < 1)
+		max_workers = 1;
+	char **paths = malloc(path_count * sizeof(paths[0]));
+	for (int i = 0; i < path_count; ++i) {
+		paths[i] = malloc(64);
+		snprintf(paths[i], 64, "/tmp/bench_par_sort_%d.txt", i);
+		bench_generate(paths[i], count, i);
+	}
+	printf("%d files of %zu numbers, %ld cpus\n", path_count, count,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	for (int is_threads = 0; is_threads < 2; ++is_threads) {
+		double base = 0;
+		/* Powers of 2 and the maximum itself. */
+		for (int w = 1;; w = w * 2 < max_workers ? w * 2 : max_workers) {
+			bench_run(paths, path_count, w, is_threads, &base);
+			if (w == max_workers)
+				break;
+		}
+	}
+	for (int i = 0; i < path_count; ++i) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "int_sort.h"
+#include "libcoro.h"
+
+/**
+ * Sorting inside coroutines with different yield granularities.
+ * The quantum is 0, so each work unit boundary is a switch. The
+ * recursive merge sort the solution used to have is the baseline:
+ * it allocates on each merge and yields after each element.
+ *
+ * $> make bench
+ */
+
+enum bench_sort_algo {
+	BENCH_SORT_LEGACY,
+	BENCH_SORT_MERGE,
+	BENCH_SORT_RADIX,
+};
+
+static const char *bench_sort_algo_names[] = {"legacy", "merge", "radix"};
+
+struct bench_sort_task {
+	enum bench_sort_algo algo;
+	size_t unit;
+	int *data;
+	size_t count;
+	long long switch_count;
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_legacy_merge(int *arr, int l, int m, int r)
+{
+	int n1 = m - l + 1;
+	int n2 = r - m;
+	int *L = malloc(n1 * sizeof(int));
+	int *R = malloc(n2 * sizeof(int));
+	memcpy(L, arr + l, n1 * sizeof(int));
+	memcpy(R, arr + m + 1, n2 * sizeof(int));
+	int i = 0, j = 0, k = l;
+	while (i < n1 && j < n2) {
+		coro_yield_if_expired();
+		arr[k++] = L[i] <= R[j] ? L[i++] : R[j++];
+	}
+	while (i < n1) {
+		coro_yield_if_expired();
+		arr[k++] = L[i++];
+	}
+	while (j < n2) {
+		coro_yield_if_expired();
+		arr[k++] = R[j++];
+	}
+	free(L);
+	free(R);
+}
+
+static void
+bench_legacy_sort(int *arr, int l, int r)
+{
+	if (l >= r)
+		return;
+	int m = l + (r - l) / 2;
+	bench_legacy_sort(arr, l, m);
+	bench_legacy_sort(arr, m + 1, r);
+	bench_legacy_merge(arr, l, m, r);
+}
+
+static int
+bench_sort_f(void *arg)
+{
+	struct bench_sort_task *t = arg;
+	int *scratch = malloc(t->count * sizeof(int));
+	switch (t->algo) {
+	case BENCH_SORT_LEGACY:
+		bench_legacy_sort(t->data, 0, t->count - 1);
+		break;
+	case BENCH_SORT_MERGE:
+		int_sort_merge(t->data, t->count, scratch, t->unit);
+		break;
+	case BENCH_SORT_RADIX:
+		int_sort_radix(t->data, t->count, scratch, t->unit);
+		break;
+	}
+	free(scratch);
+	t->switch_count = coro_switch_count(coro_this());
+	return 0;
+}
+
+/** Sort @a coro_count arrays concurrently, print time and switches. */
+static void
+bench_sort(enum bench_sort_algo algo, size_t unit, int coro_count,
+	   size_t count)
+{
+	struct bench_sort_task *tasks = calloc(coro_count, sizeof(*tasks));
+	unsigned seed = 1;
+	for (int i = 0; i < coro_count; ++i) {
+		tasks[i].algo = algo;
+		tasks[i].unit = unit;
+		tasks[i].count = count;
+		tasks[i].data = malloc(count * sizeof(int));
+		for (size_t j = 0; j < count; ++j)
+			tasks[i].data[j] = rand_r(&seed);
+	}
+	double start = bench_now();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(bench_sort_f, &tasks[i]);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double ms = (bench_now() - start) / 1e6;
+	long long switch_count = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		switch_count += tasks[i].switch_count;
+		for (size_t j = 1; j < count; ++j) {
+			if (tasks[i].data[j - 1] > tasks[i].data[j]) {
+				printf("%s: not sorted\n",
+				       bench_sort_algo_names[algo]);
+				exit(1);
+			}
+		}
+		free(tasks[i].data);
+	}
+	free(tasks);
+	if (algo == BENCH_SORT_LEGACY)
+		printf("%-6s unit 1 (per element): ", bench_sort_algo_names[algo]);
+	else if (unit == 0)
+		printf("%-6s no yields: ", bench_sort_algo_names[algo]);
+	else
+		printf("%-6s unit %zu: ", bench_sort_algo_names[algo], unit);
+	printf("%.1f ms, %lld switches\n", ms, switch_count);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t count = argc > 1 ? atol(argv[1]) : 1000000;
+	int coro_count = argc > 2 ? atoi(argv[2]) : 8;
+	coro_sched_init();
+	printf("%d coroutines sorting %zu ints each\n", coro_count, count);
+	bench_sort(BENCH_SORT_LEGACY, 1, coro_count, count);
+	size_t units[] = {1, 64, 1024, 16384, 262144, 0};
+	for (int algo = BENCH_SORT_MERGE; algo <= BENCH_SORT_RADIX; ++algo) {
+		for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); ++i)
+			bench_sort(algo, units[i], coro_count, count);
+	}
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "int_gen.h"
+#include "int_verify.h"
+
+/**
+ * Benchmark suite of the sorter. For each distribution of the input
+ * it runs the sorter binary over a grid of coroutine counts and
+ * target latencies, checks each output in one streaming pass and
+ * writes a table of results separated by tabs.
+ *
+ * $> make bench_suite
+ * $> ./bench_suite [-n <numbers per file>] [-f <files>]
+ *        [-d <distribution>,...] [-c <coroutines>,...]
+ *        [-l <latency usec>,...] [-s <sorter>] [-w <work dir>]
+ *        [-o <results file>]
+ *
+ * It replaces generator.py and checker.py for big files too:
+ *
+ * $> ./bench_suite gen <distribution> <count> <file> [<seed>]
+ * $> ./bench_suite verify <output> [<input> ...]
+ */
+
+enum {
+	/** Maximal length of a list of values of an option. */
+	BENCH_LIST_MAX = 16,
+	BENCH_PATH_MAX = 4096,
+};
+
+struct bench_opts {
+	size_t count;
+	int file_count;
+	int dists[INT_GEN_DIST_COUNT];
+	int dist_count;
+	long long coros[BENCH_LIST_MAX];
+	int coro_count;
+	long long latencies[BENCH_LIST_MAX];
+	int latency_count;
+	const char *sorter;
+	const char *work_dir;
+	const char *results;
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Parse a list like "1,3,6". */
+static int
+bench_parse_list(const char *str, long long *values)
+{
+	int count = 0;
+	while (*str != 0 && count < BENCH_LIST_MAX) {
+		char *end;
+		long long value = strtoll(str, &end, 10);
+		if (end == str)
+			break;
+		values[count++] = value;
+		str = *end == ',' ? end + 1 : end;
+	}
+	return count;
+}
+
+static int
+bench_parse_dists(const char *str, int *dists)
+{
+	char *copy = strdup(str);
+	int count = 0;
+	for (char *name = strtok(copy, ","); name != NULL;
+	     name = strtok(NULL, ",")) {
+		int dist = int_gen_dist_by_name(name);
+		if (dist < 0) {
+			fprintf(stderr, "Unknown distribution %s\n", name);
+			exit(1);
+		}
+		if (count < INT_GEN_DIST_COUNT)
+			dists[count++] = dist;
+	}
+	free(copy);
+	return count;
+}
+
+static int
+bench_generate(const char *path, int dist, size_t count, uint64_t seed,
+	       struct int_digest *digest)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	int rc = int_gen_write(fd, dist, count, seed, digest);
+	close(fd);
+	return rc;
+}
+
+/** The sorter rewrites its inputs, so each run gets fresh copies. */
+static int
+bench_copy(const char *src, const char *dst)
+{
+	int in = open(src, O_RDONLY);
+	if (in < 0)
+		return -1;
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		close(in);
+		return -1;
+	}
+	static char buf[1 << 20];
+	ssize_t size;
+	int rc = 0;
+	while ((size = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, size) != size) {
+			rc = -1;
+			break;
+		}
+	}
+	if (size < 0)
+		rc = -1;
+	close(in);
+	close(out);
+	return rc;
+}
+
+/**
+ * Run the sorter with its stdout dropped.
+ * @retval Exit status of the sorter, -1 if it could not run.
+ */
+static int
+bench_run_sorter(const struct bench_opts *opts, long long coros,
+		 long long latency, char **inputs, const char *output)
+{
+	char coro_str[32], latency_str[32];
+	snprintf(coro_str, sizeof(coro_str), "%lld", coros);
+	snprintf(latency_str, sizeof(latency_str), "%lld", latency);
+	char **argv = calloc(opts->file_count + 8, sizeof(argv[0]));
+	int argc = 0;
+	argv[argc++] = (char *)opts->sorter;
+	argv[argc++] = "-c";
+	argv[argc++] = coro_str;
+	argv[argc++] = "-l";
+	argv[argc++] = latency_str;
+	argv[argc++] = "-o";
+	argv[argc++] = (char *)output;
+	for (int i = 0; i < opts->file_count; ++i)
+		argv[argc++] = inputs[i];
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execv(opts->sorter, argv);
+		perror("Error running the sorter");
+		_exit(127);
+	}
+	free(argv);
+	if (pid < 0)
+		return -1;
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/** Why the output is wrong, or NULL if it is right. */
+static const char *
+bench_check(const char *output, const struct int_digest *expected)
+{
+	struct int_verify_result res;
+	if (int_verify_file(output, &res) != 0)
+		return "unreadable";
+	if (res.is_garbage)
+		return "garbage";
+	if (!res.is_sorted)
+		return "unsorted";
+	if (!int_digest_is_equal(&res.digest, expected))
+		return "numbers differ";
+	return NULL;
+}
+
+/** Run the whole grid for one distribution. @retval Failed runs. */
+static int
+bench_dist(const struct bench_opts *opts, int dist, FILE *results)
+{
+	const char *name = int_gen_dist_name(dist);
+	char **sources = calloc(opts->file_count, sizeof(sources[0]));
+	char **inputs = calloc(opts->file_count, sizeof(inputs[0]));
+	char output[BENCH_PATH_MAX];
+	snprintf(output, sizeof(output), "%s/bench_suite_out.txt",
+		 opts->work_dir);
+	struct int_digest expected;
+	int_digest_create(&expected);
+	for (int i = 0; i < opts->file_count; ++i) {
+		sources[i] = malloc(BENCH_PATH_MAX);
+		inputs[i] = malloc(BENCH_PATH_MAX);
+		snprintf(sources[i], BENCH_PATH_MAX, "%s/bench_suite_%s_%d.src",
+			 opts->work_dir, name, i);
+		snprintf(inputs[i], BENCH_PATH_MAX, "%s/bench_suite_%s_%d.txt",
+			 opts->work_dir, name, i);
+		if (bench_generate(sources[i], dist, opts->count, i + 1,
+				   &expected) != 0) {
+			perror("Error generating input");
+			exit(1);
+		}
+	}
+	int failed = 0;
+	for (int c = 0; c < opts->coro_count; ++c) {
+		for (int l = 0; l < opts->latency_count; ++l) {
+			for (int i = 0; i < opts->file_count; ++i) {
+				if (bench_copy(sources[i], inputs[i]) != 0) {
+					perror("Error copying input");
+					exit(1);
+				}
+			}
+			long long coros = opts->coros[c];
+			long long latency = opts->latencies[l];
+			double start = bench_now();
+			int status = bench_run_sorter(opts, coros, latency,
+						      inputs, output);
+			double time = bench_now() - start;
+			const char *error = status != 0 ? "sorter failed" :
+					    bench_check(output, &expected);
+			if (error != NULL)
+				++failed;
+			double total = (double)opts->count * opts->file_count;
+			printf("%-10s %5d %10zu %5lld %8lld %9.3f %12.0f  %s\n",
+			       name, opts->file_count, opts->count, coros,
+			       latency, time, total / time,
+			       error != NULL ? error : "ok");
+			fprintf(results, "%s\t%d\t%zu\t%lld\t%lld\t%.6f\t%.0f\t"
+				"%d\t%s\n", name, opts->file_count, opts->count,
+				coros, latency, time, total / time, status,
+				error != NULL ? error : "ok");
+		}
+	}
+	for (int i = 0; i < opts->file_count; ++i) {
+		unlink(sources[i]);
+		unlink(inputs[i]);
+		free(sources[i]);
+		free(inputs[i]);
+	}
+	unlink(output);
+	free(sources);
+	free(inputs);
+	return failed;
+}
+
+static int
+bench_gen_main(int argc, char **argv)
+{
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s gen <distribution> <count> <file> "
+			"[<seed>]\n", argv[0]);
+		return 1;
+	}
+	int dist = int_gen_dist_by_name(argv[2]);
+	if (dist < 0) {
+		fprintf(stderr, "Unknown distribution %s\n", argv[2]);
+		return 1;
+	}
+	uint64_t seed = argc > 5 ? strtoull(argv[5], NULL, 10) : (uint64_t)time(NULL);
+	if (bench_generate(argv[4], dist, strtoull(argv[3], NULL, 10), seed,
+			   NULL) != 0) {
+		perror("Error generating");
+		return 1;
+	}
+	return 0;
+}
+
+static int
+bench_verify_main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s verify <output> [<input> ...]\n",
+			argv[0]);
+		return 1;
+	}
+	struct int_verify_result res;
+	if (int_verify_file(argv[2], &res) != 0) {
+		perror("Error reading output");
+		return 1;
+	}
+	int rc = 0;
+	if (res.is_garbage) {
+		printf("Not a number after %llu numbers\n",
+		       (unsigned long long)res.digest.count);
+		rc = 1;
+	}
+	if (!res.is_sorted) {
+		printf("Number %llu is less than the previous one\n",
+		       (unsigned long long)res.first_unsorted);
+		rc = 1;
+	}
+	if (argc > 3) {
+		struct int_digest expected;
+		int_digest_create(&expected);
+		for (int i = 3; i < argc; ++i) {
+			struct int_verify_result input;
+			if (int_verify_file(argv[i], &input) != 0) {
+				perror("Error reading input");
+				return 1;
+			}
+			int_digest_merge(&expected, &input.digest);
+		}
+		if (!int_digest_is_equal(&expected, &res.digest)) {
+			printf("Numbers differ from the inputs: %llu of %llu\n",
+			       (unsigned long long)res.digest.count,
+			       (unsigned long long)expected.count);
+			rc = 1;
+		}
+	}
+	if (rc == 0)
+		printf("All is ok, %llu numbers\n",
+		       (unsigned long long)res.digest.count);
+	return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "gen") == 0)
+		return bench_gen_main(argc, argv);
+	if (argc > 1 && strcmp(argv[1], "verify") == 0)
+		return bench_verify_main(argc, argv);
+	struct bench_opts opts = {
+		.count = 100000,
+		.file_count = 6,
+		.sorter = "./main",
+		.work_dir = "/tmp",
+		.results = "bench_suite.tsv",
+	};
+	opts.dist_count = bench_parse_dists(
+		"uniform,sorted,reverse,few-unique,zipf,organ-pipe", opts.dists);
+	opts.coro_count = bench_parse_list("1,3,6", opts.coros);
+	opts.latency_count = bench_parse_list("0,1000", opts.latencies);
+	int opt;
+	while ((opt = getopt(argc, argv, "n:f:d:c:l:s:w:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.count = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			opts.file_count = atoi(optarg);
+			break;
+		case 'd':
+			opts.dist_count = bench_parse_dists(optarg, opts.dists);
+			break;
+		case 'c':
+			opts.coro_count = bench_parse_list(optarg, opts.coros);
+			break;
+		case 'l':
+			opts.latency_count = bench_parse_list(optarg,
+							      opts.latencies);
+			break;
+		case 's':
+			opts.sorter = optarg;
+			break;
+		case 'w':
+			opts.work_dir = optarg;
+			break;
+		case 'o':
+			opts.results = optarg;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (opts.file_count <= 0) {
+		fprintf(stderr, "No files to sort\n");
+		return 1;
+	}
+	FILE *results = fopen(opts.results, "w");
+	if (results == NULL) {
+		perror("Error opening results");
+		return 1;
+	}
+	fprintf(results, "dist\tfiles\tnumbers\tcoroutines\tlatency_us\t"
+		"seconds\tnumbers_per_sec\tstatus\tcheck\n");
+	printf("%-10s %5s %10s %5s %8s %9s %12s  %s\n", "dist", "files",
+	       "numbers", "coros", "lat, us", "time, s", "numbers/s", "check");
+	int failed = 0;
+	for (int d = 0; d < opts.dist_count; ++d)
+		failed += bench_dist(&opts, opts.dists[d], results);
+	fclose(results);
+	printf("Results are written to %s\n", opts.results);
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "int_bin.h"
+#include "libcoro.h"
+
+enum {
+	/** Bytes of encoded numbers written at once. */
+	INT_BIN_WRITE_SIZE = 1 << 20,
+	/** Longest varint of a uint32. */
+	INT_BIN_VARINT_MAX = 5,
+	/** Limit of the block size accepted from a file. */
+	INT_BIN_BLOCK_MAX = 1 << 20,
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define INT_BIN_LE 1
+#endif
+
+static const char int_bin_magic[4] = {'I', 'B', 'I', 'N'};
+
+static inline void
+int_bin_store16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void
+int_bin_store32(uint8_t *p, uint32_t v)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = v >> (8 * i);
+}
+
+static inline void
+int_bin_store64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i)
+		p[i] = v >> (8 * i);
+}
+
+static inline uint16_t
+int_bin_load16(const uint8_t *p)
+{
+	return p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline uint32_t
+int_bin_load32(const uint8_t *p)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < 4; ++i)
+		v |= (uint32_t)p[i] << (8 * i);
+	return v;
+}
+
+static inline uint64_t
+int_bin_load64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; ++i)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+/** Write the whole buffer, coro_write() can write only a part. */
+static int
+int_bin_write_all(int fd, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	while (size > 0) {
+		ssize_t n = coro_write(fd, pos, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/** Encode a block of numbers, return the end of the encoded bytes. */
+static uint8_t *
+int_bin_encode_block(uint8_t *out, const int *data, size_t count)
+{
+	uint8_t *pos = out + 4;
+	uint32_t prev = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t delta = (uint32_t)data[i] - prev;
+		prev = data[i];
+		while (delta >= 0x80) {
+			*pos++ = delta | 0x80;
+			delta >>= 7;
+		}
+		*pos++ = delta;
+	}
+	int_bin_store32(out, pos - out - 4);
+	return pos;
+}
+
+/** Write the numbers as int32, converted if the host is big-endian. */
+static int
+int_bin_write_raw(int fd, const int *data, size_t count)
+{
+#ifdef INT_BIN_LE
+	return int_bin_write_all(fd, data, count * sizeof(data[0]));
+#else
+	size_t batch = INT_BIN_WRITE_SIZE / sizeof(data[0]);
+	uint8_t *buf = malloc(INT_BIN_WRITE_SIZE);
+	if (buf == NULL)
+		return -1;
+	int rc = 0;
+	for (size_t i = 0; i < count && rc == 0; i += batch) {
+		size_t n = count - i < batch ? count - i : batch;
+		for (size_t j = 0; j < n; ++j)
+			int_bin_store32(buf + 4 * j, data[i + j]);
+		rc = int_bin_write_all(fd, buf, 4 * n);
+	}
+	free(buf);
+	return rc;
+#endif
+}
+
+static int
+int_bin_write_varint(int fd, const int *data, size_t count)
+{
+	uint8_t *buf = malloc(INT_BIN_WRITE_SIZE);
+	if (buf == NULL)
+		return -1;
+	size_t block_max = 4 + INT_BIN_BLOCK_SIZE * INT_BIN_VARINT_MAX;
+	uint8_t *limit = buf + INT_BIN_WRITE_SIZE - block_max;
+	uint8_t *pos = buf;
+	int rc = 0;
+	for (size_t i = 0; i < count && rc == 0; i += INT_BIN_BLOCK_SIZE) {
+		size_t n = count - i;
+		if (n > INT_BIN_BLOCK_SIZE)
+			n = INT_BIN_BLOCK_SIZE;
+		pos = int_bin_encode_block(pos, data + i, n);
+		if (pos > limit) {
+			rc = int_bin_write_all(fd, buf, pos - buf);
+			pos = buf;
+		}
+		coro_yield_if_expired();
+	}
+	if (rc == 0)
+		rc = int_bin_write_all(fd, buf, pos - buf);
+	free(buf);
+	return rc;
+}
+
+int
+int_bin_write(int fd, const int *data, size_t count,
+	      enum int_bin_format format)
+{
+	uint8_t header[INT_BIN_HEADER_SIZE] = {0};
+	memcpy(header, int_bin_magic, sizeof(int_bin_magic));
+	int_bin_store16(header + 4, INT_BIN_VERSION);
+	int_bin_store16(header + 6, format);
+	int_bin_store32(header + 8, INT_BIN_BLOCK_SIZE);
+	int_bin_store64(header + 16, count);
+	if (int_bin_write_all(fd, header, sizeof(header)) != 0)
+		return -1;
+	if (format == INT_BIN_RAW)
+		return int_bin_write_raw(fd, data, count);
+	return int_bin_write_varint(fd, data, count);
+}
+
+int
+int_bin_reader_open(struct int_bin_reader *r, int fd)
+{
+	memset(r, 0, sizeof(*r));
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -1;
+	size_t size = st.st_size;
+	if (size < INT_BIN_HEADER_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, size, MADV_SEQUENTIAL);
+	r->map = map;
+	r->map_size = size;
+	r->pos = r->map + INT_BIN_HEADER_SIZE;
+	const uint8_t *header = r->map;
+	r->format = int_bin_load16(header + 6);
+	r->block_size = int_bin_load32(header + 8);
+	r->left = int_bin_load64(header + 16);
+	size_t payload_size = size - INT_BIN_HEADER_SIZE;
+	bool is_valid = memcmp(header, int_bin_magic,
+			       sizeof(int_bin_magic)) == 0 &&
+			int_bin_load16(header + 4) == INT_BIN_VERSION;
+	if (is_valid && r->format == INT_BIN_RAW) {
+		is_valid = r->left <= payload_size / sizeof(int) &&
+			   r->left * sizeof(int) == payload_size;
+		r->block_size = INT_BIN_BLOCK_SIZE;
+	} else if (is_valid && r->format == INT_BIN_VARINT) {
+		/* Each number takes at least a byte. */
+		is_valid = r->block_size > 0 &&
+			   r->block_size <= INT_BIN_BLOCK_MAX &&
+			   r->left <= payload_size;
+	} else {
+		is_valid = false;
+	}
+	if (!is_valid) {
+		int_bin_reader_close(r);
+		errno = EINVAL;
+		return -1;
+	}
+#ifdef INT_BIN_LE
+	if (r->format == INT_BIN_RAW)
+		return 0;
+#endif
+	r->buf = malloc(r->block_size * sizeof(r->buf[0]));
+	if (r->buf == NULL) {
+		int_bin_reader_close(r);
+		return -1;
+	}
+	return 0;
+}
+
+void
+int_bin_reader_close(struct int_bin_reader *r)
+{
+	if (r->map != NULL)
+		munmap((void *)r->map, r->map_size);
+	free(r->buf);
+	memset(r, 0, sizeof(*r));
+}
+
+/** Decode a block of @a count numbers into the buffer. */
+static int
+int_bin_decode_block(struct int_bin_reader *r, size_t count)
+{
+	const uint8_t *map_end = r->map + r->map_size;
+	if (map_end - r->pos < 4)
+		return -1;
+	uint32_t size = int_bin_load32(r->pos);
+	const uint8_t *pos = r->pos + 4;
+	if ((size_t)(map_end - pos) < size)
+		return -1;
+	const uint8_t *end = pos + size;
+	uint32_t prev = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (pos == end)
+			return -1;
+		uint32_t delta = *pos++;
+		if (delta >= 0x80) {
+			delta &= 0x7f;
+			int shift = 7;
+			uint8_t byte;
+			do {
+				if (pos == end || shift > 28)
+					return -1;
+				byte = *pos++;
+				/* The 5th byte has only 4 bits of a uint32. */
+				if (shift == 28 && byte > 0x0f)
+					return -1;
+				delta |= (uint32_t)(byte & 0x7f) << shift;
+				shift += 7;
+			} while (byte >= 0x80);
+		}
+		prev += delta;
+		r->buf[i] = prev;
+	}
+	if (pos != end)
+		return -1;
+	r->pos = end;
+	return 0;
+}
+
+int
+int_bin_reader_fill(struct int_bin_reader *r)
+{
+	r->next = 0;
+	r->batch_size = 0;
+	if (r->left == 0)
+		return 0;
+#ifdef INT_BIN_LE
+	if (r->format == INT_BIN_RAW) {
+		r->batch = (const int *)r->pos;
+		r->batch_size = r->left;
+		r->pos += r->left * sizeof(int);
+		r->left = 0;
+		return 1;
+	}
+#endif
+	size_t count = r->left < r->block_size ? r->left : r->block_size;
+	if (r->format == INT_BIN_RAW) {
+		for (size_t i = 0; i < count; ++i)
+			r->buf[i] = int_bin_load32(r->pos + 4 * i);
+		r->pos += 4 * count;
+	} else if (int_bin_decode_block(r, count) != 0) {
+		r->left = 0;
+		errno = EINVAL;
+		return -1;
+	}
+	r->batch = r->buf;
+	r->batch_size = count;
+	r->left -= count;
+	return 1;
+}
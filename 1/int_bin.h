@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Binary files of sorted runs, to pass the numbers from the sort to
+ * the merge without formatting and parsing text. A file is a header
+ * of INT_BIN_HEADER_SIZE bytes and the numbers after it. All fields
+ * are little-endian:
+ *
+ *   0: "IBIN"          magic
+ *   4: uint16          version, INT_BIN_VERSION
+ *   6: uint16          format, enum int_bin_format
+ *   8: uint32          numbers in a block of INT_BIN_VARINT
+ *  12: uint32          reserved, 0
+ *  16: uint64          number count
+ *
+ * INT_BIN_RAW numbers are int32, so a mapped file is an array on
+ * little-endian hosts. INT_BIN_VARINT numbers are cut into blocks,
+ * each is a uint32 byte size and varints of the differences between
+ * the neighbour numbers modulo 2^32, the first one from 0. A sorted
+ * run of dense numbers takes 1-2 bytes per number.
+ */
+
+enum int_bin_format {
+	INT_BIN_RAW = 0,
+	INT_BIN_VARINT = 1,
+};
+
+enum {
+	INT_BIN_HEADER_SIZE = 24,
+	INT_BIN_VERSION = 1,
+	/** Numbers in a compressed block, except the last one. */
+	INT_BIN_BLOCK_SIZE = 4096,
+};
+
+/**
+ * Write the numbers into a file in the given format.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+int_bin_write(int fd, const int *data, size_t count,
+	      enum int_bin_format format);
+
+/** Reader of a mapped binary file. */
+struct int_bin_reader {
+	/** Mapping of the whole file. */
+	const uint8_t *map;
+	size_t map_size;
+	enum int_bin_format format;
+	/** Numbers in a compressed block. */
+	size_t block_size;
+	/** Numbers not in the batches yet. */
+	uint64_t left;
+	/** Next not decoded byte of the mapping. */
+	const uint8_t *pos;
+	/**
+	 * Numbers of the last decoded block. Raw numbers on
+	 * little-endian hosts are used right from the mapping.
+	 */
+	const int *batch;
+	size_t batch_size;
+	/** Index of the next number to return from the batch. */
+	size_t next;
+	/** Memory for decoded blocks. */
+	int *buf;
+};
+
+/**
+ * Map a file and check its header. The descriptor can be closed
+ * after that.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL means not a valid file.
+ */
+int
+int_bin_reader_open(struct int_bin_reader *r, int fd);
+
+/** Unmap the file. */
+void
+int_bin_reader_close(struct int_bin_reader *r);
+
+/** Numbers not returned yet, all of them right after the open. */
+static inline uint64_t
+int_bin_reader_count(const struct int_bin_reader *r)
+{
+	return r->left + r->batch_size - r->next;
+}
+
+/**
+ * Decode the next block into the batch.
+ * @retval 1 The batch is not empty.
+ * @retval 0 No more numbers.
+ * @retval -1 The file is corrupted, errno is EINVAL.
+ */
+int
+int_bin_reader_fill(struct int_bin_reader *r);
+
+/**
+ * Get the next number of the file.
+ * @retval 1 The number is returned in @a value.
+ * @retval 0 No more numbers.
+ * @retval -1 The file is corrupted, errno is EINVAL.
+ */
+static inline int
+int_bin_reader_next(struct int_bin_reader *r, int *value)
+{
+	if (r->next == r->batch_size) {
+		int rc = int_bin_reader_fill(r);
+		if (rc <= 0)
+			return rc;
+	}
+	*value = r->batch[r->next++];
+	return 1;
+}
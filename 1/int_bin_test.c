@@ -0,0 +1,298 @@
+#include "int_bin.h"
+
+#include "unit.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Temporary file with the given bytes. */
+static int
+file_with(const void *data, size_t size)
+{
+	FILE *f = tmpfile();
+	unit_fail_if(f == NULL);
+	int fd = dup(fileno(f));
+	fclose(f);
+	unit_fail_if(fd < 0);
+	unit_fail_if(write(fd, data, size) != (ssize_t)size);
+	return fd;
+}
+
+/** Temporary file with the numbers written by int_bin_write(). */
+static int
+file_with_numbers(const int *data, size_t count, enum int_bin_format format)
+{
+	int fd = file_with(NULL, 0);
+	unit_fail_if(int_bin_write(fd, data, count, format) != 0);
+	return fd;
+}
+
+static void
+store32(uint8_t *p, uint32_t v)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = v >> (8 * i);
+}
+
+/** Header of a file, like int_bin_write() makes. */
+static void
+make_header(uint8_t *header, enum int_bin_format format, uint64_t count)
+{
+	memset(header, 0, INT_BIN_HEADER_SIZE);
+	memcpy(header, "IBIN", 4);
+	header[4] = INT_BIN_VERSION;
+	header[6] = format;
+	store32(header + 8, INT_BIN_BLOCK_SIZE);
+	store32(header + 16, count);
+	store32(header + 20, count >> 32);
+}
+
+/** Read the whole file, check the count on the way. */
+static bool
+is_read_back(int fd, const int *data, size_t count)
+{
+	struct int_bin_reader r;
+	if (int_bin_reader_open(&r, fd) != 0)
+		return false;
+	bool is_ok = int_bin_reader_count(&r) == count;
+	size_t i = 0;
+	int value;
+	int rc = 0;
+	while (is_ok && (rc = int_bin_reader_next(&r, &value)) > 0) {
+		is_ok = i < count && data[i] == value &&
+			int_bin_reader_count(&r) == count - i - 1;
+		++i;
+	}
+	is_ok = is_ok && rc == 0 && i == count;
+	int_bin_reader_close(&r);
+	return is_ok;
+}
+
+/** Decode the whole file and return the result of the last fill. */
+static int
+read_all(int fd)
+{
+	struct int_bin_reader r;
+	int rc = int_bin_reader_open(&r, fd);
+	if (rc != 0)
+		return rc;
+	while ((rc = int_bin_reader_fill(&r)) > 0)
+		;
+	int_bin_reader_close(&r);
+	return rc;
+}
+
+static void
+test_round_trip(void)
+{
+	unit_test_start();
+
+	size_t counts[] = {0, 1, 2, INT_BIN_BLOCK_SIZE - 1, INT_BIN_BLOCK_SIZE,
+			   INT_BIN_BLOCK_SIZE + 1, 3 * INT_BIN_BLOCK_SIZE + 7};
+	size_t max = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+	int *sorted = malloc(max * sizeof(int));
+	int *random = malloc(max * sizeof(int));
+	unit_fail_if(sorted == NULL || random == NULL);
+	srand(1);
+	for (size_t i = 0; i < max; ++i) {
+		sorted[i] = INT_MIN + (int)i * 3;
+		random[i] = rand() - rand();
+	}
+	random[0] = INT_MIN;
+	random[1] = INT_MAX;
+	bool is_ok = true;
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		for (int format = INT_BIN_RAW; format <= INT_BIN_VARINT;
+		     ++format) {
+			int fd = file_with_numbers(sorted, counts[i], format);
+			is_ok = is_ok && is_read_back(fd, sorted, counts[i]);
+			close(fd);
+			fd = file_with_numbers(random, counts[i], format);
+			is_ok = is_ok && is_read_back(fd, random, counts[i]);
+			close(fd);
+			if (!is_ok)
+				unit_msg("count %zu, format %d", counts[i],
+					 format);
+		}
+	}
+	unit_check(is_ok, "round trip");
+	free(random);
+	free(sorted);
+
+	unit_msg("A sorted run of dense numbers is compressed");
+	int dense[1000];
+	for (int i = 0; i < 1000; ++i)
+		dense[i] = 1000000 + i * 10;
+	int fd = file_with_numbers(dense, 1000, INT_BIN_VARINT);
+	off_t size = lseek(fd, 0, SEEK_END);
+	unit_check(size < INT_BIN_HEADER_SIZE + 4 + 1000 + 3,
+		   "a byte per number");
+	close(fd);
+
+	unit_test_finish();
+}
+
+static void
+test_truncated_block(void)
+{
+	unit_test_start();
+
+	int data[INT_BIN_BLOCK_SIZE + 10];
+	for (int i = 0; i < INT_BIN_BLOCK_SIZE + 10; ++i)
+		data[i] = i * 1000;
+	int fd = file_with_numbers(data, INT_BIN_BLOCK_SIZE + 10,
+				   INT_BIN_VARINT);
+	off_t size = lseek(fd, 0, SEEK_END);
+	int first_fd = file_with_numbers(data, INT_BIN_BLOCK_SIZE,
+					 INT_BIN_VARINT);
+	off_t last_block = lseek(first_fd, 0, SEEK_END);
+	close(first_fd);
+	/*
+	 * Cut the last byte, all of the last block but a part of its
+	 * size, and all of it.
+	 */
+	off_t cuts[] = {size - 1, last_block + 2, last_block};
+	for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); ++i) {
+		unit_fail_if(ftruncate(fd, cuts[i]) != 0);
+		errno = 0;
+		unit_check(read_all(fd) == -1 && errno == EINVAL,
+			   "truncated varint file");
+	}
+	close(fd);
+
+	fd = file_with_numbers(data, 10, INT_BIN_RAW);
+	unit_fail_if(ftruncate(fd, INT_BIN_HEADER_SIZE + 10 * 4 - 1) != 0);
+	errno = 0;
+	unit_check(read_all(fd) == -1 && errno == EINVAL, "truncated raw file");
+	close(fd);
+
+	unit_msg("A block longer than its numbers");
+	uint8_t file[INT_BIN_HEADER_SIZE + 4 + 3];
+	make_header(file, INT_BIN_VARINT, 2);
+	store32(file + INT_BIN_HEADER_SIZE, 3);
+	memcpy(file + INT_BIN_HEADER_SIZE + 4, "\x01\x01\x01", 3);
+	fd = file_with(file, sizeof(file));
+	errno = 0;
+	unit_check(read_all(fd) == -1 && errno == EINVAL, "extra bytes");
+	close(fd);
+
+	unit_test_finish();
+}
+
+static void
+test_oversized_varint(void)
+{
+	unit_test_start();
+
+	uint8_t file[INT_BIN_HEADER_SIZE + 4 + 6];
+	make_header(file, INT_BIN_VARINT, 1);
+	store32(file + INT_BIN_HEADER_SIZE, 5);
+	uint8_t *block = file + INT_BIN_HEADER_SIZE + 4;
+
+	memcpy(block, "\xff\xff\xff\xff\x0f", 5);
+	int fd = file_with(file, INT_BIN_HEADER_SIZE + 4 + 5);
+	struct int_bin_reader r;
+	unit_fail_if(int_bin_reader_open(&r, fd) != 0);
+	int value;
+	unit_check(int_bin_reader_next(&r, &value) == 1 && value == -1,
+		   "the longest valid varint");
+	int_bin_reader_close(&r);
+	close(fd);
+
+	memcpy(block, "\xff\xff\xff\xff\x10", 5);
+	fd = file_with(file, INT_BIN_HEADER_SIZE + 4 + 5);
+	errno = 0;
+	unit_check(read_all(fd) == -1 && errno == EINVAL,
+		   "varint out of uint32");
+	close(fd);
+
+	store32(file + INT_BIN_HEADER_SIZE, 6);
+	memcpy(block, "\x80\x80\x80\x80\x80\x00", 6);
+	fd = file_with(file, sizeof(file));
+	errno = 0;
+	unit_check(read_all(fd) == -1 && errno == EINVAL,
+		   "varint of 6 bytes");
+	close(fd);
+
+	store32(file + INT_BIN_HEADER_SIZE, 2);
+	memcpy(block, "\x80\x80", 2);
+	fd = file_with(file, INT_BIN_HEADER_SIZE + 4 + 2);
+	errno = 0;
+	unit_check(read_all(fd) == -1 && errno == EINVAL,
+		   "varint cut by the block end");
+	close(fd);
+
+	unit_test_finish();
+}
+
+/** Check that the file with the header is not opened. */
+static bool
+is_rejected(const uint8_t *header, size_t size)
+{
+	int fd = file_with(header, size);
+	struct int_bin_reader r;
+	errno = 0;
+	bool is_ok = int_bin_reader_open(&r, fd) == -1 && errno == EINVAL;
+	close(fd);
+	return is_ok;
+}
+
+static void
+test_bad_header(void)
+{
+	unit_test_start();
+
+	uint8_t file[INT_BIN_HEADER_SIZE + 4 + 1];
+	make_header(file, INT_BIN_VARINT, 1);
+	store32(file + INT_BIN_HEADER_SIZE, 1);
+	file[INT_BIN_HEADER_SIZE + 4] = 5;
+	int fd = file_with(file, sizeof(file));
+	unit_check(read_all(fd) == 0, "valid file");
+	close(fd);
+
+	unit_check(is_rejected(file, INT_BIN_HEADER_SIZE - 1), "short file");
+	unit_check(is_rejected(file, 0), "empty file");
+
+	file[0] = 'X';
+	unit_check(is_rejected(file, sizeof(file)), "bad magic");
+	make_header(file, INT_BIN_VARINT, 1);
+
+	file[4] = INT_BIN_VERSION + 1;
+	unit_check(is_rejected(file, sizeof(file)), "bad version");
+	make_header(file, INT_BIN_VARINT, 1);
+
+	file[6] = 7;
+	unit_check(is_rejected(file, sizeof(file)), "bad format");
+	make_header(file, INT_BIN_VARINT, 1);
+
+	store32(file + 8, 0);
+	unit_check(is_rejected(file, sizeof(file)), "zero block size");
+	store32(file + 8, UINT32_MAX);
+	unit_check(is_rejected(file, sizeof(file)), "huge block size");
+
+	make_header(file, INT_BIN_VARINT, sizeof(file));
+	unit_check(is_rejected(file, sizeof(file)),
+		   "more numbers than bytes");
+	make_header(file, INT_BIN_VARINT, UINT64_MAX);
+	unit_check(is_rejected(file, sizeof(file)), "huge count");
+
+	uint8_t raw[INT_BIN_HEADER_SIZE + 8];
+	make_header(raw, INT_BIN_RAW, 1);
+	unit_check(is_rejected(raw, sizeof(raw)), "raw size mismatch");
+	make_header(raw, INT_BIN_RAW, UINT64_MAX / 2 + 2);
+	unit_check(is_rejected(raw, sizeof(raw)), "raw count overflow");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	test_round_trip();
+	test_truncated_block();
+	test_oversized_varint();
+	test_bad_header();
+	return 0;
+}
@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "int_ext_sort.h"
+#include "int_io.h"
+#include "int_merge.h"
+
+enum {
+	/** Text buffers used while cutting a file into runs. */
+	INT_EXT_SPLIT_BUFFER_SIZE = 64 * 1024,
+	/** Merge buffers are not smaller, even if the memory is tight. */
+	INT_EXT_MERGE_BUFFER_MIN = 4 * 1024,
+	INT_EXT_MERGE_BUFFER_MAX = 1024 * 1024,
+	INT_EXT_RUN_MIN = 4096,
+};
+
+void
+int_run_list_create(struct int_run_list *list)
+{
+	list->paths = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
+
+void
+int_run_list_destroy(struct int_run_list *list)
+{
+	for (int i = 0; i < list->count; ++i) {
+		unlink(list->paths[i]);
+		free(list->paths[i]);
+	}
+	free(list->paths);
+}
+
+static int
+int_run_list_reserve(struct int_run_list *list, int count)
+{
+	if (list->count + count <= list->capacity)
+		return 0;
+	int capacity = list->capacity == 0 ? 16 : list->capacity;
+	while (capacity < list->count + count)
+		capacity *= 2;
+	char **paths = realloc(list->paths, capacity * sizeof(paths[0]));
+	if (paths == NULL)
+		return -1;
+	list->paths = paths;
+	list->capacity = capacity;
+	return 0;
+}
+
+int
+int_run_list_move(struct int_run_list *dst, struct int_run_list *src)
+{
+	if (src->count == 0)
+		return 0;
+	if (int_run_list_reserve(dst, src->count) != 0)
+		return -1;
+	memcpy(dst->paths + dst->count, src->paths,
+	       src->count * sizeof(src->paths[0]));
+	dst->count += src->count;
+	src->count = 0;
+	return 0;
+}
+
+int
+int_run_list_add(struct int_run_list *list, const char *tmp_dir)
+{
+	if (int_run_list_reserve(list, 1) != 0)
+		return -1;
+	size_t size = strlen(tmp_dir) + sizeof("/sort_run.XXXXXX");
+	char *path = malloc(size);
+	if (path == NULL)
+		return -1;
+	snprintf(path, size, "%s/sort_run.XXXXXX", tmp_dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		free(path);
+		return -1;
+	}
+	list->paths[list->count++] = path;
+	return fd;
+}
+
+/** Text buffers of a split: the reader takes 3 of them, the writer 1. */
+static const size_t int_ext_split_buffers = 4 * INT_EXT_SPLIT_BUFFER_SIZE;
+
+size_t
+int_ext_split_mem_min(void)
+{
+	return int_ext_split_buffers + INT_EXT_RUN_MIN * 2 * sizeof(int);
+}
+
+size_t
+int_ext_merge_mem_min(int fan_in)
+{
+	if (fan_in < 2)
+		fan_in = 2;
+	return (3 * fan_in + 1) * (size_t)INT_EXT_MERGE_BUFFER_MIN;
+}
+
+size_t
+int_ext_run_size(size_t mem_limit)
+{
+	size_t buffers = int_ext_split_buffers;
+	size_t run_size = 0;
+	if (mem_limit > buffers)
+		run_size = (mem_limit - buffers) / (2 * sizeof(int));
+	return run_size < INT_EXT_RUN_MIN ? INT_EXT_RUN_MIN : run_size;
+}
+
+/** Save sorted numbers into a new run. */
+static int
+int_ext_spill(const int *data, size_t count, const char *tmp_dir,
+	      struct int_run_list *runs, struct int_ext_stats *stats)
+{
+	int fd = int_run_list_add(runs, tmp_dir);
+	if (fd < 0)
+		return -1;
+	struct int_writer w;
+	if (int_writer_create(&w, fd, INT_EXT_SPLIT_BUFFER_SIZE) != 0) {
+		close(fd);
+		return -1;
+	}
+	for (size_t i = 0; i < count; ++i)
+		int_writer_push(&w, data[i]);
+	int rc = int_writer_flush(&w);
+	stats->written_size += w.written_size;
+	int_writer_destroy(&w);
+	if (close(fd) != 0)
+		rc = -1;
+	return rc;
+}
+
+int
+int_ext_split(int fd, size_t run_size, int_sort_f sort, size_t unit,
+	      const char *tmp_dir, struct int_run_list *runs,
+	      struct int_ext_stats *stats)
+{
+	int *data = malloc(run_size * sizeof(int));
+	int *scratch = malloc(run_size * sizeof(int));
+	struct int_reader r;
+	if (data == NULL || scratch == NULL ||
+	    int_reader_create(&r, fd, INT_EXT_SPLIT_BUFFER_SIZE) != 0) {
+		free(data);
+		free(scratch);
+		return -1;
+	}
+	int rc = 0;
+	while (true) {
+		ssize_t count = int_reader_read(&r, data, run_size);
+		if (count <= 0) {
+			rc = count;
+			break;
+		}
+		sort(data, count, scratch, unit);
+		rc = int_ext_spill(data, count, tmp_dir, runs, stats);
+		if (rc != 0 || (size_t)count < run_size)
+			break;
+	}
+	stats->read_size += r.read_size;
+	int_reader_destroy(&r);
+	free(data);
+	free(scratch);
+	return rc;
+}
+
+/** Merge the files into @a out_fd. */
+static int
+int_ext_merge_files(char **paths, int count, size_t buf_size, int out_fd,
+		    struct int_ext_stats *stats)
+{
+	struct int_reader *readers = malloc(count * sizeof(readers[0]));
+	if (readers == NULL)
+		return -1;
+	int rc = -1;
+	int opened = 0;
+	for (; opened < count; ++opened) {
+		int fd = open(paths[opened], O_RDONLY);
+		if (fd < 0)
+			goto out;
+		if (int_reader_create(&readers[opened], fd, buf_size) != 0) {
+			close(fd);
+			goto out;
+		}
+	}
+	struct int_writer w;
+	if (int_writer_create(&w, out_fd, buf_size) == 0) {
+		rc = int_merge(readers, count, &w);
+		stats->written_size += w.written_size;
+		int_writer_destroy(&w);
+	}
+out:
+	for (int i = 0; i < opened; ++i) {
+		stats->read_size += readers[i].read_size;
+		close(readers[i].fd);
+		int_reader_destroy(&readers[i]);
+	}
+	free(readers);
+	return rc;
+}
+
+/** Merge each @a fan_in runs into one. */
+static int
+int_ext_merge_pass(struct int_run_list *runs, int fan_in, size_t buf_size,
+		   const char *tmp_dir, struct int_ext_stats *stats)
+{
+	struct int_run_list next;
+	int_run_list_create(&next);
+	int done = 0;
+	while (done < runs->count) {
+		int count = runs->count - done;
+		if (count > fan_in)
+			count = fan_in;
+		char **paths = runs->paths + done;
+		/* A lone run goes to the next pass as is. */
+		if (count == 1) {
+			if (int_run_list_reserve(&next, 1) != 0)
+				break;
+			next.paths[next.count++] = paths[0];
+			++done;
+			continue;
+		}
+		int fd = int_run_list_add(&next, tmp_dir);
+		if (fd < 0)
+			break;
+		int rc = int_ext_merge_files(paths, count, buf_size, fd, stats);
+		if (close(fd) != 0)
+			rc = -1;
+		if (rc != 0)
+			break;
+		for (int i = 0; i < count; ++i) {
+			unlink(paths[i]);
+			free(paths[i]);
+		}
+		done += count;
+	}
+	if (done == runs->count) {
+		free(runs->paths);
+		*runs = next;
+		return 0;
+	}
+	/* On error all the runs are kept in the list to be removed. */
+	int err = errno;
+	memmove(runs->paths, runs->paths + done,
+		(runs->count - done) * sizeof(runs->paths[0]));
+	runs->count -= done;
+	int_run_list_move(runs, &next);
+	int_run_list_destroy(&next);
+	errno = err;
+	return -1;
+}
+
+int
+int_ext_merge(struct int_run_list *runs, int fan_in, size_t mem_limit,
+	      const char *tmp_dir, int out_fd, struct int_ext_stats *stats)
+{
+	if (fan_in < 2)
+		fan_in = 2;
+	/* Readers of all the merged runs and the writer fit the limit. */
+	size_t buf_size = mem_limit / (3 * fan_in + 1);
+	if (buf_size < INT_EXT_MERGE_BUFFER_MIN)
+		buf_size = INT_EXT_MERGE_BUFFER_MIN;
+	if (buf_size > INT_EXT_MERGE_BUFFER_MAX)
+		buf_size = INT_EXT_MERGE_BUFFER_MAX;
+	while (runs->count > fan_in) {
+		if (int_ext_merge_pass(runs, fan_in, buf_size, tmp_dir,
+				       stats) != 0)
+			return -1;
+		++stats->merge_pass_count;
+	}
+	int rc = int_ext_merge_files(runs->paths, runs->count, buf_size,
+				     out_fd, stats);
+	++stats->merge_pass_count;
+	if (rc != 0)
+		return -1;
+	for (int i = 0; i < runs->count; ++i) {
+		unlink(runs->paths[i]);
+		free(runs->paths[i]);
+	}
+	runs->count = 0;
+	return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include "int_sort.h"
+
+/**
+ * External sort of files bigger than the memory. A file is cut into
+ * runs which fit the memory budget, each run is sorted and spilled
+ * into a temporary file. Then the runs are merged by passes, each
+ * merging at most fan-in runs at once, until one is left.
+ *
+ * A reader of a text file costs about 3 buffers of memory: the text
+ * and the parsed numbers, a writer costs one buffer.
+ */
+
+/** Sorted runs in temporary files. */
+struct int_run_list {
+	char **paths;
+	int count;
+	int capacity;
+};
+
+void
+int_run_list_create(struct int_run_list *list);
+
+/** Remove the run files and free the list. */
+void
+int_run_list_destroy(struct int_run_list *list);
+
+/**
+ * Create a new temporary run file in @a tmp_dir and add it to the
+ * list.
+ * @retval >= 0 Descriptor of the file, open for writing.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_run_list_add(struct int_run_list *list, const char *tmp_dir);
+
+/**
+ * Move all the runs of @a src to the end of @a dst.
+ * @retval 0 Success.
+ * @retval -1 Out of memory, nothing is moved.
+ */
+int
+int_run_list_move(struct int_run_list *dst, struct int_run_list *src);
+
+/** Work done by an external sort. */
+struct int_ext_stats {
+	/** Passes over the data made by the merge. */
+	int merge_pass_count;
+	/** Bytes read from all the files, including the runs. */
+	size_t read_size;
+	/** Bytes written into all the files, including the runs. */
+	size_t written_size;
+};
+
+/**
+ * How many numbers a run can have so that cutting a file into runs
+ * fits @a mem_limit bytes. The run and the sort scratch take 2 ints
+ * per number. Never less than a few thousand numbers.
+ */
+size_t
+int_ext_run_size(size_t mem_limit);
+
+/**
+ * The least memory a split takes: the text buffers and the shortest
+ * run. A smaller limit is exceeded.
+ */
+size_t
+int_ext_split_mem_min(void);
+
+/**
+ * The least memory a merge of @a fan_in runs takes with the smallest
+ * buffers. A smaller limit is exceeded.
+ */
+size_t
+int_ext_merge_mem_min(int fan_in);
+
+/**
+ * Cut a file into runs of @a run_size numbers, sort each run by
+ * @a sort and save into a new temporary file in @a tmp_dir.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. The runs saved so far are left in
+ *         the list.
+ */
+int
+int_ext_split(int fd, size_t run_size, int_sort_f sort, size_t unit,
+	      const char *tmp_dir, struct int_run_list *runs,
+	      struct int_ext_stats *stats);
+
+/**
+ * Merge the runs into @a out_fd. While there are more than @a fan_in
+ * runs, groups of @a fan_in runs are merged into new temporary runs.
+ * The buffers of the merge fit into @a mem_limit bytes. The merged
+ * runs are removed from the list and from the disk.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_ext_merge(struct int_run_list *runs, int fan_in, size_t mem_limit,
+	      const char *tmp_dir, int out_fd, struct int_ext_stats *stats);
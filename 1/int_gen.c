@@ -0,0 +1,145 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "int_gen.h"
+#include "int_io.h"
+#include "int_verify.h"
+
+enum {
+	/** Distinct values of INT_GEN_FEW_UNIQUE. */
+	INT_GEN_FEW_COUNT = 16,
+	/** Distinct values of INT_GEN_ZIPF. */
+	INT_GEN_ZIPF_COUNT = 65536,
+};
+
+static const char *const int_gen_dist_names[INT_GEN_DIST_COUNT] = {
+	"uniform", "sorted", "reverse", "few-unique", "zipf", "organ-pipe",
+};
+
+const char *
+int_gen_dist_name(enum int_gen_dist dist)
+{
+	return int_gen_dist_names[dist];
+}
+
+int
+int_gen_dist_by_name(const char *name)
+{
+	for (int i = 0; i < INT_GEN_DIST_COUNT; ++i) {
+		if (strcmp(name, int_gen_dist_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/** splitmix64 generator. */
+static inline uint64_t
+int_gen_next(uint64_t *state)
+{
+	*state += 0x9e3779b97f4a7c15ULL;
+	uint64_t x = *state;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline int
+int_gen_uniform(uint64_t *state)
+{
+	return int_gen_next(state) & INT_MAX;
+}
+
+/** Value number @a i of @a count spread evenly over the int range. */
+static inline int
+int_gen_spread(size_t i, size_t count)
+{
+	return (int)((uint64_t)i * INT_MAX / (count > 1 ? count - 1 : 1));
+}
+
+/**
+ * Cumulative probabilities of the Zipf ranks, scaled to 2^53 to be
+ * searched with uniform 53-bit numbers.
+ */
+static uint64_t *
+int_gen_zipf_create(void)
+{
+	uint64_t *cdf = malloc(INT_GEN_ZIPF_COUNT * sizeof(cdf[0]));
+	if (cdf == NULL)
+		return NULL;
+	double total = 0;
+	for (int i = 0; i < INT_GEN_ZIPF_COUNT; ++i)
+		total += 1.0 / (i + 1);
+	double sum = 0;
+	for (int i = 0; i < INT_GEN_ZIPF_COUNT; ++i) {
+		sum += 1.0 / (i + 1);
+		cdf[i] = (uint64_t)(sum / total * (double)((uint64_t)1 << 53));
+	}
+	cdf[INT_GEN_ZIPF_COUNT - 1] = (uint64_t)1 << 53;
+	return cdf;
+}
+
+static inline int
+int_gen_zipf(const uint64_t *cdf, uint64_t *state)
+{
+	uint64_t u = int_gen_next(state) >> 11;
+	int lo = 0, hi = INT_GEN_ZIPF_COUNT - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (cdf[mid] > u)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	/* Frequent values are scattered, not the smallest ones. */
+	return int_digest_mix(lo) & INT_MAX;
+}
+
+int
+int_gen_write(int fd, enum int_gen_dist dist, size_t count, uint64_t seed,
+	      struct int_digest *digest)
+{
+	struct int_writer w;
+	if (int_writer_create(&w, fd, 0) != 0)
+		return -1;
+	uint64_t state = seed;
+	int few[INT_GEN_FEW_COUNT];
+	for (int i = 0; i < INT_GEN_FEW_COUNT; ++i)
+		few[i] = int_gen_uniform(&state);
+	uint64_t *cdf = NULL;
+	if (dist == INT_GEN_ZIPF && (cdf = int_gen_zipf_create()) == NULL) {
+		int_writer_destroy(&w);
+		return -1;
+	}
+	size_t half = (count + 1) / 2;
+	for (size_t i = 0; i < count; ++i) {
+		int value;
+		switch (dist) {
+		case INT_GEN_SORTED:
+			value = int_gen_spread(i, count);
+			break;
+		case INT_GEN_REVERSE:
+			value = int_gen_spread(count - 1 - i, count);
+			break;
+		case INT_GEN_FEW_UNIQUE:
+			value = few[int_gen_next(&state) % INT_GEN_FEW_COUNT];
+			break;
+		case INT_GEN_ZIPF:
+			value = int_gen_zipf(cdf, &state);
+			break;
+		case INT_GEN_ORGAN_PIPE:
+			value = int_gen_spread(i < half ? i : count - 1 - i,
+					       half);
+			break;
+		default:
+			value = int_gen_uniform(&state);
+			break;
+		}
+		int_writer_push(&w, value);
+		if (digest != NULL)
+			int_digest_add(digest, value);
+	}
+	free(cdf);
+	int rc = int_writer_flush(&w);
+	int_writer_destroy(&w);
+	return rc;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct int_digest;
+
+/**
+ * Synthetic inputs for the sort benchmarks. The numbers are made and
+ * written as a stream, so a file of any size takes a constant amount
+ * of memory. The same seed gives the same numbers.
+ */
+
+enum int_gen_dist {
+	/** Uniform in the whole non-negative int range. */
+	INT_GEN_UNIFORM,
+	/** Not decreasing. */
+	INT_GEN_SORTED,
+	/** Not increasing. */
+	INT_GEN_REVERSE,
+	/** Uniform over 16 distinct values. */
+	INT_GEN_FEW_UNIQUE,
+	/**
+	 * Zipf with the exponent 1 over 65536 distinct values: the
+	 * most frequent value is about 1/12 of all the numbers.
+	 */
+	INT_GEN_ZIPF,
+	/** Growing in the first half, and falling in the second. */
+	INT_GEN_ORGAN_PIPE,
+	INT_GEN_DIST_COUNT,
+};
+
+/** Name of a distribution, like "few-unique". */
+const char *
+int_gen_dist_name(enum int_gen_dist dist);
+
+/** Distribution by its name, or -1 if there is no such. */
+int
+int_gen_dist_by_name(const char *name);
+
+/**
+ * Write @a count numbers of a distribution into a file as text. The
+ * digest of the numbers is added to @a digest, if it is not NULL.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_gen_write(int fd, enum int_gen_dist dist, size_t count, uint64_t seed,
+	      struct int_digest *digest);
@@ -0,0 +1,545 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "int_io.h"
+#include "libcoro.h"
+
+enum {
+	/** Bytes read from a file at once. */
+	INT_IO_CHUNK_SIZE = 1 << 20,
+	/**
+	 * Zeros after the data in the read buffer, so the digit
+	 * scanner can look past the last number.
+	 */
+	INT_IO_PADDING = INT_PARSER_PADDING,
+	/** Bytes of formatted text written at once. */
+	INT_IO_WRITE_SIZE = 1 << 20,
+	/** Maximal length of a formatted int with a space after it. */
+	INT_IO_NUMBER_MAX = 12,
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define INT_IO_SWAR 1
+#endif
+
+void
+int_array_create(struct int_array *arr)
+{
+	arr->data = NULL;
+	arr->size = 0;
+	arr->capacity = 0;
+}
+
+void
+int_array_destroy(struct int_array *arr)
+{
+	free(arr->data);
+}
+
+/**
+ * Make sure there is space for @a count more numbers.
+ * @retval 0 Success.
+ * @retval -1 Out of memory, the array is not changed.
+ */
+static int
+int_array_reserve(struct int_array *arr, size_t count)
+{
+	if (arr->size + count <= arr->capacity)
+		return 0;
+	size_t capacity = arr->capacity == 0 ? 1024 : arr->capacity;
+	while (capacity < arr->size + count)
+		capacity *= 2;
+	int *data = realloc(arr->data, capacity * sizeof(arr->data[0]));
+	if (data == NULL)
+		return -1;
+	arr->data = data;
+	arr->capacity = capacity;
+	return 0;
+}
+
+int
+int_array_push(struct int_array *arr, int value)
+{
+	if (int_array_reserve(arr, 1) != 0)
+		return -1;
+	arr->data[arr->size++] = value;
+	return 0;
+}
+
+static inline bool
+int_io_is_space(char c)
+{
+	return c == ' ' || (unsigned char)(c - '\t') < 5;
+}
+
+static inline bool
+int_io_is_digit(char c)
+{
+	return (unsigned char)(c - '0') < 10;
+}
+
+/**
+ * Length of the run of digits at @a p, at most 16. The 16 bytes
+ * at @a p must be readable.
+ */
+static inline int
+int_io_digit_count(const char *p)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	/* Digits become 0..9, everything else is bigger as unsigned. */
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)),
+					  d);
+	unsigned mask = ~(unsigned)_mm_movemask_epi8(is_digit);
+	return __builtin_ctz(mask | 0x10000);
+#else
+	int n = 0;
+	while (n < 16 && int_io_is_digit(p[n]))
+		++n;
+	return n;
+#endif
+}
+
+/**
+ * Value of @a len digits at @a p, 1 <= len <= 8. The 8 bytes at
+ * @a p must be readable.
+ */
+static inline uint32_t
+int_io_parse8(const char *p, int len)
+{
+#if defined(INT_IO_SWAR)
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	/*
+	 * The first digit is the lowest byte. The shift drops the bytes
+	 * after the digits, and the missing leading digits become 0.
+	 */
+	v <<= (8 - len) * 8;
+	v &= 0x0F0F0F0F0F0F0F0FULL;
+	/* Combine pairs of digits, then pairs of pairs, and so on. */
+	v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v * 10000 + (v >> 32)) & 0xFFFFFFFFULL;
+	return v;
+#else
+	uint32_t v = 0;
+	for (int i = 0; i < len; ++i)
+		v = v * 10 + (p[i] - '0');
+	return v;
+#endif
+}
+
+/**
+ * Parse whitespace separated numbers in [@a pos, @a end). The
+ * buffer must be readable 16 bytes past @a end. The last number
+ * must be followed by a whitespace, or a not digit at @a end.
+ * @retval Position of the first token which is not a number, or
+ *         @a end.
+ * @retval NULL Out of memory, nothing is parsed.
+ */
+static const char *
+int_io_parse(struct int_array *arr, const char *pos, const char *end)
+{
+	/* Each number takes at least two bytes with a separator. */
+	if (int_array_reserve(arr, (end - pos) / 2 + 1) != 0)
+		return NULL;
+	int *out = arr->data + arr->size;
+	while (true) {
+		while (pos < end && int_io_is_space(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		const char *start = pos;
+		bool is_negative = *pos == '-';
+		if (is_negative || *pos == '+')
+			++pos;
+		int len = int_io_digit_count(pos);
+		if (len == 0) {
+			pos = start;
+			break;
+		}
+		uint64_t value;
+		if (len <= 8) {
+			value = int_io_parse8(pos, len);
+		} else {
+			value = int_io_parse8(pos, len - 8) * 100000000ULL +
+				int_io_parse8(pos + len - 8, 8);
+		}
+		pos += len;
+		/*
+		 * Longer numbers saturate at the long range, like strtol() in
+		 * fscanf(), and are truncated to int after that.
+		 */
+		uint64_t limit = is_negative ? (uint64_t)INT64_MAX + 1 :
+			       INT64_MAX;
+		for (; int_io_is_digit(*pos); ++pos) {
+			if (value > (limit - (*pos - '0')) / 10)
+				value = limit;
+			else
+				value = value * 10 + (*pos - '0');
+		}
+		*out++ = (int)(uint32_t)(is_negative ? -value : value);
+	}
+	arr->size = out - arr->data;
+	return pos;
+}
+
+/**
+ * Read the next chunk of the file and parse the complete numbers
+ * of it into @a arr. The incomplete tail is kept in the reader for
+ * the next call.
+ * @retval 1 Some numbers are parsed, maybe none.
+ * @retval 0 The end of the file or the first not number.
+ * @retval -1 Read error or out of memory.
+ */
+static int
+int_reader_parse_chunk(struct int_reader *r, struct int_array *arr)
+{
+	if (r->is_eof)
+		return 0;
+	while (true) {
+		ssize_t n = coro_read(r->fd, r->buf + r->used,
+				      r->buf_size - r->used);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		r->used += n;
+		r->read_size += n;
+		r->is_eof = n == 0;
+		if (r->is_eof || r->used == r->buf_size)
+			break;
+	}
+	/*
+	 * Only the numbers followed by a separator are complete. The
+	 * tail is parsed with the next chunk.
+	 */
+	size_t cut = r->used;
+	if (r->is_eof) {
+		memset(r->buf + r->used, 0, INT_IO_PADDING);
+	} else {
+		while (cut > 0 && !int_io_is_space(r->buf[cut - 1]))
+			--cut;
+		/* One token is bigger than the buffer - garbage. */
+		if (cut == 0) {
+			r->is_eof = true;
+			return 0;
+		}
+	}
+	const char *end = r->buf + cut;
+	const char *stop = int_io_parse(arr, r->buf, end);
+	if (stop == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (stop != end)
+		r->is_eof = true;
+	memmove(r->buf, r->buf + cut, r->used - cut);
+	r->used -= cut;
+	return 1;
+}
+
+int
+int_reader_create(struct int_reader *r, int fd, size_t buf_size)
+{
+	r->fd = fd;
+	r->buf_size = buf_size == 0 ? INT_IO_CHUNK_SIZE : buf_size;
+	r->buf = malloc(r->buf_size + INT_IO_PADDING);
+	if (r->buf == NULL)
+		return -1;
+	memset(r->buf + r->buf_size, 0, INT_IO_PADDING);
+	r->used = 0;
+	r->is_eof = false;
+	int_array_create(&r->batch);
+	r->next = 0;
+	r->read_size = 0;
+	return 0;
+}
+
+void
+int_reader_destroy(struct int_reader *r)
+{
+	free(r->buf);
+	int_array_destroy(&r->batch);
+}
+
+int
+int_reader_fill(struct int_reader *r)
+{
+	r->batch.size = 0;
+	r->next = 0;
+	while (r->batch.size == 0) {
+		int rc = int_reader_parse_chunk(r, &r->batch);
+		if (rc <= 0)
+			return rc;
+		coro_yield_if_expired();
+	}
+	return 1;
+}
+
+ssize_t
+int_reader_read(struct int_reader *r, int *data, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		if (r->next == r->batch.size) {
+			int rc = int_reader_fill(r);
+			if (rc < 0)
+				return -1;
+			if (rc == 0)
+				break;
+		}
+		size_t n = r->batch.size - r->next;
+		if (n > count - done)
+			n = count - done;
+		memcpy(data + done, r->batch.data + r->next, n * sizeof(*data));
+		r->next += n;
+		done += n;
+	}
+	return done;
+}
+
+int
+int_array_load(struct int_array *arr, int fd)
+{
+	struct int_reader r;
+	if (int_reader_create(&r, fd, 0) != 0)
+		return -1;
+	int rc;
+	while ((rc = int_reader_parse_chunk(&r, arr)) > 0)
+		coro_yield_if_expired();
+	int_reader_destroy(&r);
+	return rc;
+}
+
+void
+int_parser_create(struct int_parser *p)
+{
+	p->tail_size = 0;
+	p->is_stopped = false;
+}
+
+/**
+ * Parse the saved tail, which is a whole token now.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+static int
+int_parser_flush_tail(struct int_parser *p, struct int_array *arr)
+{
+	if (p->tail_size == 0)
+		return 0;
+	const char *end = p->tail + p->tail_size;
+	memset(p->tail + p->tail_size, 0, INT_PARSER_PADDING);
+	const char *stop = int_io_parse(arr, p->tail, end);
+	if (stop == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (stop != end)
+		p->is_stopped = true;
+	p->tail_size = 0;
+	return 0;
+}
+
+/** Add bytes to the tail, or stop if the token is too long. */
+static void
+int_parser_append_tail(struct int_parser *p, const char *text, size_t size)
+{
+	if (p->tail_size + size > INT_PARSER_TOKEN_MAX) {
+		p->is_stopped = true;
+		return;
+	}
+	memcpy(p->tail + p->tail_size, text, size);
+	p->tail_size += size;
+}
+
+int
+int_parser_feed(struct int_parser *p, struct int_array *arr,
+		const char *text, size_t size)
+{
+	if (p->is_stopped)
+		return 0;
+	const char *end = text + size;
+	/* The tail is completed by the head of the chunk. */
+	if (p->tail_size > 0) {
+		const char *head_end = text;
+		while (head_end < end && !int_io_is_space(*head_end))
+			++head_end;
+		int_parser_append_tail(p, text, head_end - text);
+		if (head_end == end || p->is_stopped)
+			return 0;
+		if (int_parser_flush_tail(p, arr) != 0)
+			return -1;
+		if (p->is_stopped)
+			return 0;
+		text = head_end;
+	}
+	/* Only the numbers followed by a separator are complete. */
+	const char *cut = end;
+	while (cut > text && !int_io_is_space(cut[-1]))
+		--cut;
+	const char *stop = int_io_parse(arr, text, cut);
+	if (stop == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (stop != cut) {
+		p->is_stopped = true;
+		return 0;
+	}
+	int_parser_append_tail(p, cut, end - cut);
+	return 0;
+}
+
+int
+int_parser_finish(struct int_parser *p, struct int_array *arr)
+{
+	if (p->is_stopped)
+		return 0;
+	return int_parser_flush_tail(p, arr);
+}
+
+/** "00", "01", ..., "99". */
+static const char int_io_digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static inline int
+int_io_decimal_len(uint32_t v)
+{
+	int len = 1;
+	while (true) {
+		if (v < 10)
+			return len;
+		if (v < 100)
+			return len + 1;
+		if (v < 1000)
+			return len + 2;
+		if (v < 10000)
+			return len + 3;
+		v /= 10000;
+		len += 4;
+	}
+}
+
+/**
+ * Format a number with a space after it.
+ * @retval The end of the written text.
+ */
+static inline char *
+int_io_format(char *p, int value)
+{
+	uint32_t v = value;
+	if (value < 0) {
+		*p++ = '-';
+		v = -v;
+	}
+	int len = int_io_decimal_len(v);
+	char *end = p + len;
+	char *out = end;
+	while (v >= 100) {
+		out -= 2;
+		memcpy(out, &int_io_digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		out -= 2;
+		memcpy(out, &int_io_digit_pairs[v * 2], 2);
+	} else {
+		*--out = '0' + v;
+	}
+	*end = ' ';
+	return end + 1;
+}
+
+/** Write the whole buffer, coro_write() can write only a part. */
+static int
+int_io_write_all(int fd, const char *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = coro_write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+int
+int_writer_create(struct int_writer *w, int fd, size_t buf_size)
+{
+	if (buf_size < INT_IO_NUMBER_MAX * 2)
+		buf_size = INT_IO_WRITE_SIZE;
+	w->fd = fd;
+	w->buf = malloc(buf_size);
+	if (w->buf == NULL)
+		return -1;
+	w->pos = w->buf;
+	w->limit = w->buf + buf_size - INT_IO_NUMBER_MAX;
+	w->is_failed = false;
+	w->written_size = 0;
+	return 0;
+}
+
+void
+int_writer_destroy(struct int_writer *w)
+{
+	free(w->buf);
+}
+
+int
+int_writer_flush(struct int_writer *w)
+{
+	size_t size = w->pos - w->buf;
+	if (!w->is_failed) {
+		if (int_io_write_all(w->fd, w->buf, size) != 0)
+			w->is_failed = true;
+		else
+			w->written_size += size;
+	}
+	w->pos = w->buf;
+	coro_yield_if_expired();
+	return w->is_failed ? -1 : 0;
+}
+
+void
+int_writer_push(struct int_writer *w, int value)
+{
+	w->pos = int_io_format(w->pos, value);
+	if (w->pos >= w->limit)
+		int_writer_flush(w);
+}
+
+int
+int_io_write(int fd, const int *data, size_t count)
+{
+	struct int_writer w;
+	if (int_writer_create(&w, fd, 0) != 0)
+		return -1;
+	for (size_t i = 0; i < count; ++i)
+		int_writer_push(&w, data[i]);
+	int rc = int_writer_flush(&w);
+	int_writer_destroy(&w);
+	return rc;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Fast loading and saving of text files with integers separated by
+ * whitespace. The I/O goes through coro_read() and coro_write(), so
+ * inside a coroutine only that coroutine waits for the disk. Outside
+ * of coroutines they work as plain read() and write().
+ */
+
+/** Array of integers growing geometrically. */
+struct int_array {
+	int *data;
+	size_t size;
+	size_t capacity;
+};
+
+void
+int_array_create(struct int_array *arr);
+
+void
+int_array_destroy(struct int_array *arr);
+
+/**
+ * Append a number, growing the array if needed.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int
+int_array_push(struct int_array *arr, int value);
+
+/**
+ * Append all the numbers of a file to the array. Like a loop of
+ * fscanf("%d"), stops on the first token which is not a number.
+ * Numbers out of the int range are truncated, and the ones out of
+ * the long range are clamped to it first, like strtol() does.
+ * @retval 0 Success.
+ * @retval -1 Read error or out of memory, errno is set.
+ */
+int
+int_array_load(struct int_array *arr, int fd);
+
+/** Streaming reader of numbers from a file. */
+struct int_reader {
+	int fd;
+	/** Text read from the file, but not parsed yet. */
+	char *buf;
+	size_t buf_size;
+	size_t used;
+	/** True, if the file has ended, or garbage is met. */
+	bool is_eof;
+	/** Numbers of the last parsed chunk. */
+	struct int_array batch;
+	/** Index of the next number to return from the batch. */
+	size_t next;
+	/** Bytes read from the file so far. */
+	size_t read_size;
+};
+
+/**
+ * Create a reader of a file with @a buf_size bytes of text buffer,
+ * 0 means the default 1 MiB. Memory use doesn't depend on the file
+ * size.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int
+int_reader_create(struct int_reader *r, int fd, size_t buf_size);
+
+void
+int_reader_destroy(struct int_reader *r);
+
+/**
+ * Read and parse the next chunk of the file into the batch.
+ * @retval 1 The batch is not empty.
+ * @retval 0 No more numbers.
+ * @retval -1 Read error or out of memory, errno is set.
+ */
+int
+int_reader_fill(struct int_reader *r);
+
+/**
+ * Get the next number of the file.
+ * @retval 1 The number is returned in @a value.
+ * @retval 0 No more numbers.
+ * @retval -1 Read error or out of memory, errno is set.
+ */
+static inline int
+int_reader_next(struct int_reader *r, int *value)
+{
+	if (r->next == r->batch.size) {
+		int rc = int_reader_fill(r);
+		if (rc <= 0)
+			return rc;
+	}
+	*value = r->batch.data[r->next++];
+	return 1;
+}
+
+/**
+ * Get up to @a count next numbers of the file.
+ * @retval >= 0 Count of the returned numbers, less than @a count
+ *         only at the end of the file.
+ * @retval -1 Read error or out of memory, errno is set.
+ */
+ssize_t
+int_reader_read(struct int_reader *r, int *data, size_t count);
+
+enum {
+	/** Readable bytes needed after the text fed to the parser. */
+	INT_PARSER_PADDING = 32,
+	/** Longer tokens cut by a chunk border are taken for garbage. */
+	INT_PARSER_TOKEN_MAX = 64,
+};
+
+/**
+ * Parser of text which comes in chunks from elsewhere, for example
+ * from another coroutine. A number cut by a chunk border is kept
+ * until the next chunk.
+ */
+struct int_parser {
+	/** Incomplete token from the end of the previous chunk. */
+	char tail[INT_PARSER_TOKEN_MAX + INT_PARSER_PADDING];
+	size_t tail_size;
+	/** True, if garbage is met. The rest of the text is ignored. */
+	bool is_stopped;
+};
+
+void
+int_parser_create(struct int_parser *p);
+
+/**
+ * Append the numbers of the next chunk of text to the array. The
+ * text must have INT_PARSER_PADDING readable bytes after @a size.
+ * @retval 0 Success.
+ * @retval -1 Out of memory, errno is set. The numbers parsed before
+ *         stay in the array.
+ */
+int
+int_parser_feed(struct int_parser *p, struct int_array *arr,
+		const char *text, size_t size);
+
+/**
+ * Append the number cut by the end of the text, if any.
+ * @retval 0 Success.
+ * @retval -1 Out of memory, errno is set.
+ */
+int
+int_parser_finish(struct int_parser *p, struct int_array *arr);
+
+/** Streaming writer of numbers into a file. */
+struct int_writer {
+	int fd;
+	/** Formatted text not written yet. */
+	char *buf;
+	char *pos;
+	/** The buffer is flushed when the position reaches that. */
+	char *limit;
+	/** True, if a write has failed. Next writes are skipped. */
+	bool is_failed;
+	/** Bytes written into the file so far. */
+	size_t written_size;
+};
+
+/**
+ * Create a writer into a file with @a buf_size bytes of text
+ * buffer, 0 means the default 1 MiB.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int
+int_writer_create(struct int_writer *w, int fd, size_t buf_size);
+
+/** Free the writer. Not flushed data is lost. */
+void
+int_writer_destroy(struct int_writer *w);
+
+/** Add a number followed by a space. */
+void
+int_writer_push(struct int_writer *w, int value);
+
+/**
+ * Write the buffered text into the file.
+ * @retval 0 Success, of this and all the previous writes.
+ * @retval -1 Write error, errno is set.
+ */
+int
+int_writer_flush(struct int_writer *w);
+
+/**
+ * Write the numbers into a file as text, each followed by a space,
+ * like fprintf("%d ") does. The text is formatted into big buffers
+ * and written by a few large writes.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+int_io_write(int fd, const int *data, size_t count);
@@ -0,0 +1,302 @@
+#include "int_io.h"
+
+#include "unit.h"
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Numbers of the text the way a loop of fscanf("%d") reads them, to
+ * compare the parser with.
+ */
+static void
+parse_reference(const char *text, struct int_array *arr, bool *is_garbage)
+{
+	int value;
+	int n;
+	while (sscanf(text, "%d%n", &value, &n) == 1) {
+		unit_fail_if(int_array_push(arr, value) != 0);
+		text += n;
+	}
+	while (*text == ' ' || (unsigned char)(*text - '\t') < 5)
+		++text;
+	*is_garbage = *text != 0;
+}
+
+static bool
+is_equal(const struct int_array *a, const struct int_array *b)
+{
+	return a->size == b->size && (a->size == 0 ||
+		memcmp(a->data, b->data, a->size * sizeof(int)) == 0);
+}
+
+/**
+ * Feed the text to the parser in chunks of @a chunk_size bytes. The
+ * padding after each chunk is filled with digits, so the parser
+ * would get wrong numbers if it looked past the chunk.
+ */
+static void
+parse_chunked(const char *text, size_t chunk_size, struct int_array *arr,
+	      bool *is_garbage)
+{
+	char *buf = malloc(chunk_size + INT_PARSER_PADDING);
+	unit_fail_if(buf == NULL);
+	struct int_parser p;
+	int_parser_create(&p);
+	size_t size = strlen(text);
+	for (size_t pos = 0; pos < size; pos += chunk_size) {
+		size_t len = size - pos < chunk_size ? size - pos : chunk_size;
+		memcpy(buf, text + pos, len);
+		memset(buf + len, '7', INT_PARSER_PADDING);
+		unit_fail_if(int_parser_feed(&p, arr, buf, len) != 0);
+	}
+	unit_fail_if(int_parser_finish(&p, arr) != 0);
+	*is_garbage = p.is_stopped;
+	free(buf);
+}
+
+/** Parse the text in chunks of each size and compare with fscanf(). */
+static bool
+is_parsed_like_fscanf(const char *text)
+{
+	struct int_array expected;
+	int_array_create(&expected);
+	bool expected_garbage;
+	parse_reference(text, &expected, &expected_garbage);
+	bool is_ok = true;
+	size_t size = strlen(text);
+	for (size_t chunk_size = 1; chunk_size <= size + 1 && is_ok;
+	     ++chunk_size) {
+		struct int_array arr;
+		int_array_create(&arr);
+		bool is_garbage;
+		parse_chunked(text, chunk_size, &arr, &is_garbage);
+		is_ok = is_equal(&arr, &expected) &&
+			is_garbage == expected_garbage;
+		if (!is_ok)
+			unit_msg("differs in chunks of %zu", chunk_size);
+		int_array_destroy(&arr);
+	}
+	int_array_destroy(&expected);
+	return is_ok;
+}
+
+/** Parse the text at once and return the only number of it. */
+static int
+parse_one(const char *text)
+{
+	struct int_array arr;
+	int_array_create(&arr);
+	bool is_garbage;
+	parse_chunked(text, strlen(text), &arr, &is_garbage);
+	unit_fail_if(arr.size != 1 || is_garbage);
+	int value = arr.data[0];
+	int_array_destroy(&arr);
+	return value;
+}
+
+static void
+test_chunk_borders(void)
+{
+	unit_test_start();
+
+	unit_check(is_parsed_like_fscanf("1 22 333 4444 55555 666666 "
+					 "7777777 88888888 999999999 "
+					 "1234567890"),
+		   "lengths without a separator at the end");
+	unit_check(is_parsed_like_fscanf("12345678 123456789012345 "
+					 "1234567890123456 12345678901234567 "
+					 "\n"), "lengths around 8 and 16");
+	unit_check(is_parsed_like_fscanf("\t1\n\n2\r\n3\v4\f5   6\n"),
+		   "all kinds of whitespace");
+	unit_check(is_parsed_like_fscanf("   \n "), "only whitespace");
+	unit_check(is_parsed_like_fscanf(""), "empty text");
+
+	unit_test_finish();
+}
+
+static void
+test_int_min(void)
+{
+	unit_test_start();
+
+	unit_check(parse_one("-2147483648") == INT_MIN, "INT_MIN");
+	unit_check(parse_one("2147483647") == INT_MAX, "INT_MAX");
+	unit_check(parse_one("-2147483647") == -INT_MAX, "-INT_MAX");
+	unit_check(parse_one("-0000000002147483648") == INT_MIN,
+		   "INT_MIN with leading zeros");
+	unit_check(is_parsed_like_fscanf("-2147483648 2147483647 "
+					 "-2147483648"),
+		   "int limits in chunks");
+
+	unit_test_finish();
+}
+
+static void
+test_signs(void)
+{
+	unit_test_start();
+
+	unit_check(parse_one("+5") == 5, "plus");
+	unit_check(parse_one("-5") == -5, "minus");
+	unit_check(parse_one("-0") == 0, "minus zero");
+	unit_check(parse_one("+0") == 0, "plus zero");
+	unit_check(is_parsed_like_fscanf("+1 -2 +3 -4"), "signs in chunks");
+	unit_check(is_parsed_like_fscanf("1 --2 3"), "double minus");
+	unit_check(is_parsed_like_fscanf("1 +-2 3"), "plus minus");
+	unit_check(is_parsed_like_fscanf("1 - 2"), "detached minus");
+	unit_check(is_parsed_like_fscanf("1 2 -"), "minus at the end");
+	unit_check(is_parsed_like_fscanf("1-2+3"), "signs between numbers");
+
+	unit_test_finish();
+}
+
+static void
+test_garbage(void)
+{
+	unit_test_start();
+
+	unit_check(is_parsed_like_fscanf("1 2 x 3"), "letter token");
+	unit_check(is_parsed_like_fscanf("1 2x 3"), "letter after digits");
+	unit_check(is_parsed_like_fscanf("1 2 3.5 4"), "fraction");
+	unit_check(is_parsed_like_fscanf("x"), "garbage only");
+	unit_check(is_parsed_like_fscanf("1 \xff 2"), "not ASCII");
+	unit_check(is_parsed_like_fscanf("1 2 /"), "byte before '0'");
+	unit_check(is_parsed_like_fscanf("1 2 :"), "byte after '9'");
+
+	unit_msg("Tokens too long for the tail are garbage");
+	char text[INT_PARSER_TOKEN_MAX * 2 + 8] = "1 ";
+	memset(text + 2, '1', INT_PARSER_TOKEN_MAX + 1);
+	strcat(text, " 2");
+	struct int_array arr;
+	int_array_create(&arr);
+	bool is_garbage;
+	parse_chunked(text, 4, &arr, &is_garbage);
+	unit_check(arr.size == 1 && arr.data[0] == 1 && is_garbage,
+		   "long token cut by a border");
+	int_array_destroy(&arr);
+
+	unit_test_finish();
+}
+
+static void
+test_overflow(void)
+{
+	unit_test_start();
+
+	unit_check(parse_one("123456789012345678901234567890") == -1,
+		   "saturated at LONG_MAX");
+	unit_check(parse_one("-123456789012345678901234567890") == 0,
+		   "saturated at LONG_MIN");
+	unit_check(parse_one("2147483648") == INT_MIN, "INT_MAX + 1");
+	unit_check(parse_one("-2147483649") == INT_MAX, "INT_MIN - 1");
+	unit_check(parse_one("4294967296") == 0, "2^32");
+	unit_check(parse_one("4294967295") == -1, "2^32 - 1");
+	unit_check(is_parsed_like_fscanf("9223372036854775807 "
+					 "9223372036854775808 "
+					 "-9223372036854775808 "
+					 "-9223372036854775809 "
+					 "18446744073709551616 "
+					 "99999999999999999999999999 "
+					 "-99999999999999999999999999"),
+		   "long limits in chunks");
+
+	unit_test_finish();
+}
+
+static void
+test_random(void)
+{
+	unit_test_start();
+
+	const char *spaces = " \n\t";
+	const char *garbage = "x.-+/:";
+	char text[1024];
+	srand(1);
+	for (int i = 0; i < 200; ++i) {
+		size_t size = 0;
+		while (size < sizeof(text) - 64) {
+			int sign = rand() % 4;
+			if (sign == 1)
+				text[size++] = '-';
+			else if (sign == 2)
+				text[size++] = '+';
+			int len = 1 + rand() % 24;
+			for (int j = 0; j < len; ++j)
+				text[size++] = '0' + rand() % 10;
+			if (rand() % 100 == 0)
+				text[size++] = garbage[rand() % 6];
+			for (int j = rand() % 3; j >= 0; --j)
+				text[size++] = spaces[rand() % 3];
+		}
+		text[size] = 0;
+		unit_fail_if(!is_parsed_like_fscanf(text));
+	}
+	unit_check(true, "random texts");
+
+	unit_test_finish();
+}
+
+static void
+test_reader(void)
+{
+	unit_test_start();
+
+	const char *text = "-2147483648 1 22 333 4444 55555 666666 "
+			   "123456789012345678901234567890 -17 +8 "
+			   "2147483647 12 x 5";
+	struct int_array expected;
+	int_array_create(&expected);
+	bool is_garbage;
+	parse_reference(text, &expected, &is_garbage);
+
+	FILE *f = tmpfile();
+	unit_fail_if(f == NULL);
+	fputs(text, f);
+	fflush(f);
+	int fd = fileno(f);
+
+	struct int_array arr;
+	int_array_create(&arr);
+	unit_fail_if(lseek(fd, 0, SEEK_SET) != 0);
+	unit_check(int_array_load(&arr, fd) == 0, "load");
+	unit_check(is_equal(&arr, &expected), "loaded numbers");
+	int_array_destroy(&arr);
+
+	/* The tokens are at most 31 bytes, so each fits the buffer. */
+	bool is_ok = true;
+	for (size_t buf_size = 32; buf_size <= 128 && is_ok; ++buf_size) {
+		unit_fail_if(lseek(fd, 0, SEEK_SET) != 0);
+		struct int_reader r;
+		unit_fail_if(int_reader_create(&r, fd, buf_size) != 0);
+		size_t count = 0;
+		int value;
+		int rc;
+		while ((rc = int_reader_next(&r, &value)) > 0) {
+			is_ok = is_ok && count < expected.size &&
+				expected.data[count] == value;
+			++count;
+		}
+		is_ok = is_ok && rc == 0 && count == expected.size;
+		int_reader_destroy(&r);
+	}
+	unit_check(is_ok, "reader with small buffers");
+
+	int_array_destroy(&expected);
+	fclose(f);
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	test_chunk_borders();
+	test_int_min();
+	test_signs();
+	test_garbage();
+	test_overflow();
+	test_random();
+	test_reader();
+	return 0;
+}
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "int_io.h"
+#include "int_bin.h"
+#include "int_merge.h"
+#include "libcoro.h"
+
+enum {
+	/** Numbers to merge between checks of the coroutine quantum. */
+	INT_MERGE_YIELD_UNIT = 4096,
+};
+
+/** Key of an exhausted run, bigger than any int. */
+#define INT_MERGE_KEY_END INT64_MAX
+
+/**
+ * Tournament tree of losers. Leaves are the runs, an inner node
+ * keeps the run which lost the match played in it, and the overall
+ * winner is kept separately. Nodes are numbered like in a heap:
+ * 1 is the root, children of n are 2n and 2n + 1, run i is the leaf
+ * k + i. This works for any k, not only for powers of 2.
+ */
+struct int_loser_tree {
+	int k;
+	/** Inner nodes 1..k-1, node 0 is the winner. */
+	int *nodes;
+	/** Current head of each run. */
+	int64_t *keys;
+};
+
+static int
+int_loser_tree_create(struct int_loser_tree *t, int k)
+{
+	t->k = k;
+	t->nodes = malloc(k * sizeof(t->nodes[0]));
+	t->keys = malloc(k * sizeof(t->keys[0]));
+	if (t->nodes == NULL || t->keys == NULL) {
+		free(t->nodes);
+		free(t->keys);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+int_loser_tree_destroy(struct int_loser_tree *t)
+{
+	free(t->nodes);
+	free(t->keys);
+}
+
+/** Play all the matches once the keys are set. */
+static int
+int_loser_tree_build(struct int_loser_tree *t)
+{
+	int k = t->k;
+	/* Winners of the subtrees, only needed while building. */
+	int *winners = malloc(2 * k * sizeof(winners[0]));
+	if (winners == NULL)
+		return -1;
+	for (int i = 0; i < k; ++i)
+		winners[k + i] = i;
+	for (int n = k - 1; n > 0; --n) {
+		int l = winners[2 * n], r = winners[2 * n + 1];
+		if (t->keys[r] < t->keys[l]) {
+			winners[n] = r;
+			t->nodes[n] = l;
+		} else {
+			winners[n] = l;
+			t->nodes[n] = r;
+		}
+	}
+	/* With one run its leaf is node 1 too. */
+	t->nodes[0] = winners[1];
+	free(winners);
+	return 0;
+}
+
+/** Replay the matches on the path of the winner after its key changes. */
+static inline void
+int_loser_tree_replay(struct int_loser_tree *t)
+{
+	int winner = t->nodes[0];
+	int64_t key = t->keys[winner];
+	for (int n = (winner + t->k) / 2; n > 0; n /= 2) {
+		int other = t->nodes[n];
+		if (t->keys[other] < key) {
+			t->nodes[n] = winner;
+			winner = other;
+			key = t->keys[other];
+		}
+	}
+	t->nodes[0] = winner;
+}
+
+/**
+ * Read the next head of run @a i into its key, INT_MERGE_KEY_END when
+ * the run is exhausted.
+ * @retval 0 Success.
+ * @retval -1 Read error.
+ */
+typedef int (*int_merge_advance_f)(struct int_loser_tree *t, void *runs,
+				   int i);
+
+/**
+ * Merge the runs, reading their heads with @a advance, which is the
+ * only part that depends on the kind of the runs. Inlined into each
+ * merge, so the call of @a advance is direct.
+ */
+static inline int
+int_merge_runs(void *runs, int run_count, int_merge_advance_f advance,
+	       struct int_writer *out)
+{
+	if (run_count == 0)
+		return int_writer_flush(out);
+	struct int_loser_tree t;
+	if (int_loser_tree_create(&t, run_count) != 0)
+		return -1;
+	int rc = 0;
+	for (int i = 0; i < run_count && rc == 0; ++i)
+		rc = advance(&t, runs, i);
+	if (rc == 0)
+		rc = int_loser_tree_build(&t);
+	int work = 0;
+	while (rc == 0) {
+		int winner = t.nodes[0];
+		int64_t key = t.keys[winner];
+		if (key == INT_MERGE_KEY_END)
+			break;
+		int_writer_push(out, (int)key);
+		rc = advance(&t, runs, winner);
+		int_loser_tree_replay(&t);
+		if (++work == INT_MERGE_YIELD_UNIT) {
+			work = 0;
+			coro_yield_if_expired();
+		}
+	}
+	int_loser_tree_destroy(&t);
+	if (int_writer_flush(out) != 0)
+		rc = -1;
+	return rc;
+}
+
+static inline int
+int_merge_advance(struct int_loser_tree *t, void *runs, int i)
+{
+	struct int_reader *r = (struct int_reader *)runs + i;
+	int value;
+	int rc = int_reader_next(r, &value);
+	t->keys[i] = rc > 0 ? value : INT_MERGE_KEY_END;
+	return rc < 0 ? -1 : 0;
+}
+
+int
+int_merge(struct int_reader *runs, int run_count, struct int_writer *out)
+{
+	return int_merge_runs(runs, run_count, int_merge_advance, out);
+}
+
+/** Sorted arrays to merge, and the next index in each. */
+struct int_merge_arrays {
+	const int *const *runs;
+	const size_t *sizes;
+	size_t *next;
+};
+
+static inline int
+int_merge_arrays_advance(struct int_loser_tree *t, void *runs, int i)
+{
+	struct int_merge_arrays *arrays = runs;
+	size_t pos = arrays->next[i]++;
+	t->keys[i] = pos < arrays->sizes[i] ? arrays->runs[i][pos] :
+		     INT_MERGE_KEY_END;
+	return 0;
+}
+
+int
+int_merge_arrays(const int *const *runs, const size_t *sizes, int run_count,
+		 struct int_writer *out)
+{
+	struct int_merge_arrays arrays = {
+		.runs = runs,
+		.sizes = sizes,
+		.next = calloc(run_count, sizeof(arrays.next[0])),
+	};
+	if (arrays.next == NULL && run_count > 0)
+		return -1;
+	int rc = int_merge_runs(&arrays, run_count, int_merge_arrays_advance,
+				out);
+	free(arrays.next);
+	return rc;
+}
+
+static inline int
+int_merge_bin_advance(struct int_loser_tree *t, void *runs, int i)
+{
+	struct int_bin_reader *r = (struct int_bin_reader *)runs + i;
+	int value;
+	int rc = int_bin_reader_next(r, &value);
+	t->keys[i] = rc > 0 ? value : INT_MERGE_KEY_END;
+	return rc < 0 ? -1 : 0;
+}
+
+int
+int_merge_bin(struct int_bin_reader *runs, int run_count,
+	      struct int_writer *out)
+{
+	return int_merge_runs(runs, run_count, int_merge_bin_advance, out);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+struct int_bin_reader;
+struct int_reader;
+struct int_writer;
+
+/**
+ * Merge sorted runs into one sorted stream. The minimum is picked
+ * with a tournament tree of losers, so each number costs log2(k)
+ * comparisons for k runs. Memory use is only the reader and writer
+ * buffers, it does not depend on the run sizes.
+ * @retval 0 Success.
+ * @retval -1 Read or write error, errno is set.
+ */
+int
+int_merge(struct int_reader *runs, int run_count, struct int_writer *out);
+
+/**
+ * Same as int_merge(), but the runs are sorted arrays in memory, for
+ * example shared with the processes which have sorted them.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+int_merge_arrays(const int *const *runs, const size_t *sizes, int run_count,
+		 struct int_writer *out);
+
+/**
+ * Same as int_merge(), but the runs are binary files. Raw runs are
+ * merged right from their mappings, without copying.
+ * @retval 0 Success.
+ * @retval -1 Write error or a corrupted run, errno is set.
+ */
+int
+int_merge_bin(struct int_bin_reader *runs, int run_count,
+	      struct int_writer *out);
@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "int_io.h"
+#include "int_merge.h"
+#include "int_par_sort.h"
+#include "libcoro.h"
+
+enum {
+	/** Enough to overlap reading of a file with sorting another. */
+	INT_PAR_SORT_CORO_COUNT = 4,
+};
+
+/**
+ * A file to sort. The jobs live in shared memory, so the results of
+ * a worker process are seen by the parent after it exits.
+ */
+struct int_par_sort_job {
+	const char *path;
+	/** Shared memory for the numbers. */
+	int *data;
+	/** Size of the file, and so an upper bound of the numbers. */
+	size_t file_size;
+	size_t capacity;
+	size_t map_size;
+	/** Worker sorting the file. */
+	int worker;
+	/** How to sort. */
+	const struct int_par_sort_opts *opts;
+	/** Count of the sorted numbers, set by the worker. */
+	size_t count;
+};
+
+static long long
+int_par_sort_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Memory shared with the forked workers, not reserved until used. */
+static void *
+int_par_sort_map(size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static int
+int_par_sort_job_create(struct int_par_sort_job *job, const char *path,
+			const struct int_par_sort_opts *opts)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return -1;
+	job->path = path;
+	job->file_size = st.st_size;
+	/* Each number takes a digit and a separator, except the last. */
+	job->capacity = (job->file_size + 1) / 2;
+	job->map_size = (job->capacity + 1) * sizeof(int);
+	job->data = int_par_sort_map(job->map_size);
+	if (job->data == NULL)
+		return -1;
+	job->worker = 0;
+	job->opts = opts;
+	job->count = 0;
+	return 0;
+}
+
+static void
+int_par_sort_job_destroy(struct int_par_sort_job *job)
+{
+	munmap(job->data, job->map_size);
+}
+
+/** Pool function: load a file into its shared memory and sort it. */
+static int
+int_par_sort_job_f(void *arg)
+{
+	struct int_par_sort_job *job = arg;
+	int fd = open(job->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct int_reader r;
+	if (int_reader_create(&r, fd, 0) != 0) {
+		close(fd);
+		return -1;
+	}
+	ssize_t count = int_reader_read(&r, job->data, job->capacity);
+	int_reader_destroy(&r);
+	close(fd);
+	if (count < 0)
+		return -1;
+	int *scratch = malloc(count * sizeof(int) + 1);
+	if (scratch == NULL)
+		return -1;
+	job->opts->sort(job->data, count, scratch, job->opts->unit);
+	free(scratch);
+	job->count = count;
+	return 0;
+}
+
+/**
+ * Give each file to the least loaded worker, biggest files first.
+ * That keeps the workers within one biggest file of each other.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+static int
+int_par_sort_assign(struct int_par_sort_job *jobs, int job_count,
+		    int worker_count)
+{
+	size_t *loads = calloc(worker_count, sizeof(loads[0]));
+	bool *is_assigned = calloc(job_count + 1, sizeof(is_assigned[0]));
+	if (loads == NULL || is_assigned == NULL) {
+		free(loads);
+		free(is_assigned);
+		return -1;
+	}
+	for (int n = 0; n < job_count; ++n) {
+		int biggest = -1;
+		for (int i = 0; i < job_count; ++i) {
+			if (!is_assigned[i] && (biggest < 0 ||
+			    jobs[i].file_size > jobs[biggest].file_size))
+				biggest = i;
+		}
+		int worker = 0;
+		for (int w = 1; w < worker_count; ++w) {
+			if (loads[w] < loads[worker])
+				worker = w;
+		}
+		is_assigned[biggest] = true;
+		jobs[biggest].worker = worker;
+		loads[worker] += jobs[biggest].file_size;
+	}
+	free(loads);
+	free(is_assigned);
+	return 0;
+}
+
+/** Sort the files of a worker in a pool of coroutines. */
+static int
+int_par_sort_run_pool(struct int_par_sort_job *jobs, int job_count,
+		      int worker, int coro_count)
+{
+	struct coro_pool *pool = coro_pool_new(coro_count,
+					       int_par_sort_job_f, 0);
+	for (int i = 0; i < job_count; ++i) {
+		if (worker < 0 || jobs[i].worker == worker)
+			coro_pool_push(pool, &jobs[i]);
+	}
+	int failed_count = coro_pool_join(pool);
+	coro_pool_delete(pool);
+	return failed_count;
+}
+
+/** Fork a process per worker, and wait for all of them. */
+static int
+int_par_sort_processes(struct int_par_sort_job *jobs, int job_count,
+		       int worker_count, int coro_count)
+{
+	pid_t *pids = malloc(worker_count * sizeof(pids[0]));
+	if (pids == NULL)
+		return -1;
+	int rc = 0;
+	int started = 0;
+	for (; started < worker_count; ++started) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			rc = -1;
+			break;
+		}
+		if (pid == 0) {
+			coro_sched_init();
+			int failed_count = int_par_sort_run_pool(jobs,
+				job_count, started, coro_count);
+			coro_sched_destroy();
+			_exit(failed_count == 0 ? 0 : 1);
+		}
+		pids[started] = pid;
+	}
+	for (int i = 0; i < started; ++i) {
+		int status;
+		while (waitpid(pids[i], &status, 0) < 0) {
+			if (errno != EINTR) {
+				status = -1;
+				break;
+			}
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errno = EIO;
+			rc = -1;
+		}
+	}
+	free(pids);
+	return rc;
+}
+
+/** Run all the files in one pool of the M:N scheduler threads. */
+static int
+int_par_sort_threads(struct int_par_sort_job *jobs, int job_count,
+		     int worker_count, int coro_count)
+{
+	coro_sched_init_threads(worker_count);
+	int failed_count = int_par_sort_run_pool(jobs, job_count, -1,
+						 coro_count * worker_count);
+	coro_sched_destroy();
+	if (failed_count == 0)
+		return 0;
+	errno = EIO;
+	return -1;
+}
+
+int
+int_par_sort(char **paths, int path_count,
+	     const struct int_par_sort_opts *opts, struct int_writer *out,
+	     struct int_par_sort_stats *stats)
+{
+	long long start = int_par_sort_now();
+	int worker_count = opts->worker_count;
+	if (worker_count <= 0)
+		worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (worker_count > path_count)
+		worker_count = path_count;
+	if (worker_count <= 0)
+		worker_count = 1;
+	int coro_count = opts->coro_count > 0 ? opts->coro_count :
+			 INT_PAR_SORT_CORO_COUNT;
+	size_t jobs_size = (path_count + 1) * sizeof(struct int_par_sort_job);
+	struct int_par_sort_job *jobs = int_par_sort_map(jobs_size);
+	if (jobs == NULL)
+		return -1;
+	int rc = 0;
+	int job_count = 0;
+	for (; job_count < path_count; ++job_count) {
+		if (int_par_sort_job_create(&jobs[job_count], paths[job_count],
+					    opts) != 0) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc == 0)
+		rc = int_par_sort_assign(jobs, job_count, worker_count);
+	if (rc == 0) {
+		if (opts->is_threads) {
+			rc = int_par_sort_threads(jobs, job_count,
+						  worker_count, coro_count);
+		} else {
+			rc = int_par_sort_processes(jobs, job_count,
+						    worker_count, coro_count);
+		}
+	}
+	long long merge_start = int_par_sort_now();
+	stats->worker_count = worker_count;
+	stats->count = 0;
+	stats->sort_time = merge_start - start;
+	stats->merge_time = 0;
+	if (rc == 0) {
+		const int **runs = malloc((job_count + 1) * sizeof(runs[0]));
+		size_t *sizes = malloc((job_count + 1) * sizeof(sizes[0]));
+		if (runs == NULL || sizes == NULL) {
+			rc = -1;
+		} else {
+			for (int i = 0; i < job_count; ++i) {
+				runs[i] = jobs[i].data;
+				sizes[i] = jobs[i].count;
+				stats->count += sizes[i];
+			}
+			rc = int_merge_arrays(runs, sizes, job_count, out);
+		}
+		free(runs);
+		free(sizes);
+		stats->merge_time = int_par_sort_now() - merge_start;
+	}
+	int err = errno;
+	for (int i = 0; i < job_count; ++i)
+		int_par_sort_job_destroy(&jobs[i]);
+	munmap(jobs, jobs_size);
+	errno = err;
+	return rc;
+}
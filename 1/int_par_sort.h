@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "int_sort.h"
+
+struct int_writer;
+
+/**
+ * Parallel sort of many files into one output. The files are spread
+ * between workers, one per core, and each worker runs a pool of
+ * coroutines over its files, so that reading of one file overlaps
+ * with sorting of another. The numbers are loaded and sorted right in
+ * memory shared with the caller, which merges the sorted arrays
+ * without copying them back.
+ */
+
+struct int_par_sort_opts {
+	/** Workers, 0 means one per online CPU. */
+	int worker_count;
+	/**
+	 * Workers are threads of the M:N scheduler instead of processes.
+	 * Then they share one pool and balance the files by stealing.
+	 */
+	bool is_threads;
+	/** Coroutines in the pool of each worker, 0 means the default. */
+	int coro_count;
+	int_sort_f sort;
+	/** Yield unit of the sort, see int_sort.h. */
+	size_t unit;
+};
+
+/** Work done by a parallel sort. */
+struct int_par_sort_stats {
+	/** Workers actually used. */
+	int worker_count;
+	/** Numbers sorted in total. */
+	size_t count;
+	/** Nanoseconds of loading and sorting the files by the workers. */
+	long long sort_time;
+	/** Nanoseconds of the final merge. */
+	long long merge_time;
+};
+
+/**
+ * Sort the numbers of all the files into @a out. Must be called when
+ * there is no coroutine scheduler: worker processes create their own
+ * after fork(), and in the threads mode an M:N scheduler is created
+ * for the sort and destroyed after it.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. It is EIO when a worker failed.
+ */
+int
+int_par_sort(char **paths, int path_count,
+	     const struct int_par_sort_opts *opts, struct int_writer *out,
+	     struct int_par_sort_stats *stats);
@@ -0,0 +1,170 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "int_sort.h"
+#include "libcoro.h"
+
+enum {
+	/** Merge sort starts from runs sorted by insertion. */
+	INT_SORT_RUN = 16,
+	INT_SORT_RADIX_BITS = 8,
+	INT_SORT_RADIX_SIZE = 1 << INT_SORT_RADIX_BITS,
+	INT_SORT_RADIX_PASSES = 32 / INT_SORT_RADIX_BITS,
+};
+
+/** Work counter, which yields each @a unit elements. */
+struct int_sort_work {
+	size_t unit;
+	size_t left;
+};
+
+static inline void
+int_sort_work_create(struct int_sort_work *work, size_t unit)
+{
+	work->unit = unit;
+	work->left = unit == 0 ? SIZE_MAX : unit;
+}
+
+/**
+ * How many elements can be processed before the next yield, but
+ * no more than @a max.
+ */
+static inline size_t
+int_sort_work_step(const struct int_sort_work *work, size_t max)
+{
+	return work->left < max ? work->left : max;
+}
+
+/** Account @a done elements, and yield if a unit is complete. */
+static inline void
+int_sort_work_done(struct int_sort_work *work, size_t done)
+{
+	if (done < work->left) {
+		work->left -= done;
+		return;
+	}
+	work->left = work->unit;
+	coro_yield_if_expired();
+}
+
+static void
+int_sort_insertion(int *data, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		int v = data[i];
+		size_t j = i;
+		for (; j > 0 && data[j - 1] > v; --j)
+			data[j] = data[j - 1];
+		data[j] = v;
+	}
+}
+
+/** Merge two sorted runs into @a dst. */
+static void
+int_sort_merge_runs(const int *a, const int *a_end, const int *b,
+		    const int *b_end, int *dst, struct int_sort_work *work)
+{
+	while (a < a_end && b < b_end) {
+		size_t step = int_sort_work_step(work, (a_end - a) +
+							(b_end - b));
+		size_t i = 0;
+		for (; i < step && a < a_end && b < b_end; ++i) {
+			/* Branchless: both are read, one is taken. */
+			int va = *a, vb = *b;
+			bool take_b = vb < va;
+			*dst++ = take_b ? vb : va;
+			a += !take_b;
+			b += take_b;
+		}
+		int_sort_work_done(work, i);
+	}
+	/* One of the runs is left, it is copied as is. */
+	if (a == a_end) {
+		a = b;
+		a_end = b_end;
+	}
+	memcpy(dst, a, (a_end - a) * sizeof(*a));
+	int_sort_work_done(work, a_end - a);
+}
+
+void
+int_sort_merge(int *data, size_t count, int *scratch, size_t unit)
+{
+	struct int_sort_work work;
+	int_sort_work_create(&work, unit);
+	for (size_t i = 0; i < count; i += INT_SORT_RUN) {
+		size_t n = count - i < INT_SORT_RUN ? count - i : INT_SORT_RUN;
+		int_sort_insertion(data + i, n);
+		int_sort_work_done(&work, n);
+	}
+	int *src = data, *dst = scratch;
+	for (size_t width = INT_SORT_RUN; width < count; width *= 2) {
+		for (size_t left = 0; left < count; left += 2 * width) {
+			size_t mid = left + width < count ? left + width : count;
+			size_t right = mid + width < count ? mid + width : count;
+			int_sort_merge_runs(src + left, src + mid, src + mid,
+					    src + right, dst + left, &work);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != data)
+		memcpy(data, src, count * sizeof(*data));
+}
+
+/**
+ * Radix digit of a number. The sign bit is flipped, so negative
+ * numbers go first.
+ */
+static inline unsigned
+int_sort_digit(int v, int pass)
+{
+	uint32_t key = (uint32_t)v ^ 0x80000000u;
+	return (key >> (pass * INT_SORT_RADIX_BITS)) &
+	       (INT_SORT_RADIX_SIZE - 1);
+}
+
+void
+int_sort_radix(int *data, size_t count, int *scratch, size_t unit)
+{
+	struct int_sort_work work;
+	int_sort_work_create(&work, unit);
+	/* Histograms of all the digits are collected in one pass. */
+	size_t counts[INT_SORT_RADIX_PASSES][INT_SORT_RADIX_SIZE];
+	memset(counts, 0, sizeof(counts));
+	for (size_t i = 0; i < count;) {
+		size_t step = int_sort_work_step(&work, count - i);
+		for (size_t end = i + step; i < end; ++i) {
+			for (int p = 0; p < INT_SORT_RADIX_PASSES; ++p)
+				++counts[p][int_sort_digit(data[i], p)];
+		}
+		int_sort_work_done(&work, step);
+	}
+	int *src = data, *dst = scratch;
+	for (int p = 0; p < INT_SORT_RADIX_PASSES; ++p) {
+		size_t *c = counts[p];
+		/* All the numbers have the same digit - nothing to do. */
+		if (count > 0 && c[int_sort_digit(src[0], p)] == count)
+			continue;
+		size_t offset = 0;
+		for (int d = 0; d < INT_SORT_RADIX_SIZE; ++d) {
+			size_t n = c[d];
+			c[d] = offset;
+			offset += n;
+		}
+		for (size_t i = 0; i < count;) {
+			size_t step = int_sort_work_step(&work, count - i);
+			for (size_t end = i + step; i < end; ++i) {
+				int v = src[i];
+				dst[c[int_sort_digit(v, p)]++] = v;
+			}
+			int_sort_work_done(&work, step);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != data)
+		memcpy(data, src, count * sizeof(*data));
+}
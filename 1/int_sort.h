@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Sorting of int arrays inside coroutines. The sorts don't allocate
+ * memory: the caller gives them a scratch buffer of the same size
+ * as the data, and can reuse it for many sorts.
+ *
+ * The sorts call coro_yield_if_expired() after each @a unit
+ * elements of work, so the coroutine switches only at those
+ * boundaries and only when its quantum has expired. The smaller the
+ * unit, the better the latency, and the bigger the switch overhead.
+ * 0 means no yields at all.
+ */
+
+/** Any of the sorts below. */
+typedef void
+(*int_sort_f)(int *data, size_t count, int *scratch, size_t unit);
+
+/** Bottom-up merge sort, ping-ponging between data and scratch. */
+void
+int_sort_merge(int *data, size_t count, int *scratch, size_t unit);
+
+/** LSD radix sort by 8 bits, skipping the bytes which are all equal. */
+void
+int_sort_radix(int *data, size_t count, int *scratch, size_t unit);
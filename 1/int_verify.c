@@ -0,0 +1,97 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "int_io.h"
+#include "int_verify.h"
+
+enum {
+	/** Text parsed at once. The numbers of it are kept in memory. */
+	INT_VERIFY_CHUNK_SIZE = 1024 * 1024,
+};
+
+/** Check and count the parsed numbers, and drop them. */
+static void
+int_verify_consume(struct int_verify_result *res, struct int_array *arr,
+		   int *prev)
+{
+	for (size_t i = 0; i < arr->size; ++i) {
+		int value = arr->data[i];
+		if (value < *prev && res->is_sorted &&
+		    res->digest.count > 0) {
+			res->is_sorted = false;
+			res->first_unsorted = res->digest.count;
+		}
+		int_digest_add(&res->digest, value);
+		*prev = value;
+	}
+	arr->size = 0;
+}
+
+int
+int_verify_file(const char *path, struct int_verify_result *res)
+{
+	int_digest_create(&res->digest);
+	res->is_sorted = true;
+	res->first_unsorted = 0;
+	res->is_garbage = false;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return 0;
+	}
+	const char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED)
+		return -1;
+	madvise((void *)text, size, MADV_SEQUENTIAL);
+	/*
+	 * The parser reads a bit past the chunk, so the end of the file
+	 * is parsed from a copy with the padding.
+	 */
+	char *last = malloc(INT_VERIFY_CHUNK_SIZE + 2 * INT_PARSER_PADDING);
+	if (last == NULL) {
+		munmap((void *)text, size);
+		return -1;
+	}
+	struct int_parser parser;
+	int_parser_create(&parser);
+	struct int_array arr;
+	int_array_create(&arr);
+	int prev = 0;
+	int rc = 0;
+	for (size_t pos = 0; pos < size && !parser.is_stopped;) {
+		size_t len = size - pos;
+		if (len > INT_VERIFY_CHUNK_SIZE)
+			len = INT_VERIFY_CHUNK_SIZE;
+		if (pos + len + INT_PARSER_PADDING <= size) {
+			rc = int_parser_feed(&parser, &arr, text + pos, len);
+		} else {
+			len = size - pos;
+			memcpy(last, text + pos, len);
+			memset(last + len, 0, INT_PARSER_PADDING);
+			rc = int_parser_feed(&parser, &arr, last, len);
+		}
+		if (rc != 0)
+			break;
+		int_verify_consume(res, &arr, &prev);
+		pos += len;
+	}
+	if (rc == 0)
+		rc = int_parser_finish(&parser, &arr);
+	int_verify_consume(res, &arr, &prev);
+	res->is_garbage = parser.is_stopped;
+	int_array_destroy(&arr);
+	free(last);
+	munmap((void *)text, size);
+	return rc;
+}
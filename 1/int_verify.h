@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Order independent fingerprint of a multiset of numbers. It is a
+ * count and two sums of differently mixed hashes of the numbers, so
+ * unequal multisets have equal digests with a chance about 2^-64.
+ * Digests of parts can be summed, like of the files sorted together.
+ */
+struct int_digest {
+	uint64_t count;
+	uint64_t sum1;
+	uint64_t sum2;
+};
+
+static inline void
+int_digest_create(struct int_digest *d)
+{
+	memset(d, 0, sizeof(*d));
+}
+
+/** Finalizer of splitmix64, a cheap and good 64-bit mixer. */
+static inline uint64_t
+int_digest_mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline void
+int_digest_add(struct int_digest *d, int value)
+{
+	uint64_t x = (uint32_t)value;
+	++d->count;
+	d->sum1 += int_digest_mix(x + 0x9e3779b97f4a7c15ULL);
+	d->sum2 += int_digest_mix(x ^ 0xd6e8feb86659fd93ULL);
+}
+
+static inline void
+int_digest_merge(struct int_digest *dst, const struct int_digest *src)
+{
+	dst->count += src->count;
+	dst->sum1 += src->sum1;
+	dst->sum2 += src->sum2;
+}
+
+static inline bool
+int_digest_is_equal(const struct int_digest *a, const struct int_digest *b)
+{
+	return a->count == b->count && a->sum1 == b->sum1 &&
+	       a->sum2 == b->sum2;
+}
+
+/** What is found in a file by int_verify_file(). */
+struct int_verify_result {
+	/** Digest of all the numbers. */
+	struct int_digest digest;
+	/** True, if the numbers are not decreasing. */
+	bool is_sorted;
+	/** Index of the first number less than the previous one. */
+	uint64_t first_unsorted;
+	/**
+	 * True, if there is something else than numbers. The numbers
+	 * after it are not checked.
+	 */
+	bool is_garbage;
+};
+
+/**
+ * Check the order of the numbers in a text file and find their
+ * digest in one pass. The file is mapped instead of being read, and
+ * is parsed chunk by chunk, so the memory use does not depend on the
+ * file size.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_verify_file(const char *path, struct int_verify_result *res);
@@ -1,258 +1,3595 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/*
+ * Context switch backends. One of them can be forced with -D:
+ *
+ * - CORO_BACKEND_ASM - hand-written register save/restore. Both
+ *   creation and switch are done in user space without a single
+ *   syscall. Available on x86-64 and aarch64 ELF targets;
+ *
+ * - CORO_BACKEND_UCONTEXT - makecontext()/swapcontext(). Portable,
+ *   but glibc's swapcontext() does sigprocmask() on each switch;
+ *
+ * - CORO_BACKEND_SIGNAL - the original sigaltstack() trick with
+ *   sigsetjmp()/siglongjmp(). Creation costs several syscalls.
+ *
+ * By default the fastest available one is used.
+ */
+#if !defined(CORO_BACKEND_ASM) && !defined(CORO_BACKEND_UCONTEXT) && \
+    !defined(CORO_BACKEND_SIGNAL)
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+#define CORO_BACKEND_ASM
+#else
+#define CORO_BACKEND_UCONTEXT
+#endif
+#endif
+
+#if defined(CORO_BACKEND_ASM) && \
+    !((defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__))
+#error "CORO_BACKEND_ASM is supported only on x86-64 and aarch64 ELF"
+#endif
+
+#ifdef CORO_BACKEND_UCONTEXT
+#ifdef __APPLE__
+/* The API is deprecated on Mac, but still works. */
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+#include <ucontext.h>
+#endif
+
+/** Saved execution context of a coroutine. */
+struct coro_ctx {
+#if defined(CORO_BACKEND_ASM)
+	/**
+	 * Stack pointer. All the callee-saved registers are stored
+	 * on the stack right below it.
+	 */
+	void *sp;
+#elif defined(CORO_BACKEND_UCONTEXT)
+	ucontext_t uc;
+#else
+	sigjmp_buf buf;
+#endif
+};
+
+/**
+ * States of a coroutine for coro_suspend() and coro_wakeup(). They
+ * are changed atomically, and the last access of the suspending
+ * thread to the coroutine is one compare-and-swap. After it the
+ * coroutine can be woken up, run and suspended again elsewhere.
+ */
+enum coro_wait_state {
+	/** Running, or ready to run. */
+	CORO_WAIT_NONE,
+	/** Suspended and in no queue. Only a wakeup makes it ready. */
+	CORO_WAIT_SUSPENDED,
+	/**
+	 * Woken up while not suspended. Then the next suspend
+	 * returns right away.
+	 */
+	CORO_WAIT_NOTIFIED,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
+	/** Unique number for the trace. 0 is a scheduler context. */
+	uint64_t id;
 	/** Stack, used by the coroutine. */
-	void *stack;
+	struct coro_stack *stack;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_ctx ctx;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
+	/** Clock ticks spent running, except the current slice. */
+	uint64_t work_ticks;
+	/** Clock ticks when the current slice has started. */
+	uint64_t slice_start;
+	/** Suspend and wakeup state, enum coro_wait_state. */
+	int wait_state;
+	/**
+	 * True, if the coroutine is deleted right after it finishes,
+	 * and is not returned from coro_sched_wait().
+	 */
+	bool is_detached;
+	/** Priority for CORO_SCHED_PRIORITY, higher runs first. */
+	int priority;
+	/** Latency budget in clock ticks, 0 if none. */
+	uint64_t budget;
+	/** Clock ticks when it became ready, if it has a budget. */
+	uint64_t ready_since;
+	/** Runs started later than the budget. */
+	long long budget_miss_count;
+	/**
+	 * Order in a ready heap: the policy key, then the arrival
+	 * number for the equal keys.
+	 */
+	int64_t sched_key;
+	uint64_t sched_seq;
+	/**
+	 * Link in a scheduler queue - either ready or finished
+	 * coroutines.
+	 */
+	struct coro *next;
+};
+
+/** Intrusive FIFO queue of coroutines. */
+struct coro_queue {
+	struct coro *head;
+	struct coro *tail;
+	int size;
+};
+
+/**
+ * Coroutines ready to run in one worker. Round robin keeps them in
+ * a FIFO, the other policies - in a binary heap by the policy key.
+ */
+struct coro_runq {
+	struct coro_queue fifo;
+	struct coro **heap;
+	int heap_size;
+	int heap_capacity;
+	/** Arrival counter to keep the equal keys in FIFO order. */
+	uint64_t seq;
+};
+
+/** What to do with a coroutine, when it is switched out. */
+enum coro_switch_action {
+	/** Nothing, somebody else takes care of it. */
+	CORO_SWITCH_NONE,
+	/** Put it back into the ready queue. */
+	CORO_SWITCH_REQUEUE,
+	/** Put it into the finished queue. */
+	CORO_SWITCH_FINISH,
+	/** Leave it until coro_wakeup(). */
+	CORO_SWITCH_SUSPEND,
+};
+
+enum coro_trace_type {
+	/** A coroutine is created. */
+	CORO_TRACE_CREATE,
+	/** A thread switched from one coroutine to another. */
+	CORO_TRACE_SWITCH,
+};
+
+/** An event in the trace ring of a thread. */
+struct coro_trace_event {
+	/** Clock ticks. */
+	uint64_t ticks;
+	/** Switched out coroutine, or the creator. */
+	uint64_t from;
+	/** Switched in, or the created coroutine. */
+	uint64_t to;
+	/** enum coro_trace_type. */
+	uint32_t type;
+	/** What is done with the switched out one, coro_switch_action. */
+	uint32_t action;
+};
+
+/** An I/O operation a coroutine is waiting for. */
+struct coro_io_req {
+	/** The waiting coroutine. */
+	struct coro *coro;
+	/** Result of the operation, or -errno. */
+	int res;
+	/** True, if the operation is complete. */
+	bool is_done;
+	/** Next request waiting for a free slot in the poller. */
+	struct coro_io_req *next;
+};
+
+/**
+ * I/O poller of a thread running coroutines. Coroutines submit
+ * their I/O into it and suspend, the thread completes the I/O and
+ * wakes them up when has nothing else to do. Each thread has its
+ * own poller, used only by it. Other threads can only notify it.
+ *
+ * On Linux the operations are executed by io_uring, when it is
+ * available. Otherwise the poller only waits for file descriptors
+ * readiness with epoll, or poll() on other systems, and the
+ * operations are done by the coroutines themselves.
+ */
+struct coro_poller {
+	/** Number of operations in progress. */
+	int pending;
+	/** Maximal number of operations in progress. */
+	int capacity;
+	/** Requests waiting until there are less than capacity ones. */
+	struct coro_io_req *waiters_head;
+	struct coro_io_req *waiters_tail;
+	/** Counter to check the readiness only once in a while. */
+	unsigned poll_tick;
+	/**
+	 * Pipe to wake the thread up from another one. On Linux it is
+	 * an eventfd, both ends are the same.
+	 */
+	int notify_fd[2];
+	/** Buffer to drain the notifications into. */
+	uint64_t notify_buf;
+#ifdef __linux__
+	/** The ring file descriptor, or -1 if io_uring is not used. */
+	int ring_fd;
+	/** Submission queue. */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/** Completion queue. */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/** The ring mappings. */
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	/** Epoll descriptor, when io_uring is not used. */
+	int epoll_fd;
+#else
+	/** Descriptors to wait for, and who waits for them. */
+	struct pollfd *fds;
+	struct coro_io_req **reqs;
+	int fd_count;
+	int fd_capacity;
+#endif
+};
+
+enum {
+	/** Bits of a slot index in one level of a timer wheel. */
+	CORO_TIMER_LEVEL_BITS = 6,
+	CORO_TIMER_LEVEL_SIZE = 1 << CORO_TIMER_LEVEL_BITS,
+	/** With 100us ticks the levels cover 79 days. */
+	CORO_TIMER_LEVEL_COUNT = 6,
+};
+
+/** Resolution of the timers in nanoseconds. */
+#define CORO_TIMER_TICK_NS 100000
+
+/** Deadline of a coroutine waiting in coro_suspend_until(). */
+struct coro_timer {
+	/** The coroutine to wake up. */
+	struct coro *coro;
+	/** Tick, when the coroutine should be woken up. */
+	uint64_t expire;
+	/**
+	 * The wheel the timer is in. The coroutine can move to
+	 * another thread meanwhile and cancel the timer from there.
+	 */
+	struct coro_timer_wheel *wheel;
+	/** Links in a slot of the wheel. */
+	struct coro_timer *next;
+	struct coro_timer *prev;
+	/** Where in the wheel the timer is. */
+	int level;
+	int slot;
+	/** True, if the timer is in the wheel. */
+	bool is_linked;
+	/** True, if the deadline has come and the coroutine is woken. */
+	bool is_fired;
+};
+
+/**
+ * Hierarchical timer wheel. Level 0 has a slot per tick, each next
+ * level has a slot per whole previous level. A timer is put into
+ * the lowest level which spans its deadline, and is moved down when
+ * the wheel reaches its slot. So adding and cancelling are O(1), and
+ * each timer is moved at most once per level.
+ */
+struct coro_timer_wheel {
+	/** Lists of timers. */
+	struct coro_timer *slots[CORO_TIMER_LEVEL_COUNT][CORO_TIMER_LEVEL_SIZE];
+	/** Bit per not empty slot of each level. */
+	uint64_t occupied[CORO_TIMER_LEVEL_COUNT];
+	/** The next tick to process. */
+	uint64_t now;
+	/** Timers in the wheel. */
+	int count;
+	/**
+	 * Protects the wheel in the multi thread mode. Only the owner
+	 * thread adds and fires the timers, but they are cancelled by
+	 * the coroutines from anywhere.
+	 */
+	pthread_mutex_t lock;
+};
+
+/**
+ * A thread running coroutines. In the single thread mode it is the
+ * thread which called coro_sched_init(). In the multi thread mode
+ * these are the worker threads.
+ */
+struct coro_worker {
+	/**
+	 * Own context of the thread - the scheduler loop of a worker,
+	 * or the main context of the single thread mode. It catches
+	 * the finished coroutines.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *current;
+	/**
+	 * Coroutines ready to run, in the order they should run. The
+	 * current one is not here.
+	 */
+	struct coro_runq ready;
+	/**
+	 * The coroutine switched out last, and what to do with it.
+	 * It can be done only when its context is saved, otherwise
+	 * another thread could pick it up too early.
+	 */
+	struct coro *prev;
+	enum coro_switch_action prev_action;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_sched_waiting;
+	/** Protects the ready queue in the multi thread mode. */
+	pthread_mutex_t lock;
+	/** Seed to choose whom to steal from. */
+	unsigned steal_seed;
+	/** I/O of the coroutines running here. */
+	struct coro_poller poller;
+	/** Deadlines of the coroutines suspended here. */
+	struct coro_timer_wheel timers;
+	/**
+	 * Runs of the coroutines with a latency budget, how many of
+	 * them were late, and the worst delay past a budget in clock
+	 * ticks. Written only by the worker itself.
+	 */
+	long long budget_dispatch_count;
+	long long budget_miss_count;
+	uint64_t max_lateness;
+	/**
+	 * Ring of the last trace events, NULL if the tracing was never
+	 * started. Written only by the worker itself.
+	 */
+	struct coro_trace_event *trace;
+	/** Events recorded. The ring keeps the last trace_size ones. */
+	uint64_t trace_count;
+	/** Capacity of the ring, a power of 2. */
+	uint64_t trace_size;
+	/** True, if the worker sleeps in the poller waiting for work. */
+	bool is_idle;
+	/**
+	 * Coroutines woken up by other threads in the single thread
+	 * mode. Protected by the lock.
+	 */
+	struct coro_queue remote;
+	pthread_t thread;
 };
 
 /**
  * Scheduler is a main coroutine - it catches and returns dead
  * ones to a user.
  */
-static struct coro coro_sched;
+static struct coro_sched {
+	/** True, if coroutines are run by worker threads. */
+	bool is_mt;
+	/**
+	 * Order of the ready coroutines. Set after the workers have
+	 * started, so accessed atomically.
+	 */
+	enum coro_sched_policy policy;
+	/** The last coroutine number given. */
+	uint64_t last_id;
+	/**
+	 * True, if the switches are recorded. Set while the workers
+	 * run, so accessed atomically. The release of the set makes
+	 * the rings of the threads visible to them.
+	 */
+	bool is_tracing;
+	/** Clock ticks when the tracing started. */
+	uint64_t trace_start;
+	/**
+	 * The thread, which called coro_sched_init(). In the single
+	 * thread mode it runs the coroutines itself.
+	 */
+	struct coro_worker main;
+	/** Threads running coroutines. */
+	struct coro_worker *workers;
+	int worker_count;
+	/** Finished coroutines not returned by coro_sched_wait() yet. */
+	struct coro_queue finished;
+	/** Coroutines created and not returned by coro_sched_wait(). */
+	long long alive_count;
+	/**
+	 * Workers put coroutines created outside of them in a round
+	 * robin.
+	 */
+	unsigned next_worker;
+	/** How many workers wait for new coroutines to run. */
+	int idle_count;
+	/** True, if the workers should exit. */
+	bool is_stopping;
+	/** Protects the finished queue in the multi thread mode. */
+	pthread_mutex_t lock;
+	/** Signaled when a coroutine finishes. */
+	pthread_cond_t finished_cond;
+} coro_sched;
+
+static inline enum coro_sched_policy
+coro_sched_policy(void)
+{
+	return __atomic_load_n(&coro_sched.policy, __ATOMIC_RELAXED);
+}
+
+static inline bool
+coro_sched_is_tracing(void)
+{
+	return __atomic_load_n(&coro_sched.is_tracing, __ATOMIC_ACQUIRE);
+}
+
+/** Scheduler of the current thread. */
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Get the scheduler of the current thread. Coroutines can move from
+ * one thread to another while switched out, and the compiler should
+ * never reuse an address of a thread local variable computed
+ * before a switch. So it is always read via this function.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static __attribute__((noinline)) struct coro_worker *
+coro_worker_this(void)
+{
+	struct coro_worker *w = coro_worker_ptr;
+	__asm__ __volatile__("" ::: "memory");
+	return w;
+}
+
+/** Add a coroutine to the end of a queue. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	if (q->tail != NULL)
+		q->tail->next = c;
+	else
+		q->head = c;
+	q->tail = c;
+	++q->size;
+}
+
+/** Remove the first coroutine from a queue. NULL, if empty. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->head;
+	if (c == NULL)
+		return NULL;
+	q->head = c->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	--q->size;
+	return c;
+}
+
+/** Move all coroutines of @a src to the end of @a dst. */
+static inline void
+coro_queue_splice(struct coro_queue *dst, struct coro_queue *src)
+{
+	if (src->head == NULL)
+		return;
+	if (dst->tail != NULL)
+		dst->tail->next = src->head;
+	else
+		dst->head = src->head;
+	dst->tail = src->tail;
+	dst->size += src->size;
+	memset(src, 0, sizeof(*src));
+}
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Key of a coroutine in a ready heap, if it became ready at
+ * @a ready_since ticks. Lower runs first.
  */
-static sigjmp_buf start_point;
+static inline int64_t
+coro_sched_key(const struct coro *c, uint64_t ready_since)
+{
+	switch (coro_sched_policy()) {
+	case CORO_SCHED_PRIORITY:
+		return -(int64_t)c->priority;
+	case CORO_SCHED_EDF:
+		/* Coroutines without a deadline wait for all the others. */
+		if (c->budget == 0)
+			return INT64_MAX;
+		return (int64_t)(ready_since + c->budget);
+	default:
+		return 0;
+	}
+}
+
+static inline bool
+coro_runq_less(const struct coro *a, const struct coro *b)
+{
+	return a->sched_key < b->sched_key ||
+	       (a->sched_key == b->sched_key && a->sched_seq < b->sched_seq);
+}
+
+static inline int
+coro_runq_size(const struct coro_runq *q)
+{
+	return coro_sched_policy() == CORO_SCHED_RR ? q->fifo.size :
+	       q->heap_size;
+}
+
+/** The coroutine to run next, NULL if none. */
+static inline struct coro *
+coro_runq_first(const struct coro_runq *q)
+{
+	if (coro_sched_policy() == CORO_SCHED_RR)
+		return q->fifo.head;
+	return q->heap_size > 0 ? q->heap[0] : NULL;
+}
 
-/** Add a new coroutine to the beginning of the list. */
 static void
-coro_list_add(struct coro *c)
+coro_runq_push(struct coro_runq *q, struct coro *c)
+{
+	if (coro_sched_policy() == CORO_SCHED_RR) {
+		coro_queue_push(&q->fifo, c);
+		return;
+	}
+	c->sched_key = coro_sched_key(c, c->ready_since);
+	c->sched_seq = q->seq++;
+	if (q->heap_size == q->heap_capacity) {
+		q->heap_capacity = q->heap_capacity * 2 + 16;
+		q->heap = realloc(q->heap,
+				  q->heap_capacity * sizeof(q->heap[0]));
+		if (q->heap == NULL)
+			handle_error();
+	}
+	int i = q->heap_size++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!coro_runq_less(c, q->heap[parent]))
+			break;
+		q->heap[i] = q->heap[parent];
+		i = parent;
+	}
+	q->heap[i] = c;
+}
+
+static struct coro *
+coro_runq_pop(struct coro_runq *q)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	if (coro_sched_policy() == CORO_SCHED_RR)
+		return coro_queue_pop(&q->fifo);
+	if (q->heap_size == 0)
+		return NULL;
+	struct coro *res = q->heap[0];
+	struct coro *last = q->heap[--q->heap_size];
+	int i = 0;
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= q->heap_size)
+			break;
+		if (child + 1 < q->heap_size &&
+		    coro_runq_less(q->heap[child + 1], q->heap[child]))
+			++child;
+		if (!coro_runq_less(q->heap[child], last))
+			break;
+		q->heap[i] = q->heap[child];
+		i = child;
+	}
+	if (q->heap_size > 0)
+		q->heap[i] = last;
+	return res;
 }
 
-/** Remove a coroutine from the list. */
+/** Move all coroutines of @a src into the run queue. */
 static void
-coro_list_delete(struct coro *c)
+coro_runq_splice(struct coro_runq *q, struct coro_queue *src)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	if (coro_sched_policy() == CORO_SCHED_RR) {
+		coro_queue_splice(&q->fifo, src);
+		return;
+	}
+	struct coro *c;
+	while ((c = coro_queue_pop(src)) != NULL)
+		coro_runq_push(q, c);
 }
 
-int
-coro_status(const struct coro *c)
+static void
+coro_runq_destroy(struct coro_runq *q)
 {
-	return c->ret;
+	free(q->heap);
 }
 
-long long
-coro_switch_count(const struct coro *c)
+/**
+ * Cheap clock for the coroutine time accounting. It reads the CPU
+ * time stamp counter when it is reliable, and falls back to
+ * CLOCK_MONOTONIC otherwise. The ticks are converted into
+ * nanoseconds only when reported.
+ */
+static struct coro_clock {
+	/** True, if the CPU counter is used. */
+	bool is_counter;
+	/** Nanoseconds in one tick. */
+	double ns_per_tick;
+	/**
+	 * Time quantum of coroutines in ticks. Set after the workers
+	 * have started, so accessed atomically.
+	 */
+	uint64_t quantum;
+} coro_clock;
+
+static inline uint64_t
+coro_clock_monotonic(void)
 {
-	return c->switch_count;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-bool
-coro_is_finished(const struct coro *c)
+static inline uint64_t
+coro_clock_ticks(void)
 {
-	return c->is_finished;
+#if defined(__x86_64__)
+	if (coro_clock.is_counter)
+		return __rdtsc();
+#elif defined(__aarch64__)
+	if (coro_clock.is_counter) {
+		uint64_t res;
+		__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(res));
+		return res;
+	}
+#endif
+	return coro_clock_monotonic();
 }
 
-void
-coro_delete(struct coro *c)
+/**
+ * Find how fast the clock ticks. The counter is used only if it
+ * runs with a constant rate regardless of the CPU frequency and
+ * sleep states.
+ */
+static void
+coro_clock_calibrate(void)
 {
-	free(c->stack);
-	free(c);
+	coro_clock.is_counter = false;
+	coro_clock.ns_per_tick = 1;
+#if defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	/* Invariant TSC bit. */
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & (1 << 8)) == 0)
+		return;
+#elif !defined(__aarch64__)
+	return;
+#endif
+	coro_clock.is_counter = true;
+	uint64_t ns_start = coro_clock_monotonic();
+	uint64_t ticks_start = coro_clock_ticks();
+	uint64_t ns_end, ticks_end;
+	/* Long enough to get an error less than 0.1%. */
+	do {
+		ns_end = coro_clock_monotonic();
+		ticks_end = coro_clock_ticks();
+	} while (ns_end - ns_start < 200000);
+	coro_clock.ns_per_tick =
+		(double)(ns_end - ns_start) / (ticks_end - ticks_start);
+}
+
+static inline uint64_t
+coro_timer_tick_now(void)
+{
+	return coro_clock_monotonic() / CORO_TIMER_TICK_NS;
 }
 
-/** Switch the current coroutine to an arbitrary one. */
 static void
-coro_yield_to(struct coro *to)
+coro_timer_wheel_create(struct coro_timer_wheel *wh)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	memset(wh, 0, sizeof(*wh));
+	wh->now = coro_timer_tick_now();
+	pthread_mutex_init(&wh->lock, NULL);
 }
 
-void
-coro_yield(void)
+static void
+coro_timer_wheel_destroy(struct coro_timer_wheel *wh)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
+	pthread_mutex_destroy(&wh->lock);
+}
+
+static inline void
+coro_timer_wheel_lock(struct coro_timer_wheel *wh)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_lock(&wh->lock);
+}
+
+static inline void
+coro_timer_wheel_unlock(struct coro_timer_wheel *wh)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_unlock(&wh->lock);
+}
+
+/** Put a timer into the slot of its deadline. */
+static void
+coro_timer_wheel_link(struct coro_timer_wheel *wh, struct coro_timer *t)
+{
+	const uint64_t span = (uint64_t)1 <<
+			      (CORO_TIMER_LEVEL_BITS * CORO_TIMER_LEVEL_COUNT);
+	uint64_t expire = t->expire < wh->now ? wh->now : t->expire;
+	/*
+	 * Farther than the wheel spans - park in the farthest slot,
+	 * from there it is put back with the real deadline.
+	 */
+	if (expire - wh->now >= span)
+		expire = wh->now + span - 1;
+	uint64_t delta = expire - wh->now;
+	int level = 0;
+	while (delta >= (uint64_t)1 << (CORO_TIMER_LEVEL_BITS * (level + 1)))
+		++level;
+	int slot = (expire >> (CORO_TIMER_LEVEL_BITS * level)) &
+		   (CORO_TIMER_LEVEL_SIZE - 1);
+	struct coro_timer **head = &wh->slots[level][slot];
+	t->level = level;
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = *head;
+	if (*head != NULL)
+		(*head)->prev = t;
+	*head = t;
+	t->is_linked = true;
+	wh->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void
+coro_timer_wheel_unlink(struct coro_timer_wheel *wh, struct coro_timer *t)
+{
+	if (t->prev != NULL)
+		t->prev->next = t->next;
 	else
-		coro_yield_to(to);
+		wh->slots[t->level][t->slot] = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	if (wh->slots[t->level][t->slot] == NULL)
+		wh->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+	t->is_linked = false;
 }
 
-void
-coro_sched_init(void)
+/**
+ * Move the timers of the upper level slots, reached by the wheel,
+ * down. Called when the level 0 starts a new round.
+ */
+static void
+coro_timer_wheel_cascade(struct coro_timer_wheel *wh)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	for (int level = 1; level < CORO_TIMER_LEVEL_COUNT; ++level) {
+		int slot = (wh->now >> (CORO_TIMER_LEVEL_BITS * level)) &
+			   (CORO_TIMER_LEVEL_SIZE - 1);
+		struct coro_timer *t = wh->slots[level][slot];
+		wh->slots[level][slot] = NULL;
+		wh->occupied[level] &= ~((uint64_t)1 << slot);
+		while (t != NULL) {
+			struct coro_timer *next = t->next;
+			coro_timer_wheel_link(wh, t);
+			t = next;
+		}
+		/* The next level moves only when this one wraps. */
+		if (slot != 0)
+			break;
+	}
 }
 
-struct coro *
-coro_sched_wait(void)
+/**
+ * Fire all the timers with deadlines up to the @a target tick.
+ * Runs of empty slots are skipped with the occupancy bitmap.
+ */
+static void
+coro_timer_wheel_run(struct coro_timer_wheel *wh, uint64_t target)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	const uint64_t mask = CORO_TIMER_LEVEL_SIZE - 1;
+	while (wh->now <= target) {
+		if (wh->count == 0) {
+			wh->now = target + 1;
+			break;
+		}
+		uint64_t idx = wh->now & mask;
+		if (idx == 0)
+			coro_timer_wheel_cascade(wh);
+		uint64_t bits = wh->occupied[0] >> idx;
+		if (bits == 0) {
+			/* Nothing till the end of the round. */
+			uint64_t end = (wh->now | mask) + 1;
+			wh->now = end <= target ? end : target + 1;
+			continue;
+		}
+		uint64_t tick = wh->now + __builtin_ctzll(bits);
+		if (tick > target) {
+			wh->now = target + 1;
+			break;
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		struct coro_timer **head = &wh->slots[0][tick & mask];
+		while (*head != NULL) {
+			struct coro_timer *t = *head;
+			coro_timer_wheel_unlink(wh, t);
+			__atomic_sub_fetch(&wh->count, 1, __ATOMIC_RELAXED);
+			t->is_fired = true;
+			/*
+			 * Under the lock, so the coroutine can't cancel
+			 * the timer, return and exit meanwhile.
+			 */
+			coro_wakeup(t->coro);
+		}
+		wh->now = tick + 1;
 	}
-	return NULL;
 }
 
-struct coro *
-coro_this(void)
+/** Fire the timers which deadlines have come. */
+static void
+coro_timer_wheel_expire(struct coro_timer_wheel *wh)
 {
-	return coro_this_ptr;
+	coro_timer_wheel_lock(wh);
+	coro_timer_wheel_run(wh, coro_timer_tick_now());
+	coro_timer_wheel_unlock(wh);
 }
 
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Nanoseconds until the wheel should be run again, -1 if it is
+ * empty. Can be less than till the nearest deadline, when the wheel
+ * has to move timers down first.
  */
-static void
-coro_body(int signum)
+static long long
+coro_timer_wheel_timeout(struct coro_timer_wheel *wh)
 {
-	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
+	coro_timer_wheel_lock(wh);
+	if (wh->count == 0) {
+		coro_timer_wheel_unlock(wh);
+		return -1;
+	}
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < CORO_TIMER_LEVEL_COUNT; ++level) {
+		uint64_t bits = wh->occupied[level];
+		if (bits == 0)
+			continue;
+		/*
+		 * The first slot of the level, which is reached not
+		 * earlier than now, and the next occupied one after it.
+		 */
+		int shift = CORO_TIMER_LEVEL_BITS * level;
+		uint64_t pos = (wh->now + ((uint64_t)1 << shift) - 1) >> shift;
+		int rot = pos & (CORO_TIMER_LEVEL_SIZE - 1);
+		if (rot != 0)
+			bits = (bits >> rot) | (bits << (64 - rot));
+		uint64_t tick = (pos + __builtin_ctzll(bits)) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	coro_timer_wheel_unlock(wh);
+	uint64_t now = coro_clock_monotonic();
+	uint64_t deadline = next * CORO_TIMER_TICK_NS;
+	return deadline > now ? (long long)(deadline - now) : 0;
+}
+
+/**
+ * Coroutine stack. It has a guard page right below it, so an
+ * overflow crashes instead of silently corrupting a neighbour.
+ * Stacks of deleted coroutines are kept in a pool and reused by new
+ * ones.
+ */
+struct coro_stack {
+	/** Lowest address of the stack, right above the guard page. */
+	char *base;
+	/** Stack size. */
+	size_t size;
+	/** Pool size class, or -1 if the stack is not pooled. */
+	int class_id;
+	/**
+	 * True, if the stack memory was returned to the kernel while
+	 * lying in the pool.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
+	bool is_cold;
+	/** Slab the stack is cut from. */
+	struct coro_stack_slab *slab;
+	/** Next stack in a free list of the pool. */
+	struct coro_stack *next_free;
+	/** True, if the stack was filled with the watermark pattern. */
+	bool is_watermarked;
+};
+
+/**
+ * Stacks are mapped in slabs of several stacks at once. Each guard
+ * page splits a mapping in two, and the number of mappings per
+ * process is limited (vm.max_map_count on Linux). So the slabs are
+ * never unmapped partially - that would need even more mappings
+ * and could fail. Unused stacks only give their memory back via
+ * madvise().
+ */
+struct coro_stack_slab {
+	/** The mapping. */
+	char *map;
+	/** Size of the mapping. */
+	size_t map_size;
+	/** Links in the list of all the slabs. */
+	struct coro_stack_slab *next, *prev;
+	/** Stacks of the slab. */
+	struct coro_stack stacks[];
+};
+
+enum {
+	/** Smallest stack size class, as a power of 2. */
+	CORO_STACK_CLASS_MIN = 14,
+	/** Largest pooled stack size class, as a power of 2. */
+	CORO_STACK_CLASS_MAX = 26,
+	CORO_STACK_CLASS_COUNT =
+		CORO_STACK_CLASS_MAX - CORO_STACK_CLASS_MIN + 1,
+	/** Slabs of small stacks are at least that big. */
+	CORO_STACK_SLAB_SIZE = 4 * 1024 * 1024,
+};
+
+/**
+ * How many free stacks each size class can keep hot. The memory of
+ * the others is returned to the kernel.
+ */
+static const int coro_stack_pool_hot_limit = 4096;
+/**
+ * Share of the mapping limit given to the guard pages by default.
+ * Each guard page splits its slab twice, and the rest of the process
+ * needs the mappings too - malloc(), threads, files, everything. So
+ * with the default Linux limit of 65530 about 16K stacks are guarded.
+ */
+static const int coro_stack_guard_share = 4;
+/**
+ * Cap of a limit set by the user, leaving a third of the mappings to
+ * the rest of the process.
+ */
+static const int coro_stack_guard_max_share = 3;
+/** Mapping limit, when /proc/sys/vm/max_map_count can't be read. */
+static const long long coro_stack_map_limit_default = 65530;
+
+/** Pool of free stacks, split into power-of-2 size classes. */
+static struct coro_stack_pool {
+	/**
+	 * Free lists, one per size class. Hot stacks are in the
+	 * beginning, cold ones are in the end.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
+	struct coro_stack *free_head[CORO_STACK_CLASS_COUNT];
+	struct coro_stack *free_tail[CORO_STACK_CLASS_COUNT];
+	/** Number of hot stacks in each free list. */
+	int hot_count[CORO_STACK_CLASS_COUNT];
+	/** All the slabs. */
+	struct coro_stack_slab *slabs;
+	/** Page size, cached. */
+	size_t page_size;
+	/** Statistics, see struct coro_stack_stats. */
+	long long hits;
+	long long misses;
+	long long used_count;
+	long long free_count;
+	long long guarded_count;
+	long long unguarded_count;
+	size_t mapped_bytes;
+	/**
+	 * How many stacks can have a guard page, set by the user.
+	 * Negative means derived from the mapping limit.
+	 */
+	long long guard_limit;
+	/** vm.max_map_count, read with the first slab. */
+	long long map_limit;
+	/** True, if new stacks are filled with the watermark pattern. */
+	bool is_watermark;
+	/** Peak use of the deleted stacks with a watermark. */
+	struct coro_stack_hist peak_hist;
+	/** Protects the pool in the multi thread mode. */
+	pthread_mutex_t lock;
+} coro_stack_pool = {
+	.guard_limit = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline void
+coro_stack_pool_lock(void)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_lock(&coro_stack_pool.lock);
+}
+
+static inline void
+coro_stack_pool_unlock(void)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_unlock(&coro_stack_pool.lock);
+}
+
+/** Find size class of a stack, or -1 if it is too big. */
+static int
+coro_stack_class(size_t size)
+{
+	int id = 0;
+	while (((size_t)1 << (CORO_STACK_CLASS_MIN + id)) < size) {
+		if (++id == CORO_STACK_CLASS_COUNT)
+			return -1;
 	}
-	siglongjmp(coro_sched.ctx, 1);
+	return id;
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/** Put a stack into the free list of its class. */
+static void
+coro_stack_pool_put(struct coro_stack *s)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
-	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
-	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	int id = s->class_id;
+	s->next_free = NULL;
+	if (!s->is_cold &&
+	    pool->hot_count[id] >= coro_stack_pool_hot_limit) {
+#ifdef MADV_DONTNEED
+		if (madvise(s->base, s->size, MADV_DONTNEED) != 0)
+			handle_error();
+#endif
+		s->is_cold = true;
+	}
+	if (s->is_cold) {
+		if (pool->free_tail[id] != NULL)
+			pool->free_tail[id]->next_free = s;
+		else
+			pool->free_head[id] = s;
+		pool->free_tail[id] = s;
+	} else {
+		s->next_free = pool->free_head[id];
+		pool->free_head[id] = s;
+		if (pool->free_tail[id] == NULL)
+			pool->free_tail[id] = s;
+		++pool->hot_count[id];
+	}
+	++pool->free_count;
+}
+
+/** Take a stack from the free list of a class, if any. */
+static struct coro_stack *
+coro_stack_pool_get(int id)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	struct coro_stack *s = pool->free_head[id];
+	if (s == NULL)
+		return NULL;
+	pool->free_head[id] = s->next_free;
+	if (pool->free_head[id] == NULL)
+		pool->free_tail[id] = NULL;
+	if (!s->is_cold)
+		--pool->hot_count[id];
+	s->is_cold = false;
+	--pool->free_count;
+	return s;
+}
+
+/** How many stacks can have a guard page, within the mapping limit. */
+static long long
+coro_stack_guard_limit(struct coro_stack_pool *pool)
+{
+	if (pool->map_limit == 0) {
+		FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+		if (f != NULL) {
+			if (fscanf(f, "%lld", &pool->map_limit) != 1)
+				pool->map_limit = 0;
+			fclose(f);
+		}
+		if (pool->map_limit <= 0)
+			pool->map_limit = coro_stack_map_limit_default;
+	}
+	if (pool->guard_limit < 0)
+		return pool->map_limit / coro_stack_guard_share;
+	long long max = pool->map_limit / coro_stack_guard_max_share;
+	return pool->guard_limit < max ? pool->guard_limit : max;
+}
+
+/**
+ * Map a new slab of stacks of the given size class, or of a given
+ * size for a not pooled stack. The first stack is returned, the
+ * others go to the pool.
+ */
+static struct coro_stack *
+coro_stack_slab_new(size_t size, int class_id)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	if (pool->page_size == 0)
+		pool->page_size = sysconf(_SC_PAGESIZE);
+	size_t page = pool->page_size;
+	int count = 1;
+	if (class_id >= 0) {
+		size = (size_t)1 << (CORO_STACK_CLASS_MIN + class_id);
+		if (size + page < CORO_STACK_SLAB_SIZE)
+			count = CORO_STACK_SLAB_SIZE / (size + page);
+	} else {
+		size = (size + page - 1) & ~(page - 1);
+	}
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	long long guard_limit = coro_stack_guard_limit(pool);
+	size_t map_size = (size + page) * count;
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags,
+			 -1, 0);
+	if (map == MAP_FAILED)
 		handle_error();
-	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
-			sigsuspend(&suss);
+	struct coro_stack_slab *slab =
+		malloc(sizeof(*slab) + count * sizeof(slab->stacks[0]));
+	slab->map = map;
+	slab->map_size = map_size;
+	slab->prev = NULL;
+	slab->next = pool->slabs;
+	if (pool->slabs != NULL)
+		pool->slabs->prev = slab;
+	pool->slabs = slab;
+	pool->mapped_bytes += map_size;
+	for (int i = 0; i < count; ++i) {
+		struct coro_stack *s = &slab->stacks[i];
+		char *guard = map + i * (size + page);
+		/*
+		 * When the guard limit is exhausted, the stack still
+		 * works, just without the overflow protection.
+		 */
+		if (pool->guarded_count < guard_limit) {
+			if (mprotect(guard, page, PROT_NONE) != 0)
+				handle_error();
+			++pool->guarded_count;
+		} else {
+			++pool->unguarded_count;
+		}
+		s->base = guard + page;
+		s->size = size;
+		s->class_id = class_id;
+		s->is_cold = false;
+		s->slab = slab;
+		s->next_free = NULL;
+		if (i > 0)
+			coro_stack_pool_put(s);
 	}
-	coro_this_ptr = old_this;
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
-	 */
-	if (sigaltstack(NULL, &newst) != 0)
+	return &slab->stacks[0];
+}
+
+/** Unmap a slab with a single not pooled stack. */
+static void
+coro_stack_slab_delete(struct coro_stack_slab *slab)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		pool->slabs = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	pool->mapped_bytes -= slab->map_size;
+	if (munmap(slab->map, slab->map_size) != 0)
 		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
+	free(slab);
+}
+
+/** Byte the stacks with a watermark are filled with. */
+#define CORO_STACK_PATTERN 0xa5
+
+static void
+coro_stack_fill(struct coro_stack *s)
+{
+	memset(s->base, CORO_STACK_PATTERN, s->size);
+}
+
+/**
+ * Bytes of the stack overwritten since the fill. The stack grows
+ * down, so the untouched pattern is in the bottom of it.
+ */
+static size_t
+coro_stack_used(const struct coro_stack *s)
+{
+	const uint64_t pattern = 0x0101010101010101ULL * CORO_STACK_PATTERN;
+	const uint64_t *word = (const uint64_t *)s->base;
+	const uint64_t *word_end = word + s->size / sizeof(*word);
+	while (word < word_end && *word == pattern)
+		++word;
+	const unsigned char *pos = (const unsigned char *)word;
+	const unsigned char *top = (const unsigned char *)s->base + s->size;
+	while (pos < top && *pos == CORO_STACK_PATTERN)
+		++pos;
+	return top - pos;
+}
+
+/** Take a stack of at least @a size bytes from the pool. */
+static struct coro_stack *
+coro_stack_new(size_t size)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	int class_id = coro_stack_class(size);
+	struct coro_stack *s = NULL;
+	coro_stack_pool_lock();
+	if (class_id >= 0)
+		s = coro_stack_pool_get(class_id);
+	if (s != NULL) {
+		++pool->hits;
+	} else {
+		s = coro_stack_slab_new(size, class_id);
+		++pool->misses;
+	}
+	++pool->used_count;
+	s->is_watermarked = pool->is_watermark;
+	coro_stack_pool_unlock();
+	if (s->is_watermarked)
+		coro_stack_fill(s);
+	return s;
+}
+
+/** Return a stack to the pool. */
+static void
+coro_stack_delete(struct coro_stack *s)
+{
+	size_t peak = s->is_watermarked ? coro_stack_used(s) : 0;
+	coro_stack_pool_lock();
+	if (s->is_watermarked) {
+		struct coro_stack_hist *hist = &coro_stack_pool.peak_hist;
+		int i = 0;
+		while (i < CORO_STACK_HIST_SIZE - 1 &&
+		       peak > (size_t)1 << (CORO_STACK_HIST_MIN_LOG + i))
+			++i;
+		++hist->buckets[i];
+		++hist->count;
+		if (peak > hist->max)
+			hist->max = peak;
+	}
+	--coro_stack_pool.used_count;
+	if (s->class_id >= 0)
+		coro_stack_pool_put(s);
+	else
+		coro_stack_slab_delete(s->slab);
+	coro_stack_pool_unlock();
+}
+
+/** Unmap all the stacks. None of them should be used. */
+static void
+coro_stack_pool_destroy(void)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	while (pool->slabs != NULL) {
+		struct coro_stack_slab *slab = pool->slabs;
+		pool->slabs = slab->next;
+		if (munmap(slab->map, slab->map_size) != 0)
+			handle_error();
+		free(slab);
+	}
+	memset(pool->free_head, 0, sizeof(pool->free_head));
+	memset(pool->free_tail, 0, sizeof(pool->free_tail));
+	memset(pool->hot_count, 0, sizeof(pool->hot_count));
+	pool->free_count = 0;
+	pool->mapped_bytes = 0;
+	pool->guarded_count = 0;
+}
+
+void
+coro_stack_stats(struct coro_stack_stats *stats)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	coro_stack_pool_lock();
+	stats->hits = pool->hits;
+	stats->misses = pool->misses;
+	stats->used_count = pool->used_count;
+	stats->free_count = pool->free_count;
+	stats->unguarded_count = pool->unguarded_count;
+	stats->mapped_bytes = pool->mapped_bytes;
+	stats->committed_bytes = 0;
+	unsigned char *vec = NULL;
+	size_t vec_size = 0;
+	struct coro_stack_slab *slab;
+	for (slab = pool->slabs; slab != NULL; slab = slab->next) {
+		size_t count = slab->map_size / pool->page_size;
+		if (count > vec_size) {
+			vec_size = count;
+			vec = realloc(vec, vec_size);
+		}
+		if (mincore(slab->map, slab->map_size, (void *)vec) != 0)
+			handle_error();
+		for (size_t i = 0; i < count; ++i) {
+			if ((vec[i] & 1) != 0)
+				stats->committed_bytes += pool->page_size;
+		}
+	}
+	coro_stack_pool_unlock();
+	free(vec);
+}
+
+void
+coro_stack_set_guard_limit(long long limit)
+{
+	coro_stack_pool_lock();
+	coro_stack_pool.guard_limit = limit;
+	coro_stack_pool_unlock();
+}
+
+void
+coro_stack_set_watermark(bool is_enabled)
+{
+	coro_stack_pool_lock();
+	coro_stack_pool.is_watermark = is_enabled;
+	coro_stack_pool_unlock();
+}
+
+long long
+coro_stack_peak(const struct coro *c)
+{
+	if (!c->stack->is_watermarked)
+		return -1;
+	return coro_stack_used(c->stack);
+}
+
+void
+coro_stack_hist(struct coro_stack_hist *hist)
+{
+	coro_stack_pool_lock();
+	*hist = coro_stack_pool.peak_hist;
+	coro_stack_pool_unlock();
+}
+
+#ifdef CORO_POLLER_EPOLL
+/** Build with -DCORO_POLLER_EPOLL to use epoll even with io_uring. */
+static const bool coro_poller_use_epoll = true;
+#else
+static const bool coro_poller_use_epoll = false;
+#endif
+
+/** Tag of the notification read in io_uring. */
+#define CORO_POLLER_NOTIFY_TAG 1
+/** Size of io_uring completion queue. */
+#define CORO_URING_CQ_SIZE 4096
+/**
+ * How many pops of ready coroutines to do before checking the
+ * readiness of file descriptors, when it takes a syscall.
+ */
+#define CORO_POLL_PERIOD 64
+
+/** Complete an I/O request and wake its coroutine up. */
+static void
+coro_io_req_complete(struct coro_io_req *req, int res)
+{
+	req->res = res;
+	req->is_done = true;
+	coro_wakeup(req->coro);
+}
+
+/**
+ * Take a slot for a new operation. When there are none, @a req
+ * is queued and is completed when a slot is released.
+ * @retval Whether the slot is taken.
+ */
+static bool
+coro_poller_reserve(struct coro_poller *p, struct coro_io_req *req)
+{
+	if (p->pending < p->capacity) {
+		++p->pending;
+		return true;
+	}
+	req->next = NULL;
+	if (p->waiters_head == NULL)
+		p->waiters_head = req;
+	else
+		p->waiters_tail->next = req;
+	p->waiters_tail = req;
+	return false;
+}
+
+/** Release a slot taken by coro_poller_reserve(). */
+static void
+coro_poller_release(struct coro_poller *p)
+{
+	--p->pending;
+	struct coro_io_req *req = p->waiters_head;
+	if (req == NULL)
+		return;
+	p->waiters_head = req->next;
+	/* The waiter retries in the poller it runs in then. */
+	coro_io_req_complete(req, 0);
+}
+
+/**
+ * Convert a poller timeout into milliseconds for epoll and poll().
+ * Rounded up, so the deadlines are not missed by waking up early.
+ */
+static int
+coro_poller_timeout_ms(long long timeout)
+{
+	if (timeout < 0)
+		return -1;
+	long long ms = (timeout + 999999) / 1000000;
+	return ms < INT_MAX ? (int)ms : INT_MAX;
+}
+
+/** Close both ends of the notification pipe. */
+static void
+coro_poller_close_notify(struct coro_poller *p)
+{
+	close(p->notify_fd[0]);
+	if (p->notify_fd[1] != p->notify_fd[0])
+		close(p->notify_fd[1]);
+}
+
+/** Wake up the poller thread. Can be called from any thread. */
+static void
+coro_poller_notify(struct coro_poller *p)
+{
+	uint64_t one = 1;
+	while (write(p->notify_fd[1], &one, sizeof(one)) < 0 &&
+	       errno == EINTR) {
+	}
+}
+
+#ifdef __linux__
+
+static int
+coro_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags, const void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, arg_size);
+}
+
+/** Get a free submission entry. The ring is never full. */
+static struct io_uring_sqe *
+coro_uring_sqe(struct coro_poller *p)
+{
+	unsigned tail = *p->sq_tail;
+	struct io_uring_sqe *sqe = &p->sqes[tail & p->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/** Submit the entry returned by coro_uring_sqe(). */
+static void
+coro_uring_submit(struct coro_poller *p)
+{
+	unsigned tail = *p->sq_tail;
+	p->sq_array[tail & p->sq_mask] = tail & p->sq_mask;
+	__atomic_store_n(p->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	while (coro_uring_enter(p->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			handle_error();
+	}
+}
+
+/** Start reading the notification eventfd. */
+static void
+coro_uring_arm_notify(struct coro_poller *p)
+{
+	struct io_uring_sqe *sqe = coro_uring_sqe(p);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = p->notify_fd[0];
+	sqe->addr = (uintptr_t)&p->notify_buf;
+	sqe->len = sizeof(p->notify_buf);
+	sqe->user_data = CORO_POLLER_NOTIFY_TAG;
+	coro_uring_submit(p);
+}
+
+/**
+ * Create io_uring. It is used only if it can read and write at the
+ * current file position, like read() and write() do, and can wait
+ * for completions with a timeout.
+ */
+static bool
+coro_uring_create(struct coro_poller *p)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = CORO_URING_CQ_SIZE;
+	p->ring_fd = syscall(__NR_io_uring_setup, 64, &params);
+	if (p->ring_fd < 0)
+		return false;
+	if ((params.features & IORING_FEAT_RW_CUR_POS) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0) {
+		close(p->ring_fd);
+		p->ring_fd = -1;
+		return false;
+	}
+	p->sq_map_size = params.sq_off.array +
+			 params.sq_entries * sizeof(unsigned);
+	p->cq_map_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	bool is_single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single && p->cq_map_size > p->sq_map_size)
+		p->sq_map_size = p->cq_map_size;
+	p->sq_map = mmap(NULL, p->sq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, p->ring_fd,
+			 IORING_OFF_SQ_RING);
+	if (p->sq_map == MAP_FAILED)
 		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
+	if (is_single) {
+		p->cq_map = p->sq_map;
+	} else {
+		p->cq_map = mmap(NULL, p->cq_map_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, p->ring_fd,
+				 IORING_OFF_CQ_RING);
+		if (p->cq_map == MAP_FAILED)
+			handle_error();
+	}
+	p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	p->sqes = mmap(NULL, p->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, p->ring_fd,
+		       IORING_OFF_SQES);
+	if (p->sqes == MAP_FAILED)
 		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+	char *sq = p->sq_map, *cq = p->cq_map;
+	p->sq_head = (unsigned *)(sq + params.sq_off.head);
+	p->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	p->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	p->sq_array = (unsigned *)(sq + params.sq_off.array);
+	p->cq_head = (unsigned *)(cq + params.cq_off.head);
+	p->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	p->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	p->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	/* One completion is always reserved for the notification. */
+	p->capacity = params.cq_entries - 1;
+	coro_uring_arm_notify(p);
+	return true;
+}
+
+static void
+coro_uring_destroy(struct coro_poller *p)
+{
+	munmap(p->sqes, p->sqes_size);
+	if (p->cq_map != p->sq_map)
+		munmap(p->cq_map, p->cq_map_size);
+	munmap(p->sq_map, p->sq_map_size);
+	close(p->ring_fd);
+}
+
+/** Handle all the ready completions. */
+static void
+coro_uring_reap(struct coro_poller *p)
+{
+	unsigned head = *p->cq_head;
+	unsigned tail = __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &p->cqes[head & p->cq_mask];
+		uint64_t tag = cqe->user_data;
+		int res = cqe->res;
+		/* Let the kernel reuse the entry right away. */
+		__atomic_store_n(p->cq_head, head + 1, __ATOMIC_RELEASE);
+		if (tag == CORO_POLLER_NOTIFY_TAG) {
+			coro_uring_arm_notify(p);
+			continue;
+		}
+		coro_poller_release(p);
+		coro_io_req_complete((struct coro_io_req *)(uintptr_t)tag, res);
+	}
+}
+
+static void
+coro_poller_create(struct coro_poller *p)
+{
+	memset(p, 0, sizeof(*p));
+	/* io_uring does not wait on non-blocking descriptors. */
+	p->notify_fd[0] = eventfd(0, EFD_CLOEXEC);
+	if (p->notify_fd[0] < 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	p->notify_fd[1] = p->notify_fd[0];
+	p->ring_fd = -1;
+	p->epoll_fd = -1;
+	if (!coro_poller_use_epoll && coro_uring_create(p))
+		return;
+	if (fcntl(p->notify_fd[0], F_SETFL, O_NONBLOCK) != 0)
+		handle_error();
+	p->capacity = INT32_MAX;
+	p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (p->epoll_fd < 0)
 		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, p->notify_fd[0], &ev) != 0)
+		handle_error();
+}
 
-	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
-	return c;
+static void
+coro_poller_destroy(struct coro_poller *p)
+{
+	if (p->ring_fd >= 0)
+		coro_uring_destroy(p);
+	else
+		close(p->epoll_fd);
+	coro_poller_close_notify(p);
+}
+
+/** True, if the I/O operations are done by the poller itself. */
+static inline bool
+coro_poller_is_async(const struct coro_poller *p)
+{
+	return p->ring_fd >= 0;
+}
+
+/**
+ * Start waiting for readiness of a descriptor. The request is
+ * completed when it is ready. Another coroutine can wait for the
+ * same descriptor already, then a duplicate of it is registered.
+ * @retval The registered descriptor.
+ * @retval -1 The descriptor can't be waited for, like regular
+ *         files.
+ */
+static int
+coro_poller_add_fd(struct coro_poller *p, int fd, short events,
+		   struct coro_io_req *req)
+{
+	struct epoll_event ev;
+	ev.events = (events & POLLIN ? EPOLLIN : 0) |
+		    (events & POLLOUT ? EPOLLOUT : 0) | EPOLLONESHOT;
+	ev.data.ptr = req;
+	if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+		return fd;
+	if (errno == EPERM)
+		return -1;
+	if (errno != EEXIST)
+		handle_error();
+	int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd < 0 ||
+	    epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, dup_fd, &ev) != 0)
+		handle_error();
+	return dup_fd;
+}
+
+/** Stop waiting for a descriptor registered by coro_poller_add_fd(). */
+static void
+coro_poller_delete_fd(struct coro_poller *p, int fd, int poll_fd)
+{
+	/*
+	 * A registration belongs to the open file, not to the number.
+	 * Closing a duplicate keeps it while the original is open, and
+	 * the next duplicate with the same number would get EEXIST.
+	 */
+	epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, poll_fd, NULL);
+	if (poll_fd != fd)
+		close(poll_fd);
+}
+
+/**
+ * Wait until at least one operation completes, or the poller is
+ * notified, or the timeout passes, and handle what is ready.
+ * @param timeout Nanoseconds, -1 to wait without a limit, 0 to only
+ *        handle what is ready already.
+ */
+static void
+coro_poller_wait(struct coro_poller *p, long long timeout)
+{
+	if (p->ring_fd >= 0) {
+		struct __kernel_timespec ts;
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		unsigned flags = IORING_ENTER_GETEVENTS;
+		if (timeout > 0) {
+			ts.tv_sec = timeout / 1000000000;
+			ts.tv_nsec = timeout % 1000000000;
+			arg.ts = (uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+		if (timeout != 0 &&
+		    __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE) ==
+		    *p->cq_head &&
+		    coro_uring_enter(p->ring_fd, 0, 1, flags,
+				     timeout > 0 ? &arg : NULL,
+				     timeout > 0 ? sizeof(arg) : 0) < 0 &&
+		    errno != EINTR && errno != ETIME)
+			handle_error();
+		coro_uring_reap(p);
+		return;
+	}
+	struct epoll_event events[64];
+	int count = epoll_wait(p->epoll_fd, events, 64,
+			       coro_poller_timeout_ms(timeout));
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < count; ++i) {
+		struct coro_io_req *req = events[i].data.ptr;
+		if (req == NULL) {
+			while (read(p->notify_fd[0], &p->notify_buf,
+				    sizeof(p->notify_buf)) > 0) {
+			}
+			continue;
+		}
+		coro_poller_release(p);
+		coro_io_req_complete(req, 0);
+	}
+}
+
+#else /* !__linux__ */
+
+static void
+coro_poller_create(struct coro_poller *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->capacity = INT32_MAX;
+	if (pipe(p->notify_fd) != 0)
+		handle_error();
+	for (int i = 0; i < 2; ++i) {
+		fcntl(p->notify_fd[i], F_SETFL, O_NONBLOCK);
+		fcntl(p->notify_fd[i], F_SETFD, FD_CLOEXEC);
+	}
+}
+
+static void
+coro_poller_destroy(struct coro_poller *p)
+{
+	free(p->fds);
+	free(p->reqs);
+	coro_poller_close_notify(p);
+}
+
+static inline bool
+coro_poller_is_async(const struct coro_poller *p)
+{
+	(void)p;
+	return false;
+}
+
+static int
+coro_poller_add_fd(struct coro_poller *p, int fd, short events,
+		   struct coro_io_req *req)
+{
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		return -1;
+	if (p->fd_count == p->fd_capacity) {
+		p->fd_capacity = (p->fd_capacity + 1) * 2;
+		p->fds = realloc(p->fds, p->fd_capacity * sizeof(p->fds[0]));
+		p->reqs = realloc(p->reqs,
+				  p->fd_capacity * sizeof(p->reqs[0]));
+	}
+	p->fds[p->fd_count].fd = fd;
+	p->fds[p->fd_count].events = events;
+	p->reqs[p->fd_count] = req;
+	++p->fd_count;
+	return fd;
+}
+
+static void
+coro_poller_delete_fd(struct coro_poller *p, int fd, int poll_fd)
+{
+	(void)p;
+	(void)fd;
+	(void)poll_fd;
+}
+
+static void
+coro_poller_wait(struct coro_poller *p, long long timeout)
+{
+	/* The notification pipe goes last. */
+	int count = p->fd_count;
+	if (p->fd_count == p->fd_capacity) {
+		p->fd_capacity = (p->fd_capacity + 1) * 2;
+		p->fds = realloc(p->fds, p->fd_capacity * sizeof(p->fds[0]));
+		p->reqs = realloc(p->reqs,
+				  p->fd_capacity * sizeof(p->reqs[0]));
+	}
+	p->fds[count].fd = p->notify_fd[0];
+	p->fds[count].events = POLLIN;
+	int rc = poll(p->fds, count + 1, coro_poller_timeout_ms(timeout));
+	if (rc < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	if (p->fds[count].revents != 0) {
+		while (read(p->notify_fd[0], &p->notify_buf,
+			    sizeof(p->notify_buf)) > 0) {
+		}
+	}
+	for (int i = 0; i < p->fd_count;) {
+		if (p->fds[i].revents == 0) {
+			++i;
+			continue;
+		}
+		struct coro_io_req *req = p->reqs[i];
+		--p->fd_count;
+		p->fds[i] = p->fds[p->fd_count];
+		p->reqs[i] = p->reqs[p->fd_count];
+		coro_poller_release(p);
+		coro_io_req_complete(req, 0);
+	}
+}
+
+#endif /* !__linux__ */
+
+/**
+ * Run the coroutine function and return into the scheduler. It
+ * is the first thing each coroutine does on its own stack.
+ */
+static void
+coro_main(struct coro *c);
+
+#if defined(CORO_BACKEND_ASM)
+
+/**
+ * Save callee-saved registers of the current context on its stack,
+ * store the stack pointer into @a from_sp, and restore the context
+ * saved at @a to_sp. Defined in assembly below.
+ */
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
+#if defined(__x86_64__)
+
+/*
+ * Stack frame layout, from the lowest address: MXCSR and x87
+ * control word (8 bytes), r15, r14, r13, r12, rbx, rbp, return
+ * address.
+ */
+enum { CORO_CTX_FRAME_WORDS = 8 };
+
+__asm__(
+"	.text\n"
+"	.p2align 4\n"
+"	.type coro_ctx_switch_asm, @function\n"
+"coro_ctx_switch_asm:\n"
+"	pushq %rbp\n"
+"	pushq %rbx\n"
+"	pushq %r12\n"
+"	pushq %r13\n"
+"	pushq %r14\n"
+"	pushq %r15\n"
+"	subq $8, %rsp\n"
+"	stmxcsr (%rsp)\n"
+"	fnstcw 4(%rsp)\n"
+"	movq %rsp, (%rdi)\n"
+"	movq %rsi, %rsp\n"
+"	ldmxcsr (%rsp)\n"
+"	fldcw 4(%rsp)\n"
+"	addq $8, %rsp\n"
+"	popq %r15\n"
+"	popq %r14\n"
+"	popq %r13\n"
+"	popq %r12\n"
+"	popq %rbx\n"
+"	popq %rbp\n"
+"	ret\n"
+"	.size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+);
+
+#else /* __aarch64__ */
+
+/*
+ * Stack frame layout, from the lowest address: x19-x28, x29 (frame
+ * pointer), x30 (return address), d8-d15.
+ */
+enum { CORO_CTX_FRAME_WORDS = 20 };
+
+__asm__(
+"	.text\n"
+"	.p2align 4\n"
+"	.type coro_ctx_switch_asm, %function\n"
+"coro_ctx_switch_asm:\n"
+"	sub sp, sp, #160\n"
+"	stp x19, x20, [sp, #0]\n"
+"	stp x21, x22, [sp, #16]\n"
+"	stp x23, x24, [sp, #32]\n"
+"	stp x25, x26, [sp, #48]\n"
+"	stp x27, x28, [sp, #64]\n"
+"	stp x29, x30, [sp, #80]\n"
+"	stp d8, d9, [sp, #96]\n"
+"	stp d10, d11, [sp, #112]\n"
+"	stp d12, d13, [sp, #128]\n"
+"	stp d14, d15, [sp, #144]\n"
+"	mov x9, sp\n"
+"	str x9, [x0]\n"
+"	mov sp, x1\n"
+"	ldp x19, x20, [sp, #0]\n"
+"	ldp x21, x22, [sp, #16]\n"
+"	ldp x23, x24, [sp, #32]\n"
+"	ldp x25, x26, [sp, #48]\n"
+"	ldp x27, x28, [sp, #64]\n"
+"	ldp x29, x30, [sp, #80]\n"
+"	ldp d8, d9, [sp, #96]\n"
+"	ldp d10, d11, [sp, #112]\n"
+"	ldp d12, d13, [sp, #128]\n"
+"	ldp d14, d15, [sp, #144]\n"
+"	add sp, sp, #160\n"
+"	ret\n"
+"	.size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+);
+
+#endif
+
+/** Entry point of each new coroutine, "returned" into from asm. */
+static void
+coro_body(void)
+{
+	coro_main(coro_worker_this()->current);
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_switch_asm(&from->sp, to->sp);
+}
+
+/**
+ * Build a fake frame on top of the new stack, looking exactly like
+ * the one coro_ctx_switch_asm() leaves. The first switch into it
+ * "returns" into coro_body().
+ */
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uintptr_t *frame;
+#if defined(__x86_64__)
+	/*
+	 * One more word above the return address to get the ABI stack
+	 * alignment at coro_body() entry - as if it was called.
+	 */
+	frame = (uintptr_t *)top - CORO_CTX_FRAME_WORDS - 1;
+	memset(frame, 0, (CORO_CTX_FRAME_WORDS + 1) * sizeof(*frame));
+	/* Default MXCSR and x87 control word. */
+	frame[0] = 0x1F80 | ((uintptr_t)0x037F << 32);
+	frame[7] = (uintptr_t)coro_body;
+#else
+	frame = (uintptr_t *)top - CORO_CTX_FRAME_WORDS;
+	memset(frame, 0, CORO_CTX_FRAME_WORDS * sizeof(*frame));
+	frame[11] = (uintptr_t)coro_body;
+#endif
+	ctx->sp = frame;
+}
+
+#elif defined(CORO_BACKEND_UCONTEXT)
+
+/** Entry point of each new coroutine, called by makecontext(). */
+static void
+coro_body(void)
+{
+	coro_main(coro_worker_this()->current);
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
+}
+
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size)
+{
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, coro_body, 0);
+}
+
+#else /* CORO_BACKEND_SIGNAL */
+
+/**
+ * Buffer, used by the coroutine constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static __thread sigjmp_buf start_point;
+/** Context of the coroutine being created. */
+static __thread struct coro_ctx *volatile new_ctx;
+/**
+ * The signal handler is process-wide, so coroutines can't be
+ * created by several threads at once.
+ */
+static pthread_mutex_t new_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+/**
+ * The core part of the coroutines creation - this signal handler
+ * is run on a separate stack using sigaltstack. On an invokation
+ * it remembers its current context and jumps back to the
+ * coroutine constructor. Later the coroutine continues from here.
+ */
+static void
+coro_body(int signum)
+{
+	(void)signum;
+	struct coro_ctx *ctx = new_ctx;
+	new_ctx = NULL;
+	/*
+	 * On an invokation jump back to the constructor right
+	 * after remembering the context.
+	 */
+	if (sigsetjmp(ctx->buf, 0) == 0)
+		siglongjmp(start_point, 1);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finaly start work.
+	 */
+	coro_main(coro_worker_this()->current);
+}
+
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size)
+{
+	pthread_mutex_lock(&new_ctx_lock);
+	new_ctx = ctx;
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
+	sigaddset(&news, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+		handle_error();
+	/*
+	 * New handler should jump onto a new stack and remember
+	 * that position. Afterwards the stack is disabled and
+	 * becomes dedicated to that single coroutine.
+	 */
+	struct sigaction newsa, oldsa;
+	newsa.sa_handler = coro_body;
+	newsa.sa_flags = SA_ONSTACK;
+	sigemptyset(&newsa.sa_mask);
+	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
+		handle_error();
+	/* Create that new stack. */
+	stack_t oldst, newst;
+	newst.ss_sp = stack;
+	newst.ss_size = stack_size;
+	newst.ss_flags = 0;
+	if (sigaltstack(&newst, &oldst) != 0)
+		handle_error();
+	/* Jump onto the stack and remember its position. */
+	sigemptyset(&suss);
+	if (sigsetjmp(start_point, 1) == 0) {
+		raise(SIGUSR2);
+		while (new_ctx != NULL)
+			sigsuspend(&suss);
+	}
+	/*
+	 * Return the old stack, unblock SIGUSR2. In other words,
+	 * rollback all global changes. The newly created stack
+	 * now is remembered only by the new coroutine, and can be
+	 * used by it only.
+	 */
+	if (sigaltstack(NULL, &newst) != 0)
+		handle_error();
+	newst.ss_flags = SS_DISABLE;
+	if (sigaltstack(&newst, NULL) != 0)
+		handle_error();
+	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
+	    sigaltstack(&oldst, NULL) != 0)
+		handle_error();
+	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+		handle_error();
+	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+		handle_error();
+	pthread_mutex_unlock(&new_ctx_lock);
+}
+
+#endif
+
+const char *
+coro_backend(void)
+{
+#if defined(CORO_BACKEND_ASM)
+	return "asm";
+#elif defined(CORO_BACKEND_UCONTEXT)
+	return "ucontext";
+#else
+	return "signal";
+#endif
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+long long
+coro_work_time(const struct coro *c)
+{
+	uint64_t ticks = c->work_ticks;
+	if (c == coro_worker_this()->current)
+		ticks += coro_clock_ticks() - c->slice_start;
+	return ticks * coro_clock.ns_per_tick;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	coro_stack_delete(c->stack);
+	free(c);
+}
+
+/** Wake up an idle worker, if any, to check the queues. */
+static void
+coro_sched_wakeup_idle(void)
+{
+	/* Pairs with the idle counter increment in the idle worker. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_sched.idle_count, __ATOMIC_RELAXED) == 0)
+		return;
+	for (int i = 0; i < coro_sched.worker_count; ++i) {
+		struct coro_worker *w = &coro_sched.workers[i];
+		bool is_idle = true;
+		if (__atomic_compare_exchange_n(&w->is_idle, &is_idle, false,
+						false, __ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			coro_poller_notify(&w->poller);
+			return;
+		}
+	}
+}
+
+/** Remember when a coroutine became ready, to check its budget. */
+static inline void
+coro_mark_ready(struct coro *c)
+{
+	if (c->budget != 0)
+		c->ready_since = coro_clock_ticks();
+}
+
+/** Make a coroutine ready to run in the given worker. */
+static void
+coro_worker_push(struct coro_worker *w, struct coro *c)
+{
+	coro_mark_ready(c);
+	if (!coro_sched.is_mt) {
+		coro_runq_push(&w->ready, c);
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	coro_runq_push(&w->ready, c);
+	pthread_mutex_unlock(&w->lock);
+	coro_sched_wakeup_idle();
+}
+
+/**
+ * Steal half of the ready coroutines of some other worker. The
+ * first of them is returned, the others are moved into the ready
+ * queue of @a w.
+ */
+static struct coro *
+coro_worker_steal(struct coro_worker *w)
+{
+	int count = coro_sched.worker_count;
+	int start = rand_r(&w->steal_seed) % count;
+	for (int i = 0; i < count; ++i) {
+		struct coro_worker *victim =
+			&coro_sched.workers[(start + i) % count];
+		if (victim == w || pthread_mutex_trylock(&victim->lock) != 0)
+			continue;
+		struct coro *res = coro_runq_pop(&victim->ready);
+		if (res == NULL) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		struct coro_queue stolen = {0};
+		for (int n = coro_runq_size(&victim->ready) / 2; n > 0; --n)
+			coro_queue_push(&stolen, coro_runq_pop(&victim->ready));
+		pthread_mutex_unlock(&victim->lock);
+		if (stolen.head != NULL) {
+			pthread_mutex_lock(&w->lock);
+			coro_runq_splice(&w->ready, &stolen);
+			pthread_mutex_unlock(&w->lock);
+		}
+		return res;
+	}
+	return NULL;
+}
+
+/** Take the next coroutine from the own queue of the worker. */
+static struct coro *
+coro_worker_pop_local(struct coro_worker *w)
+{
+	if (!coro_sched.is_mt) {
+		if (__atomic_load_n(&w->remote.head, __ATOMIC_RELAXED) != NULL) {
+			pthread_mutex_lock(&w->lock);
+			coro_runq_splice(&w->ready, &w->remote);
+			pthread_mutex_unlock(&w->lock);
+		}
+		return coro_runq_pop(&w->ready);
+	}
+	pthread_mutex_lock(&w->lock);
+	struct coro *c = coro_runq_pop(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+	return c;
+}
+
+/**
+ * Take the next coroutine to run in the given worker. Expired
+ * timers and completed I/O are checked on the way, so the
+ * coroutines waiting for them take their turn too.
+ */
+static struct coro *
+coro_worker_pop(struct coro_worker *w)
+{
+	struct coro_poller *p = &w->poller;
+	bool is_async = coro_poller_is_async(p);
+	if (__atomic_load_n(&w->timers.count, __ATOMIC_RELAXED) > 0)
+		coro_timer_wheel_expire(&w->timers);
+	if (p->pending > 0 &&
+	    (is_async || ++p->poll_tick % CORO_POLL_PERIOD == 0))
+		coro_poller_wait(p, 0);
+	struct coro *c = coro_worker_pop_local(w);
+	if (c == NULL && p->pending > 0 && !is_async) {
+		coro_poller_wait(p, 0);
+		c = coro_worker_pop_local(w);
+	}
+	if (c == NULL && coro_sched.is_mt)
+		c = coro_worker_steal(w);
+	return c;
+}
+
+/** Make a finished coroutine visible to coro_sched_wait(). */
+static void
+coro_sched_finish(struct coro *c)
+{
+	if (!coro_sched.is_mt) {
+		coro_queue_push(&coro_sched.finished, c);
+		return;
+	}
+	pthread_mutex_lock(&coro_sched.lock);
+	coro_queue_push(&coro_sched.finished, c);
+	pthread_cond_signal(&coro_sched.finished_cond);
+	pthread_mutex_unlock(&coro_sched.lock);
+}
+
+/**
+ * Complete a switch in the new context: the previous coroutine is
+ * saved now and can be given to others.
+ */
+static void
+coro_switch_done(void)
+{
+	struct coro_worker *w = coro_worker_this();
+	enum coro_switch_action action = w->prev_action;
+	w->prev_action = CORO_SWITCH_NONE;
+	switch (action) {
+	case CORO_SWITCH_REQUEUE:
+		coro_worker_push(w, w->prev);
+		break;
+	case CORO_SWITCH_FINISH:
+		if (w->prev->is_detached)
+			coro_delete(w->prev);
+		else
+			coro_sched_finish(w->prev);
+		break;
+	case CORO_SWITCH_SUSPEND: {
+		struct coro *c = w->prev;
+		int state = CORO_WAIT_NONE;
+		if (__atomic_compare_exchange_n(&c->wait_state, &state,
+						CORO_WAIT_SUSPENDED, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			break;
+		/* Notified before it got suspended - run it again. */
+		__atomic_store_n(&c->wait_state, CORO_WAIT_NONE,
+				 __ATOMIC_SEQ_CST);
+		coro_worker_push(w, c);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static inline void
+coro_trace_add(struct coro_worker *w, uint64_t ticks,
+	       enum coro_trace_type type, uint64_t from, uint64_t to,
+	       enum coro_switch_action action)
+{
+	struct coro_trace_event *e =
+		&w->trace[w->trace_count++ & (w->trace_size - 1)];
+	e->ticks = ticks;
+	e->from = from;
+	e->to = to;
+	e->type = type;
+	e->action = action;
+}
+
+/** Count a run of a coroutine with a budget, and if it is late. */
+static void
+coro_worker_check_budget(struct coro_worker *w, struct coro *c,
+			 uint64_t now)
+{
+	__atomic_add_fetch(&w->budget_dispatch_count, 1, __ATOMIC_RELAXED);
+	uint64_t deadline = c->ready_since + c->budget;
+	if (now <= deadline)
+		return;
+	++c->budget_miss_count;
+	__atomic_add_fetch(&w->budget_miss_count, 1, __ATOMIC_RELAXED);
+	if (now - deadline > w->max_lateness)
+		__atomic_store_n(&w->max_lateness, now - deadline,
+				 __ATOMIC_RELAXED);
+}
+
+/**
+ * Whether the current coroutine should give way to the first ready
+ * one, if it was put back into the queue now. Under round robin it
+ * always should.
+ */
+static bool
+coro_worker_should_yield(struct coro_worker *w)
+{
+	if (coro_sched_policy() == CORO_SCHED_RR)
+		return true;
+	struct coro *c = w->current;
+	if (coro_sched.is_mt)
+		pthread_mutex_lock(&w->lock);
+	struct coro *first = coro_runq_first(&w->ready);
+	/* Equal keys take turns, like in round robin. */
+	bool res = first == NULL ||
+		   first->sched_key <=
+		   coro_sched_key(c, c->budget != 0 ? coro_clock_ticks() : 0);
+	if (coro_sched.is_mt)
+		pthread_mutex_unlock(&w->lock);
+	return res;
+}
+
+/**
+ * Switch the current coroutine to an arbitrary one. The switched
+ * out coroutine is handled according to @a action.
+ */
+static void
+coro_yield_to(struct coro_worker *w, struct coro *to,
+	      enum coro_switch_action action)
+{
+	struct coro *from = w->current;
+	++from->switch_count;
+	uint64_t now = coro_clock_ticks();
+	from->work_ticks += now - from->slice_start;
+	to->slice_start = now;
+	if (to->budget != 0)
+		coro_worker_check_budget(w, to, now);
+	if (coro_sched_is_tracing())
+		coro_trace_add(w, now, CORO_TRACE_SWITCH, from->id, to->id,
+			       action);
+	w->current = to;
+	w->prev = from;
+	w->prev_action = action;
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	/* Can be another thread here. */
+	coro_switch_done();
+}
+
+/** Switch to the next ready coroutine, if there is one. */
+static bool
+coro_yield_next(void)
+{
+	struct coro_worker *w = coro_worker_this();
+	/* The scheduler is not a part of the round robin. */
+	if (w->current == &w->sched || !coro_worker_should_yield(w))
+		return false;
+	struct coro *to = coro_worker_pop(w);
+	if (to == NULL)
+		return false;
+	coro_yield_to(w, to, CORO_SWITCH_REQUEUE);
+	return true;
+}
+
+void
+coro_yield(void)
+{
+	coro_yield_next();
+}
+
+bool
+coro_yield_if_expired(void)
+{
+	struct coro_worker *w = coro_worker_this();
+	/* Helpers doing long work can be used without the scheduler. */
+	if (w == NULL)
+		return false;
+	struct coro *c = w->current;
+	uint64_t now = coro_clock_ticks();
+	if (now - c->slice_start <
+	    __atomic_load_n(&coro_clock.quantum, __ATOMIC_RELAXED))
+		return false;
+	if (coro_yield_next())
+		return true;
+	/* Nobody to switch to - start a new quantum. */
+	c->work_ticks += now - c->slice_start;
+	c->slice_start = now;
+	return false;
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_worker *w = coro_worker_this();
+	/* The scheduler can't be suspended, it has nothing to return to. */
+	if (w->current == &w->sched)
+		return;
+	struct coro *to = coro_worker_pop(w);
+	if (to == NULL)
+		to = &w->sched;
+	coro_yield_to(w, to, CORO_SWITCH_SUSPEND);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	/*
+	 * Either the wakeup sees the coroutine suspended and makes it
+	 * ready, or the coroutine, when suspends, sees the
+	 * notification and stays ready.
+	 */
+	int state = __atomic_load_n(&c->wait_state, __ATOMIC_SEQ_CST);
+	while (true) {
+		if (state == CORO_WAIT_NOTIFIED)
+			return;
+		int new_state = state == CORO_WAIT_SUSPENDED ?
+				CORO_WAIT_NONE : CORO_WAIT_NOTIFIED;
+		if (__atomic_compare_exchange_n(&c->wait_state, &state,
+						new_state, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			break;
+	}
+	if (state != CORO_WAIT_SUSPENDED)
+		return;
+	struct coro_worker *w = coro_worker_this();
+	if (!coro_sched.is_mt) {
+		coro_mark_ready(c);
+		if (w == &coro_sched.main) {
+			coro_runq_push(&w->ready, c);
+			return;
+		}
+		w = &coro_sched.main;
+		pthread_mutex_lock(&w->lock);
+		coro_queue_push(&w->remote, c);
+		pthread_mutex_unlock(&w->lock);
+		coro_poller_notify(&w->poller);
+		return;
+	}
+	if (w == NULL || w == &coro_sched.main) {
+		unsigned i = __atomic_fetch_add(&coro_sched.next_worker, 1,
+						__ATOMIC_RELAXED);
+		w = &coro_sched.workers[i % coro_sched.worker_count];
+	}
+	coro_worker_push(w, c);
+}
+
+long long
+coro_time(void)
+{
+	return coro_clock_monotonic() / 1000;
+}
+
+bool
+coro_suspend_until(long long deadline)
+{
+	struct coro_worker *w = coro_worker_this();
+	if (w == NULL || w->current == &w->sched)
+		return coro_time() < deadline;
+	uint64_t deadline_ns = (uint64_t)deadline * 1000;
+	if (coro_clock_monotonic() >= deadline_ns)
+		return false;
+	struct coro_timer t;
+	t.coro = w->current;
+	/* Rounded up, a timer never fires early. */
+	t.expire = (deadline_ns + CORO_TIMER_TICK_NS - 1) / CORO_TIMER_TICK_NS;
+	t.wheel = &w->timers;
+	t.is_fired = false;
+	coro_timer_wheel_lock(t.wheel);
+	/* An empty wheel is not run, catch up with the time. */
+	if (t.wheel->count == 0)
+		t.wheel->now = coro_timer_tick_now();
+	coro_timer_wheel_link(t.wheel, &t);
+	__atomic_add_fetch(&t.wheel->count, 1, __ATOMIC_RELAXED);
+	coro_timer_wheel_unlock(t.wheel);
+	coro_suspend();
+	/* Can be another thread here. */
+	coro_timer_wheel_lock(t.wheel);
+	if (t.is_linked) {
+		coro_timer_wheel_unlink(t.wheel, &t);
+		__atomic_sub_fetch(&t.wheel->count, 1, __ATOMIC_RELAXED);
+	}
+	coro_timer_wheel_unlock(t.wheel);
+	return !t.is_fired;
+}
+
+void
+coro_sleep_until(long long deadline)
+{
+	struct coro_worker *w = coro_worker_this();
+	if (w == NULL || w->current == &w->sched) {
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000;
+		ts.tv_nsec = deadline % 1000000 * 1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR) {
+		}
+		return;
+	}
+	/* Wakeups meant for other waits are ignored. */
+	while (coro_suspend_until(deadline)) {
+	}
+}
+
+void
+coro_sleep(long long usec)
+{
+	coro_sleep_until(coro_time() + usec);
+}
+
+void
+coro_sched_set_policy(enum coro_sched_policy policy)
+{
+	__atomic_store_n(&coro_sched.policy, policy, __ATOMIC_RELAXED);
+}
+
+void
+coro_set_priority(int priority)
+{
+	struct coro_worker *w = coro_worker_this();
+	if (w != NULL && w->current != &w->sched)
+		w->current->priority = priority;
+}
+
+void
+coro_set_budget(long long usec)
+{
+	struct coro_worker *w = coro_worker_this();
+	if (w != NULL && w->current != &w->sched)
+		w->current->budget = usec * 1000 / coro_clock.ns_per_tick;
+}
+
+long long
+coro_budget_miss_count(const struct coro *c)
+{
+	return c->budget_miss_count;
+}
+
+void
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	uint64_t max_lateness = 0;
+	for (int i = 0; i < coro_sched.worker_count; ++i) {
+		struct coro_worker *w = &coro_sched.workers[i];
+		stats->budget_dispatch_count +=
+			__atomic_load_n(&w->budget_dispatch_count,
+					__ATOMIC_RELAXED);
+		stats->budget_miss_count +=
+			__atomic_load_n(&w->budget_miss_count,
+					__ATOMIC_RELAXED);
+		uint64_t lateness = __atomic_load_n(&w->max_lateness,
+						    __ATOMIC_RELAXED);
+		if (lateness > max_lateness)
+			max_lateness = lateness;
+	}
+	stats->max_lateness = max_lateness * coro_clock.ns_per_tick;
+}
+
+/**
+ * Threads, which can record events: the workers, and then the main
+ * thread in the multi thread mode. It creates coroutines there.
+ */
+static inline int
+coro_trace_thread_count(void)
+{
+	return coro_sched.worker_count + (coro_sched.is_mt ? 1 : 0);
+}
+
+static inline struct coro_worker *
+coro_trace_thread(int i)
+{
+	return i < coro_sched.worker_count ? &coro_sched.workers[i] :
+	       &coro_sched.main;
+}
+
+void
+coro_trace_start(size_t event_count)
+{
+	size_t size = 1;
+	while (size < event_count)
+		size *= 2;
+	for (int i = 0; i < coro_trace_thread_count(); ++i) {
+		struct coro_worker *w = coro_trace_thread(i);
+		free(w->trace);
+		w->trace = malloc(size * sizeof(w->trace[0]));
+		if (w->trace == NULL)
+			handle_error();
+		w->trace_size = size;
+		w->trace_count = 0;
+	}
+	coro_sched.trace_start = coro_clock_ticks();
+	__atomic_store_n(&coro_sched.is_tracing, true, __ATOMIC_RELEASE);
+}
+
+void
+coro_trace_stop(void)
+{
+	__atomic_store_n(&coro_sched.is_tracing, false, __ATOMIC_RELEASE);
+}
+
+static const char *
+coro_trace_action_name(uint32_t action)
+{
+	switch (action) {
+	case CORO_SWITCH_REQUEUE:
+		return "yield";
+	case CORO_SWITCH_FINISH:
+		return "finish";
+	case CORO_SWITCH_SUSPEND:
+		return "suspend";
+	default:
+		return "none";
+	}
+}
+
+/** Microseconds since the trace start, as Chrome trace wants. */
+static double
+coro_trace_usec(uint64_t ticks)
+{
+	return (double)(ticks - coro_sched.trace_start) *
+	       coro_clock.ns_per_tick / 1000;
+}
+
+/**
+ * Write the events of one thread. Its track in the process 0 shows
+ * what ran there, the gaps are idle time. The tracks in the process
+ * 1 show each coroutine, the gaps are its waits.
+ */
+static void
+coro_trace_dump_thread(FILE *f, const struct coro_worker *w, int tid)
+{
+	uint64_t first = w->trace_count > w->trace_size ?
+			 w->trace_count - w->trace_size : 0;
+	/* The start of the slice running before the oldest event is lost. */
+	bool has_slice = false;
+	uint64_t slice_start = 0;
+	for (uint64_t i = first; i < w->trace_count; ++i) {
+		const struct coro_trace_event *e =
+			&w->trace[i & (w->trace_size - 1)];
+		if (e->type == CORO_TRACE_CREATE) {
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":1,\"tid\":%llu,\"args\":"
+				"{\"name\":\"coro %llu\"}}",
+				(unsigned long long)e->to,
+				(unsigned long long)e->to);
+			fprintf(f, ",\n{\"name\":\"create coro %llu\","
+				"\"ph\":\"i\",\"s\":\"t\",\"pid\":0,"
+				"\"tid\":%d,\"ts\":%.3f}",
+				(unsigned long long)e->to, tid,
+				coro_trace_usec(e->ticks));
+			continue;
+		}
+		if (has_slice && e->from != 0) {
+			double ts = coro_trace_usec(slice_start);
+			double dur = coro_trace_usec(e->ticks) - ts;
+			const char *end = coro_trace_action_name(e->action);
+			fprintf(f, ",\n{\"name\":\"coro %llu\",\"ph\":\"X\","
+				"\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+				"\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+				(unsigned long long)e->from, tid, ts, dur, end);
+			fprintf(f, ",\n{\"name\":\"run\",\"ph\":\"X\","
+				"\"pid\":1,\"tid\":%llu,\"ts\":%.3f,"
+				"\"dur\":%.3f,\"args\":{\"thread\":%d,"
+				"\"end\":\"%s\"}}",
+				(unsigned long long)e->from, ts, dur, tid, end);
+		}
+		has_slice = true;
+		slice_start = e->ticks;
+	}
+}
+
+int
+coro_trace_dump(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+		"\"args\":{\"name\":\"threads\"}},\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"coroutines\"}}");
+	for (int i = 0; i < coro_trace_thread_count(); ++i) {
+		struct coro_worker *w = coro_trace_thread(i);
+		if (w->trace == NULL)
+			continue;
+		bool is_main = w == &coro_sched.main;
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":0,\"tid\":%d,\"args\":{\"name\":"
+			"\"%s %d\"}}", i, is_main ? "main" : "worker", i);
+		coro_trace_dump_thread(f, w, i);
+	}
+	fprintf(f, "\n]}\n");
+	bool is_failed = ferror(f) != 0;
+	if (fclose(f) != 0 || is_failed)
+		return -1;
+	return 0;
+}
+
+void
+coro_sched_set_quantum(long long usec)
+{
+	__atomic_store_n(&coro_clock.quantum,
+			 (uint64_t)(usec * 1000 / coro_clock.ns_per_tick),
+			 __ATOMIC_RELAXED);
+}
+
+/** Prepare the thread to run coroutines. */
+static void
+coro_worker_create(struct coro_worker *w, unsigned seed)
+{
+	memset(w, 0, sizeof(*w));
+	w->current = &w->sched;
+	w->sched.slice_start = coro_clock_ticks();
+	w->steal_seed = seed;
+	pthread_mutex_init(&w->lock, NULL);
+	coro_poller_create(&w->poller);
+	coro_timer_wheel_create(&w->timers);
+}
+
+void
+coro_sched_init(void)
+{
+	memset(&coro_sched, 0, sizeof(coro_sched));
+	coro_clock_calibrate();
+	coro_clock.quantum = 0;
+	coro_worker_create(&coro_sched.main, 0);
+	coro_sched.workers = &coro_sched.main;
+	coro_sched.worker_count = 1;
+	pthread_mutex_init(&coro_sched.lock, NULL);
+	pthread_cond_init(&coro_sched.finished_cond, NULL);
+	coro_worker_ptr = &coro_sched.main;
+}
+
+/**
+ * Wait until there might be something to run. The worker sleeps
+ * in its poller, so it wakes up on completed I/O as well, and not
+ * later than the nearest deadline of its timers.
+ * @retval Whether the worker should exit.
+ */
+static bool
+coro_worker_idle(struct coro_worker *w)
+{
+	__atomic_store_n(&w->is_idle, true, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&coro_sched.idle_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * The queues are checked once more after the idle counter
+	 * is visible. Either this worker sees a new coroutine, or
+	 * whoever pushed it sees the counter and notifies.
+	 */
+	bool has_work = __atomic_load_n(&coro_sched.is_stopping,
+					__ATOMIC_SEQ_CST);
+	for (int i = 0; i < coro_sched.worker_count && !has_work; ++i) {
+		struct coro_worker *other = &coro_sched.workers[i];
+		pthread_mutex_lock(&other->lock);
+		has_work = coro_runq_size(&other->ready) > 0;
+		pthread_mutex_unlock(&other->lock);
+	}
+	if (!has_work)
+		coro_poller_wait(&w->poller,
+				 coro_timer_wheel_timeout(&w->timers));
+	__atomic_store_n(&w->is_idle, false, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&coro_sched.idle_count, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&coro_sched.is_stopping, __ATOMIC_SEQ_CST);
+}
+
+/** Worker thread. Runs coroutines until the scheduler stops. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_worker_ptr = w;
+	while (true) {
+		struct coro *c = coro_worker_pop(w);
+		if (c != NULL) {
+			coro_yield_to(w, c, CORO_SWITCH_NONE);
+			continue;
+		}
+		if (coro_worker_idle(w))
+			break;
+	}
+	return NULL;
+}
+
+void
+coro_sched_init_threads(int thread_count)
+{
+	coro_sched_init();
+	if (thread_count <= 0)
+		return;
+	coro_sched.is_mt = true;
+	coro_sched.worker_count = thread_count;
+	coro_sched.workers = calloc(thread_count, sizeof(struct coro_worker));
+	for (int i = 0; i < thread_count; ++i)
+		coro_worker_create(&coro_sched.workers[i], i + 1);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &coro_sched.workers[i];
+		errno = pthread_create(&w->thread, NULL, coro_worker_f, w);
+		if (errno != 0)
+			handle_error();
+	}
+}
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_sched.is_mt) {
+		__atomic_store_n(&coro_sched.is_stopping, true, __ATOMIC_SEQ_CST);
+		for (int i = 0; i < coro_sched.worker_count; ++i)
+			coro_poller_notify(&coro_sched.workers[i].poller);
+		for (int i = 0; i < coro_sched.worker_count; ++i)
+			pthread_join(coro_sched.workers[i].thread, NULL);
+		/* The workers look into each other until all have exited. */
+		for (int i = 0; i < coro_sched.worker_count; ++i) {
+			struct coro_worker *w = &coro_sched.workers[i];
+			pthread_mutex_destroy(&w->lock);
+			coro_poller_destroy(&w->poller);
+			coro_timer_wheel_destroy(&w->timers);
+			coro_runq_destroy(&w->ready);
+			free(w->trace);
+		}
+		free(coro_sched.workers);
+		coro_sched.is_mt = false;
+	}
+	pthread_mutex_destroy(&coro_sched.main.lock);
+	coro_poller_destroy(&coro_sched.main.poller);
+	coro_timer_wheel_destroy(&coro_sched.main.timers);
+	coro_runq_destroy(&coro_sched.main.ready);
+	free(coro_sched.main.trace);
+	pthread_mutex_destroy(&coro_sched.lock);
+	pthread_cond_destroy(&coro_sched.finished_cond);
+	coro_stack_pool_destroy();
+	memset(&coro_sched, 0, sizeof(coro_sched));
+	coro_worker_ptr = NULL;
+}
+
+/** Wait for a coroutine finish in the multi thread mode. */
+static struct coro *
+coro_sched_wait_mt(void)
+{
+	pthread_mutex_lock(&coro_sched.lock);
+	while (coro_sched.finished.head == NULL &&
+	       __atomic_load_n(&coro_sched.alive_count, __ATOMIC_SEQ_CST) > 0)
+		pthread_cond_wait(&coro_sched.finished_cond, &coro_sched.lock);
+	struct coro *c = coro_queue_pop(&coro_sched.finished);
+	if (c != NULL)
+		__atomic_sub_fetch(&coro_sched.alive_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&coro_sched.lock);
+	return c;
+}
+
+/**
+ * Run the coroutines in the single thread mode until one of them
+ * returns to the scheduler. If none is ready, wait for I/O or the
+ * nearest timer instead.
+ */
+static void
+coro_sched_run(void)
+{
+	struct coro_worker *w = &coro_sched.main;
+	struct coro *c = coro_worker_pop(w);
+	if (c == NULL) {
+		/* All the coroutines wait for something. */
+		coro_poller_wait(&w->poller,
+				 coro_timer_wheel_timeout(&w->timers));
+		return;
+	}
+	/*
+	 * Coroutines switch between each other until one of them
+	 * finishes or suspends with nobody else to run.
+	 */
+	w->is_sched_waiting = true;
+	coro_yield_to(w, c, CORO_SWITCH_NONE);
+	w->is_sched_waiting = false;
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	if (coro_sched.is_mt)
+		return coro_sched_wait_mt();
+	while (true) {
+		struct coro *c = coro_queue_pop(&coro_sched.finished);
+		if (c != NULL) {
+			--coro_sched.alive_count;
+			return c;
+		}
+		/* Detached coroutines are not waited for. */
+		if (coro_sched.alive_count == 0)
+			return NULL;
+		coro_sched_run();
+	}
+}
+
+struct coro *
+coro_this(void)
+{
+	return coro_worker_this()->current;
+}
+
+static void
+coro_main(struct coro *c)
+{
+	coro_switch_done();
+	c->ret = c->func(c->func_arg);
+	c->is_finished = true;
+	struct coro_worker *w = coro_worker_this();
+	/* Can not return - 'ret' address is invalid already! */
+	if (!coro_sched.is_mt && !w->is_sched_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	coro_yield_to(w, &w->sched, CORO_SWITCH_FINISH);
+	/* Finished coroutines are never switched back to. */
+	abort();
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, 0);
+}
+
+/** Create a coroutine and make it ready to run. */
+static struct coro *
+coro_create(coro_f func, void *func_arg, size_t stack_size,
+	    bool is_detached)
+{
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->ret = 0;
+	if (stack_size == 0)
+		stack_size = CORO_STACK_SIZE_DEFAULT;
+	if (stack_size < SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	c->stack = coro_stack_new(stack_size);
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->switch_count = 0;
+	c->work_ticks = 0;
+	c->slice_start = 0;
+	c->wait_state = CORO_WAIT_NONE;
+	c->is_detached = is_detached;
+	c->priority = 0;
+	c->budget = 0;
+	c->ready_since = 0;
+	c->budget_miss_count = 0;
+	c->id = __atomic_add_fetch(&coro_sched.last_id, 1, __ATOMIC_RELAXED);
+	coro_ctx_create(&c->ctx, c->stack->base, c->stack->size);
+	if (!is_detached)
+		__atomic_add_fetch(&coro_sched.alive_count, 1, __ATOMIC_SEQ_CST);
+
+	/* Now scheduler can work with that coroutine. */
+	struct coro_worker *w = coro_worker_this();
+	if (coro_sched_is_tracing() && w != NULL)
+		coro_trace_add(w, coro_clock_ticks(), CORO_TRACE_CREATE,
+			       w->current->id, c->id, CORO_SWITCH_NONE);
+	if (w == &coro_sched.main && coro_sched.is_mt) {
+		unsigned i = __atomic_fetch_add(&coro_sched.next_worker, 1,
+						__ATOMIC_RELAXED);
+		w = &coro_sched.workers[i % coro_sched.worker_count];
+	}
+	coro_worker_push(w, c);
+	return c;
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_create(func, func_arg, stack_size, false);
+}
+
+/** Kinds of I/O the coroutines can wait for. */
+enum coro_io_op {
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+	CORO_IO_ACCEPT,
+};
+
+/** Do the operation as a plain syscall, blocking the thread. */
+static ssize_t
+coro_io_sync(enum coro_io_op op, int fd, void *buf, size_t size,
+	     socklen_t *addrlen)
+{
+	switch (op) {
+	case CORO_IO_READ:
+		return read(fd, buf, size);
+	case CORO_IO_WRITE:
+		return write(fd, buf, size);
+	default:
+		return accept(fd, buf, addrlen);
+	}
+}
+
+/** Suspend until the request is completed. */
+static void
+coro_io_wait(struct coro_io_req *req)
+{
+	while (!req->is_done)
+		coro_suspend();
+	req->is_done = false;
+}
+
+#ifdef __linux__
+
+/**
+ * Do the operation in io_uring of the current thread. When the
+ * descriptor is non-blocking, io_uring fails with EAGAIN instead
+ * of waiting. Then its readiness is waited for first.
+ */
+static ssize_t
+coro_io_uring(enum coro_io_op op, int fd, void *buf, size_t size,
+	      socklen_t *addrlen)
+{
+	struct coro_io_req req;
+	memset(&req, 0, sizeof(req));
+	req.coro = coro_this();
+	bool is_poll = false;
+	while (true) {
+		/* The coroutine can migrate to another thread. */
+		struct coro_poller *p = &coro_worker_this()->poller;
+		if (!coro_poller_reserve(p, &req)) {
+			coro_io_wait(&req);
+			continue;
+		}
+		struct io_uring_sqe *sqe = coro_uring_sqe(p);
+		sqe->fd = fd;
+		sqe->user_data = (uintptr_t)&req;
+		if (is_poll) {
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = op == CORO_IO_WRITE ? POLLOUT : POLLIN;
+		} else if (op == CORO_IO_ACCEPT) {
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->addr = (uintptr_t)buf;
+			sqe->addr2 = (uintptr_t)addrlen;
+		} else {
+			sqe->opcode = op == CORO_IO_READ ? IORING_OP_READ :
+				      IORING_OP_WRITE;
+			sqe->addr = (uintptr_t)buf;
+			sqe->len = size;
+			/* Use and move the file position like read() does. */
+			sqe->off = (uint64_t)-1;
+		}
+		coro_uring_submit(p);
+		coro_io_wait(&req);
+		if (req.res == -EAGAIN && !is_poll) {
+			is_poll = true;
+			continue;
+		}
+		if (req.res < 0) {
+			errno = -req.res;
+			return -1;
+		}
+		if (!is_poll)
+			return req.res;
+		is_poll = false;
+	}
+}
+
+#endif /* __linux__ */
+
+/**
+ * Wait for readiness of the descriptor in the poller of the current
+ * thread and do the operation then.
+ */
+static ssize_t
+coro_io_ready(enum coro_io_op op, int fd, void *buf, size_t size,
+	      socklen_t *addrlen)
+{
+	int flags = fcntl(fd, F_GETFL);
+	bool is_nonblock = flags >= 0 && (flags & O_NONBLOCK) != 0;
+	short events = op == CORO_IO_WRITE ? POLLOUT : POLLIN;
+	struct coro_io_req req;
+	memset(&req, 0, sizeof(req));
+	req.coro = coro_this();
+	while (true) {
+		if (is_nonblock) {
+			ssize_t rc = coro_io_sync(op, fd, buf, size, addrlen);
+			if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				return rc;
+		}
+		struct coro_poller *p = &coro_worker_this()->poller;
+		if (!coro_poller_reserve(p, &req)) {
+			coro_io_wait(&req);
+			continue;
+		}
+		int poll_fd = coro_poller_add_fd(p, fd, events, &req);
+		if (poll_fd < 0) {
+			coro_poller_release(p);
+			return coro_io_sync(op, fd, buf, size, addrlen);
+		}
+		coro_io_wait(&req);
+		coro_poller_delete_fd(p, fd, poll_fd);
+		if (is_nonblock)
+			continue;
+		/*
+		 * A blocking descriptor is ready, but a big write can
+		 * still block. Only PIPE_BUF bytes are sure to fit.
+		 */
+		if (op == CORO_IO_WRITE && size > PIPE_BUF)
+			size = PIPE_BUF;
+		return coro_io_sync(op, fd, buf, size, addrlen);
+	}
+}
+
+static ssize_t
+coro_io(enum coro_io_op op, int fd, void *buf, size_t size,
+	socklen_t *addrlen)
+{
+	struct coro_worker *w = coro_worker_this();
+	/* Outside of coroutines there is nobody to switch to. */
+	if (w == NULL || w->current == &w->sched)
+		return coro_io_sync(op, fd, buf, size, addrlen);
+#ifdef __linux__
+	if (coro_poller_is_async(&w->poller))
+		return coro_io_uring(op, fd, buf, size, addrlen);
+#endif
+	return coro_io_ready(op, fd, buf, size, addrlen);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	return coro_io(CORO_IO_READ, fd, buf, size, NULL);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	return coro_io(CORO_IO_WRITE, fd, (void *)buf, size, NULL);
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return coro_io(CORO_IO_ACCEPT, fd, addr, 0, addrlen);
+}
+
+/** A coroutine of a pool. */
+struct coro_pool_member {
+	struct coro_pool *pool;
+	struct coro *coro;
+	/** True, if the member is in the idle list of the pool. */
+	bool is_idle;
+};
+
+struct coro_pool {
+	/** Function to call for each item. */
+	coro_f func;
+	/** Items not taken yet, a ring buffer. */
+	void **items;
+	size_t item_head;
+	size_t item_count;
+	size_t item_capacity;
+	/** The coroutines of the pool. */
+	struct coro_pool_member *members;
+	int member_count;
+	/** How many members have not exited yet. */
+	int alive_count;
+	/** Indexes of the members waiting for items, a stack. */
+	int *idle;
+	int idle_count;
+	/** How many times the function returned not 0. */
+	int error_count;
+	/** True, if no more items are going to be pushed. */
+	bool is_closed;
+	/** Coroutine waiting in coro_pool_join(), if any. */
+	struct coro *joiner;
+	/** Protects the pool in the multi thread mode. */
+	pthread_mutex_t lock;
+	/** Signaled when the last member exits. */
+	pthread_cond_t exit_cond;
+};
+
+static inline void
+coro_pool_lock(struct coro_pool *pool)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_lock(&pool->lock);
+}
+
+static inline void
+coro_pool_unlock(struct coro_pool *pool)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Take an idle member out of the idle list. It should be woken up
+ * before the pool is unlocked, so it can't exit meanwhile.
+ */
+static struct coro *
+coro_pool_take_idle(struct coro_pool *pool)
+{
+	if (pool->idle_count == 0)
+		return NULL;
+	int i = pool->idle[--pool->idle_count];
+	pool->members[i].is_idle = false;
+	return pool->members[i].coro;
+}
+
+/** Body of the pool coroutines. Runs until the pool is closed. */
+static int
+coro_pool_member_f(void *arg)
+{
+	struct coro_pool_member *m = arg;
+	struct coro_pool *pool = m->pool;
+	m->coro = coro_this();
+	coro_pool_lock(pool);
+	while (true) {
+		if (pool->item_count > 0) {
+			void *item = pool->items[pool->item_head];
+			pool->item_head = (pool->item_head + 1) %
+					  pool->item_capacity;
+			--pool->item_count;
+			coro_pool_unlock(pool);
+			if (pool->func(item) != 0)
+				__atomic_add_fetch(&pool->error_count, 1,
+						   __ATOMIC_RELAXED);
+			coro_pool_lock(pool);
+			continue;
+		}
+		if (pool->is_closed)
+			break;
+		/* After a spurious wakeup it can be in the list still. */
+		if (!m->is_idle) {
+			m->is_idle = true;
+			pool->idle[pool->idle_count++] = m - pool->members;
+		}
+		coro_pool_unlock(pool);
+		coro_suspend();
+		coro_pool_lock(pool);
+	}
+	if (--pool->alive_count == 0) {
+		/*
+		 * Under the lock, so the joiner can't see the pool empty,
+		 * return and exit before the wakeup.
+		 */
+		if (pool->joiner != NULL)
+			coro_wakeup(pool->joiner);
+		if (coro_sched.is_mt)
+			pthread_cond_signal(&pool->exit_cond);
+	}
+	coro_pool_unlock(pool);
+	return 0;
+}
+
+struct coro_pool *
+coro_pool_new(int coro_count, coro_f func, size_t stack_size)
+{
+	struct coro_pool *pool = calloc(1, sizeof(*pool));
+	pool->func = func;
+	pool->item_capacity = 16;
+	pool->items = malloc(pool->item_capacity * sizeof(pool->items[0]));
+	pool->members = calloc(coro_count, sizeof(pool->members[0]));
+	pool->member_count = coro_count;
+	pool->alive_count = coro_count;
+	pool->idle = malloc(coro_count * sizeof(pool->idle[0]));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->exit_cond, NULL);
+	for (int i = 0; i < coro_count; ++i) {
+		struct coro_pool_member *m = &pool->members[i];
+		m->pool = pool;
+		coro_create(coro_pool_member_f, m, stack_size, true);
+	}
+	return pool;
+}
+
+void
+coro_pool_push(struct coro_pool *pool, void *item)
+{
+	coro_pool_lock(pool);
+	if (pool->item_count == pool->item_capacity) {
+		size_t old_capacity = pool->item_capacity;
+		pool->item_capacity *= 2;
+		pool->items = realloc(pool->items, pool->item_capacity *
+				      sizeof(pool->items[0]));
+		/* The ring is full, its wrapped part goes after the end. */
+		for (size_t i = 0; i < pool->item_head; ++i)
+			pool->items[old_capacity + i] = pool->items[i];
+	}
+	size_t tail = (pool->item_head + pool->item_count) %
+		      pool->item_capacity;
+	pool->items[tail] = item;
+	++pool->item_count;
+	/* Under the lock, the member can't exit meanwhile. */
+	struct coro *idle = coro_pool_take_idle(pool);
+	if (idle != NULL)
+		coro_wakeup(idle);
+	coro_pool_unlock(pool);
+}
+
+int
+coro_pool_join(struct coro_pool *pool)
+{
+	coro_pool_lock(pool);
+	pool->is_closed = true;
+	struct coro *idle;
+	/*
+	 * Under the lock, so a member woken spuriously can't see the
+	 * pool closed, exit and be freed before the wakeup.
+	 */
+	while ((idle = coro_pool_take_idle(pool)) != NULL)
+		coro_wakeup(idle);
+	struct coro_worker *w = coro_worker_this();
+	if (w->current != &w->sched) {
+		pool->joiner = w->current;
+		while (pool->alive_count > 0) {
+			coro_pool_unlock(pool);
+			coro_suspend();
+			coro_pool_lock(pool);
+		}
+		pool->joiner = NULL;
+	} else if (coro_sched.is_mt) {
+		while (pool->alive_count > 0)
+			pthread_cond_wait(&pool->exit_cond, &pool->lock);
+	} else {
+		/* Nobody else runs the coroutines in this mode. */
+		while (pool->alive_count > 0)
+			coro_sched_run();
+	}
+	coro_pool_unlock(pool);
+	return pool->error_count;
+}
+
+void
+coro_pool_delete(struct coro_pool *pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->exit_cond);
+	free(pool->idle);
+	free(pool->members);
+	free(pool->items);
+	free(pool);
+}
+
+/** A coroutine waiting on a channel, lives on its stack. */
+struct coro_chan_waiter {
+	struct coro *coro;
+	struct coro_chan_waiter *next;
+	/** True, while the waiter is in the list. */
+	bool is_linked;
+};
+
+/** FIFO of the waiters. */
+struct coro_chan_waiters {
+	struct coro_chan_waiter *head;
+	struct coro_chan_waiter *tail;
+};
+
+struct coro_chan {
+	/** Items, a ring buffer. */
+	char *items;
+	size_t item_size;
+	size_t head;
+	size_t count;
+	size_t capacity;
+	/** True, if no more items can be sent. */
+	bool is_closed;
+	/** Senders waiting for space. */
+	struct coro_chan_waiters senders;
+	/** Receivers waiting for items. */
+	struct coro_chan_waiters receivers;
+	/** Protects the channel in the multi thread mode. */
+	pthread_mutex_t lock;
+};
+
+static inline void
+coro_chan_lock(struct coro_chan *chan)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_lock(&chan->lock);
+}
+
+static inline void
+coro_chan_unlock(struct coro_chan *chan)
+{
+	if (coro_sched.is_mt)
+		pthread_mutex_unlock(&chan->lock);
+}
+
+static void
+coro_chan_waiters_push(struct coro_chan_waiters *list,
+		       struct coro_chan_waiter *waiter)
+{
+	waiter->next = NULL;
+	waiter->is_linked = true;
+	if (list->tail == NULL)
+		list->head = waiter;
+	else
+		list->tail->next = waiter;
+	list->tail = waiter;
+}
+
+/**
+ * Take the oldest waiter out of the list. It should be woken up
+ * with coro_chan_wakeup() before the channel is unlocked.
+ */
+static struct coro *
+coro_chan_waiters_pop(struct coro_chan_waiters *list)
+{
+	struct coro_chan_waiter *waiter = list->head;
+	if (waiter == NULL)
+		return NULL;
+	list->head = waiter->next;
+	if (list->head == NULL)
+		list->tail = NULL;
+	waiter->is_linked = false;
+	return waiter->coro;
+}
+
+/** Unlink a waiter, which stopped waiting on its own. */
+static void
+coro_chan_waiters_remove(struct coro_chan_waiters *list,
+			 struct coro_chan_waiter *waiter)
+{
+	struct coro_chan_waiter *prev = NULL;
+	struct coro_chan_waiter *it = list->head;
+	while (it != waiter) {
+		prev = it;
+		it = it->next;
+	}
+	if (prev == NULL)
+		list->head = waiter->next;
+	else
+		prev->next = waiter->next;
+	if (list->tail == waiter)
+		list->tail = prev;
+	waiter->is_linked = false;
+}
+
+/**
+ * Wait in the list until woken up. The channel is locked before and
+ * after the call.
+ */
+static void
+coro_chan_wait(struct coro_chan *chan, struct coro_chan_waiters *list,
+	       struct coro_chan_waiter *waiter)
+{
+	/* After a spurious wakeup it can be in the list still. */
+	if (!waiter->is_linked)
+		coro_chan_waiters_push(list, waiter);
+	coro_chan_unlock(chan);
+	coro_suspend();
+	coro_chan_lock(chan);
+}
+
+/**
+ * Wake up a popped waiter. The channel must be locked, so the waiter
+ * can't see the channel changed, return and exit meanwhile.
+ */
+static inline void
+coro_chan_wakeup(struct coro *c)
+{
+	if (c != NULL)
+		coro_wakeup(c);
+}
+
+/** Wake up all the waiters of a list. The channel is locked. */
+static void
+coro_chan_wakeup_all(struct coro_chan_waiters *list)
+{
+	struct coro *c;
+	while ((c = coro_chan_waiters_pop(list)) != NULL)
+		coro_chan_wakeup(c);
+}
+
+struct coro_chan *
+coro_chan_new(size_t item_size, size_t capacity)
+{
+	struct coro_chan *chan = calloc(1, sizeof(*chan));
+	chan->item_size = item_size;
+	chan->capacity = capacity == 0 ? 1 : capacity;
+	chan->items = malloc(chan->capacity * item_size);
+	pthread_mutex_init(&chan->lock, NULL);
+	return chan;
+}
+
+int
+coro_chan_send(struct coro_chan *chan, const void *item)
+{
+	struct coro_chan_waiter waiter = {coro_this(), NULL, false};
+	coro_chan_lock(chan);
+	while (!chan->is_closed && chan->count == chan->capacity)
+		coro_chan_wait(chan, &chan->senders, &waiter);
+	if (waiter.is_linked)
+		coro_chan_waiters_remove(&chan->senders, &waiter);
+	if (chan->is_closed) {
+		coro_chan_unlock(chan);
+		return -1;
+	}
+	size_t tail = (chan->head + chan->count) % chan->capacity;
+	memcpy(chan->items + tail * chan->item_size, item, chan->item_size);
+	++chan->count;
+	coro_chan_wakeup(coro_chan_waiters_pop(&chan->receivers));
+	coro_chan_unlock(chan);
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *chan, void *item)
+{
+	struct coro_chan_waiter waiter = {coro_this(), NULL, false};
+	coro_chan_lock(chan);
+	while (!chan->is_closed && chan->count == 0)
+		coro_chan_wait(chan, &chan->receivers, &waiter);
+	if (waiter.is_linked)
+		coro_chan_waiters_remove(&chan->receivers, &waiter);
+	if (chan->count == 0) {
+		coro_chan_unlock(chan);
+		return -1;
+	}
+	memcpy(item, chan->items + chan->head * chan->item_size,
+	       chan->item_size);
+	chan->head = (chan->head + 1) % chan->capacity;
+	--chan->count;
+	coro_chan_wakeup(coro_chan_waiters_pop(&chan->senders));
+	coro_chan_unlock(chan);
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *chan)
+{
+	coro_chan_lock(chan);
+	chan->is_closed = true;
+	coro_chan_wakeup_all(&chan->senders);
+	coro_chan_wakeup_all(&chan->receivers);
+	coro_chan_unlock(chan);
+}
+
+void
+coro_chan_delete(struct coro_chan *chan)
+{
+	pthread_mutex_destroy(&chan->lock);
+	free(chan->items);
+	free(chan);
 }
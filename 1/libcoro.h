@@ -1,14 +1,38 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
+/** Stack size of coroutines created by coro_new(). */
+#define CORO_STACK_SIZE_DEFAULT (1024 * 1024)
+
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
+/**
+ * Make current context scheduler, and run coroutines in
+ * @a thread_count worker threads. Each worker has its own queue of
+ * ready coroutines and steals from the others when it is empty.
+ * Coroutines can move to another thread on each switch, so they
+ * should not keep pointers to thread local data across a yield.
+ * The current thread only creates coroutines and waits for them.
+ */
+void
+coro_sched_init_threads(int thread_count);
+
+/**
+ * Stop the worker threads, if any, and free the coroutine stacks.
+ * All coroutines should be deleted before that.
+ */
+void
+coro_sched_destroy(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -22,11 +46,19 @@ coro_this(void);
 
 /**
  * Create a new coroutine. It is not started, just added to the
- * scheduler.
+ * scheduler. Returns NULL when out of memory.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with a custom stack size. 0 means the
+ * default size. The size is rounded up to a power of 2 to be able
+ * to reuse the stacks of deleted coroutines.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,14 +66,353 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Nanoseconds the coroutine has been running. The time it was
+ * waiting for other coroutines is not included.
+ */
+long long
+coro_work_time(const struct coro *c);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Free the coroutine. Its stack is returned into the stack pool
+ * for reuse.
+ */
 void
 coro_delete(struct coro *c);
 
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Set time quantum of coroutines. For example, target latency
+ * divided by coroutine count. 0 means no quantum, the default.
+ * Should be called after coro_sched_init() or
+ * coro_sched_init_threads(), the running workers see the new value.
+ */
+void
+coro_sched_set_quantum(long long usec);
+
+/** Order, in which the ready coroutines run. */
+enum coro_sched_policy {
+	/** In the order they became ready. The default. */
+	CORO_SCHED_RR,
+	/** Higher priority first, round robin among equal ones. */
+	CORO_SCHED_PRIORITY,
+	/**
+	 * Earliest deadline first. The deadline is the time the
+	 * coroutine became ready plus its latency budget. Coroutines
+	 * without a budget run when no others are ready.
+	 */
+	CORO_SCHED_EDF,
+};
+
+/**
+ * Set the scheduling policy. Should be called after
+ * coro_sched_init() or coro_sched_init_threads() and before any
+ * coroutine is created. Each thread orders its own ready
+ * coroutines, so in the multi thread mode the order is not global.
+ */
+void
+coro_sched_set_policy(enum coro_sched_policy policy);
+
+/**
+ * Set the priority of the current coroutine for
+ * CORO_SCHED_PRIORITY. Higher runs first, the default is 0. Takes
+ * effect when the coroutine becomes ready next time.
+ */
+void
+coro_set_priority(int priority);
+
+/**
+ * Declare the latency budget of the current coroutine: how long it
+ * can wait to run, once it is ready. 0 removes the budget. Under
+ * CORO_SCHED_EDF it sets the deadlines, under any policy the late
+ * runs are counted as misses. Takes effect when the coroutine
+ * becomes ready next time.
+ */
+void
+coro_set_budget(long long usec);
+
+/** How many times the coroutine started running later than its budget. */
+long long
+coro_budget_miss_count(const struct coro *c);
+
+/** Latency budget statistics of all the coroutines. */
+struct coro_sched_stats {
+	/** Runs of the coroutines with a budget. */
+	long long budget_dispatch_count;
+	/** How many of them started later than the budget. */
+	long long budget_miss_count;
+	/** The worst delay past a budget in nanoseconds. */
+	long long max_lateness;
+};
+
+/** Collect the statistics. Should be called before coro_sched_destroy(). */
+void
+coro_sched_stats(struct coro_sched_stats *stats);
+
+/**
+ * Switch to another coroutine, but only if the current one has
+ * been running for its whole time quantum. Cheap enough to be
+ * called after every small piece of work. Returns false without
+ * the scheduler.
+ * @retval Whether there was a switch.
+ */
+bool
+coro_yield_if_expired(void);
+
+/**
+ * Suspend the current coroutine until coro_wakeup() is called for
+ * it. If it was called already after the previous suspend, returns
+ * right away. Can return spuriously, so check the condition being
+ * waited for in a loop. Does nothing outside of coroutines.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready to run. Can be called from any
+ * thread, in the single thread mode too.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/** Monotonic time in microseconds. The deadlines are set in it. */
+long long
+coro_time(void);
+
+/**
+ * Same as coro_suspend(), but returns not later than coro_time()
+ * reaches @a deadline. Outside of coroutines returns right away.
+ * @retval false The deadline has come.
+ * @retval true Woken up, maybe spuriously.
+ */
+bool
+coro_suspend_until(long long deadline);
+
+/**
+ * Sleep until coro_time() reaches @a deadline. Only the current
+ * coroutine waits, the others keep running. When all the coroutines
+ * of a thread sleep, it blocks in the kernel until the nearest
+ * deadline. Outside of coroutines the thread itself sleeps. The
+ * timers have a resolution of 100 microseconds, and never fire
+ * early.
+ */
+void
+coro_sleep_until(long long deadline);
+
+/** Sleep for @a usec microseconds, like coro_sleep_until(). */
+void
+coro_sleep(long long usec);
+
+/**
+ * Same as read(), but only the current coroutine waits for the
+ * data, the others keep running meanwhile. On Linux the reads are
+ * done by io_uring, so regular files don't block either. Otherwise
+ * only the readiness of pipes and sockets is waited for.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Same as write(), waits like coro_read(). */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** Same as accept(), waits like coro_read(). */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Pool of coroutines calling a function for each pushed item. The
+ * coroutines are created once, so the cost does not depend on the
+ * item count.
+ */
+struct coro_pool;
+
+/**
+ * Create a pool of @a coro_count coroutines with stacks of
+ * @a stack_size bytes, 0 means the default. They are detached: not
+ * returned from coro_sched_wait() and are deleted automatically.
+ */
+struct coro_pool *
+coro_pool_new(int coro_count, coro_f func, size_t stack_size);
+
+/** Add an item to the queue of the pool. An idle coroutine runs it. */
+void
+coro_pool_push(struct coro_pool *pool, void *item);
+
+/**
+ * Wait until all the pushed items are processed and the pool
+ * coroutines exit. No pushes are allowed after that. Can be called
+ * from a coroutine or from the scheduler.
+ * @retval How many times the function returned not 0.
+ */
+int
+coro_pool_join(struct coro_pool *pool);
+
+/** Free a joined pool. */
+void
+coro_pool_delete(struct coro_pool *pool);
+
+/**
+ * Bounded channel of fixed size items between coroutines. A sender
+ * waits while the channel is full, and a receiver waits while it is
+ * empty. Each send wakes only one waiting receiver, and each receive
+ * wakes only one waiting sender. Works across threads in the multi
+ * thread mode. Sends and receives must be called from coroutines.
+ */
+struct coro_chan;
+
+/**
+ * Create a channel of @a capacity items of @a item_size bytes each.
+ * Capacity 0 is treated as 1.
+ */
+struct coro_chan *
+coro_chan_new(size_t item_size, size_t capacity);
+
+/**
+ * Copy an item into the channel, waiting for free space if it is
+ * full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed.
+ */
+int
+coro_chan_send(struct coro_chan *chan, const void *item);
+
+/**
+ * Take the oldest item from the channel, waiting for one if it is
+ * empty.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and has no items left.
+ */
+int
+coro_chan_recv(struct coro_chan *chan, void *item);
+
+/**
+ * Forbid more sends and wake up all the waiters. The items sent
+ * before can still be received.
+ */
+void
+coro_chan_close(struct coro_chan *chan);
+
+/** Free a channel nobody waits on. The items left are dropped. */
+void
+coro_chan_delete(struct coro_chan *chan);
+
+/**
+ * Start recording the creations and switches of coroutines. Each
+ * thread keeps the last @a event_count events in its own ring, so
+ * the recording takes no locks. Should be called after
+ * coro_sched_init() while no coroutines run. A restart drops the
+ * events recorded before.
+ */
+void
+coro_trace_start(size_t event_count);
+
+/** Stop recording. The events are kept for coro_trace_dump(). */
+void
+coro_trace_stop(void);
+
+/**
+ * Write the recorded events into a file in Chrome trace JSON
+ * format, for chrome://tracing or Perfetto. One track per thread
+ * shows which coroutine ran there, and one track per coroutine shows
+ * when it ran. Should be called while no coroutines run, before
+ * coro_sched_destroy().
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_trace_dump(const char *path);
+
+/** Name of the context switch backend the library is built with. */
+const char *
+coro_backend(void);
+
+/** Statistics of the coroutine stack pool. */
+struct coro_stack_stats {
+	/** How many times a stack was taken from the pool. */
+	long long hits;
+	/** How many times new stacks had to be mapped. */
+	long long misses;
+	/** Stacks, used by coroutines now. */
+	long long used_count;
+	/** Stacks, cached in the pool. */
+	long long free_count;
+	/**
+	 * Stacks without a guard page, because the limit on the
+	 * mapping count was reached.
+	 */
+	long long unguarded_count;
+	/** Address space reserved by the stacks with guard pages. */
+	size_t mapped_bytes;
+	/** Stack memory actually backed by RAM. */
+	size_t committed_bytes;
+};
+
+/**
+ * Collect stack pool statistics. Committed bytes calculation
+ * walks all the stacks, so it is not for hot paths.
+ */
+void
+coro_stack_stats(struct coro_stack_stats *stats);
+
+/**
+ * Set how many stacks can have a guard page. Each guard page takes
+ * mappings of the process, limited by vm.max_map_count on Linux, and
+ * the stacks above the limit are not protected from overflows. By
+ * default a quarter of vm.max_map_count, at most a third of it. A
+ * negative limit restores the default. Affects the stacks mapped
+ * after the call.
+ */
+void
+coro_stack_set_guard_limit(long long limit);
+
+/**
+ * Turn the stack watermarks on or off for the coroutines created
+ * after that. A stack is filled with a pattern when taken, and the
+ * deepest overwritten byte shows the peak use. The fill touches the
+ * whole stack, so it is a mode for sizing the stacks, not for
+ * production.
+ */
+void
+coro_stack_set_watermark(bool is_enabled);
+
+/**
+ * Peak stack use of a coroutine in bytes, or -1 if its stack has no
+ * watermark. Scans the stack, so it is not for hot paths.
+ */
+long long
+coro_stack_peak(const struct coro *c);
+
+enum {
+	/**
+	 * Bucket i of the histogram counts peaks in
+	 * (2^(MIN_LOG + i - 1), 2^(MIN_LOG + i)] bytes. The first
+	 * bucket has all the smaller ones, the last - the bigger ones.
+	 */
+	CORO_STACK_HIST_MIN_LOG = 8,
+	CORO_STACK_HIST_SIZE = 19,
+};
+
+/** Histogram of peak stack use. */
+struct coro_stack_hist {
+	long long buckets[CORO_STACK_HIST_SIZE];
+	/** Coroutines counted. */
+	long long count;
+	/** The biggest peak. */
+	size_t max;
+};
+
+/**
+ * Get the histogram of peak stack use of the coroutines with a
+ * watermark, deleted so far. Pool members are counted too, they are
+ * deleted when the pool is joined.
+ */
+void
+coro_stack_hist(struct coro_stack_hist *hist);
@@ -1,40 +1,95 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "libcoro.h"
+#include "int_bin.h"
+#include "int_ext_sort.h"
+#include "int_io.h"
+#include "int_merge.h"
+#include "int_par_sort.h"
+#include "int_sort.h"
 #include <time.h>
 
 /**
  * You can compile and run this code using the commands:
  *
- * $> gcc solution.c libcoro.c
+ * $> gcc solution.c libcoro.c int_io.c int_bin.c int_sort.c int_merge.c \
+ *      int_ext_sort.c int_par_sort.c
  * $> ./a.out
  */
 
 struct my_context {
     char *name;
-    struct timespec start_time;
-    struct timespec end_time;
-    struct timespec active_start_time; // Время начала активной работы
-    long active_work_time; // Активное время работы
-    int switch_count; // Счетчик переключений корутины
-    struct timespec idle_start_time; // Время начала простоя
-    long total_idle_time; // Общее время простоя
-    struct timespec last_idle_start_time;
+    // Куда складываются куски файла при внешней сортировке
+    struct int_run_list *runs;
+    struct int_ext_stats *stats;
 };
 
-static void mergeSort(int *array, int left, int right, struct my_context *ctx);
-static void merge(int *array, int left, int middle, int right, struct my_context *ctx);
-static struct my_context *my_context_new(const char *name);
+// Сортировка слиянием или поразрядная, из int_sort.h
+static bool use_radix_sort = false;
+// Сколько элементов сортировки между проверками кванта
+static size_t yield_unit = 1024;
+
+// Буфер чтения одного отсортированного файла при слиянии
+#define MERGE_BUFFER_SIZE (256 * 1024)
+
+// Лимит памяти внешней сортировки в байтах. 0 - все файлы в памяти
+static size_t mem_limit = 0;
+// Сколько кусков сливается за раз во внешней сортировке
+static int fan_in = 16;
+// Размер куска в числах, чтобы все корутины уложились в лимит
+static size_t run_size;
+static const char *tmp_dir = "/tmp";
+
+// Емкость каналов конвейера в сообщениях. 0 - без конвейера
+static size_t pipeline_depth = 0;
+// Размер куска текста, который читатель передает разборщику
+#define PIPELINE_CHUNK_SIZE (256 * 1024)
+
+// Отсортированные файлы передаются слиянию бинарными кусками во временных
+// файлах, а не текстом на месте. Текст только на входе и в результате
+static bool is_bin_runs = false;
+static enum int_bin_format bin_format = INT_BIN_RAW;
+
+// Размер стека корутин в байтах. 0 - по умолчанию из libcoro.h
+static size_t stack_size = 0;
+// Печатать пик стека корутин, чтобы подобрать stack_size
+static bool is_stack_report = false;
+// Сколько стеков получают сторожевую страницу. -1 - по умолчанию из libcoro
+static long long stack_guard_limit = -1;
+
+// Файл трассы переключений корутин для chrome://tracing. NULL - без трассы
+static const char *trace_path = NULL;
+// Сколько последних событий трассы хранит каждый поток
+#define TRACE_EVENT_COUNT (1 << 18)
+
+// Бюджет задержки каждой корутины в мкс - целевая задержка T.
+// Планировщик сам считает, сколько раз корутина ждала дольше
+static long long latency_budget = 0;
+
+/** Print the peak stack use of the current coroutine, if measured. */
+static void print_stack_peak(const char *name) {
+    long long peak = coro_stack_peak(coro_this());
+    if (peak >= 0)
+        printf("Coroutine %s peak stack: %lld bytes\n", name, peak);
+}
+
+static struct my_context *my_context_new(const char *name,
+                                         struct int_run_list *runs,
+                                         struct int_ext_stats *stats);
 static void my_context_delete(struct my_context *ctx);
 
-static struct my_context *my_context_new(const char *name) {
+static struct my_context *my_context_new(const char *name,
+                                         struct int_run_list *runs,
+                                         struct int_ext_stats *stats) {
     struct my_context *ctx = malloc(sizeof(*ctx));
     ctx->name = strdup(name);
-    ctx->switch_count = 0;
-    ctx->active_work_time = 0; // Инициализация активного времени работы
-    ctx->total_idle_time = 0; // Инициализация общего времени простоя
-    clock_gettime(CLOCK_MONOTONIC, &ctx->active_start_time); // Запоминаем время начала активной работы
+    ctx->runs = runs;
+    ctx->stats = stats;
     return ctx;
 }
 
@@ -43,88 +98,518 @@ static void my_context_delete(struct my_context *ctx) {
     free(ctx);
 }
 
-void yield_start(struct my_context *ctx) {
-    clock_gettime(CLOCK_MONOTONIC, &ctx->last_idle_start_time);
+/**
+ * A function, called from inside of coroutines recursively. Just to demonstrate
+ * the example. You can split your code into multiple functions, that usually
+ * helps to keep the individual code blocks simple.
+ */
+//static void
+//other_function(const char *name, int depth)
+//{
+//	printf("%s: entered function, depth = %d\n", name, depth);
+//	coro_yield();
+//	if (depth < 3)
+//		other_function(name, depth + 1);
+//}
+
+/**
+ * Merge the sorted files into the output file. Only a buffer per file
+ * is kept in memory, not the numbers themselves.
+ */
+static int merge_files(char **names, int count, const char *output) {
+    struct int_reader *runs = calloc(count, sizeof(*runs));
+    int opened = 0;
+    int rc = -1;
+    for (; opened < count; ++opened) {
+        int fd = open(names[opened], O_RDONLY);
+        if (fd < 0) {
+            perror("Error opening sorted file");
+            goto out;
+        }
+        if (int_reader_create(&runs[opened], fd, MERGE_BUFFER_SIZE) != 0) {
+            close(fd);
+            goto out;
+        }
+    }
+    int output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("Error opening output file");
+        goto out;
+    }
+    struct int_writer writer;
+    if (int_writer_create(&writer, output_fd, 0) == 0) {
+        rc = int_merge(runs, count, &writer);
+        if (rc != 0)
+            perror("Error merging files");
+        int_writer_destroy(&writer);
+    }
+    close(output_fd);
+out:
+    for (int i = 0; i < opened; ++i) {
+        close(runs[i].fd);
+        int_reader_destroy(&runs[i]);
+    }
+    free(runs);
+    return rc;
 }
 
-void yield_end(struct my_context *ctx) {
-    struct timespec idle_end_time;
-    clock_gettime(CLOCK_MONOTONIC, &idle_end_time);
+/**
+ * Merge the binary runs, one per file, into the output file. The runs
+ * are mapped, so raw ones are merged without any copying or parsing.
+ */
+static int merge_bin_runs(struct int_run_list *file_runs, int count,
+                          const char *output) {
+    struct int_bin_reader *runs = calloc(count, sizeof(*runs));
+    int opened = 0;
+    int rc = -1;
+    for (; opened < count; ++opened) {
+        int fd = open(file_runs[opened].paths[0], O_RDONLY);
+        if (fd < 0) {
+            perror("Error opening sorted run");
+            goto out;
+        }
+        int open_rc = int_bin_reader_open(&runs[opened], fd);
+        close(fd);
+        if (open_rc != 0) {
+            perror("Error mapping sorted run");
+            goto out;
+        }
+    }
+    int output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("Error opening output file");
+        goto out;
+    }
+    struct int_writer writer;
+    if (int_writer_create(&writer, output_fd, 0) == 0) {
+        rc = int_merge_bin(runs, count, &writer);
+        if (rc != 0)
+            perror("Error merging runs");
+        int_writer_destroy(&writer);
+    }
+    close(output_fd);
+out:
+    for (int i = 0; i < opened; ++i)
+        int_bin_reader_close(&runs[i]);
+    free(runs);
+    return rc;
+}
 
-    long idle_time = (idle_end_time.tv_sec - ctx->last_idle_start_time.tv_sec) * 1000000 +
-                     (idle_end_time.tv_nsec - ctx->last_idle_start_time.tv_nsec) / 1000;
-    ctx->total_idle_time += idle_time;
-    ctx->switch_count++;
+// Кусок текста файла. Последний кусок файла пустой
+struct text_chunk {
+    int file;
+    char *data;
+    size_t size;
+    bool is_last;
+    // Файл не дочитан, его числа нельзя записывать
+    bool is_failed;
+};
+
+// Все числа одного файла
+struct file_numbers {
+    int file;
+    struct int_array numbers;
+};
+
+/**
+ * Sorting as a pipeline of 4 coroutines: reader -> parser -> sorter ->
+ * writer. The bounded channels between them give backpressure: a
+ * stage which runs ahead waits for the next one, so only a few chunks
+ * and files are in memory at once.
+ */
+struct pipeline {
+    char **files;
+    int file_count;
+    struct coro_chan *chunks;
+    struct coro_chan *parsed;
+    struct coro_chan *sorted;
+};
+
+static void pipeline_print_stats(const char *stage) {
+    struct coro *this = coro_this();
+    printf("Pipeline %s: Active execution time: %.3f seconds, switch count: %lld\n", stage, (double)coro_work_time(this) / 1000000000, coro_switch_count(this));
+    print_stack_peak(stage);
+}
+
+/** Read the files one by one and send them in chunks. */
+static int pipeline_reader_f(void *arg) {
+    struct pipeline *p = arg;
+    coro_set_budget(latency_budget);
+    int rc = 0;
+    for (int i = 0; i < p->file_count; ++i) {
+        int fd = open(p->files[i], O_RDONLY);
+        if (fd < 0) {
+            perror("Error opening input file");
+            rc = 1;
+            continue;
+        }
+        struct text_chunk chunk = {.file = i};
+        while (true) {
+            chunk.data = malloc(PIPELINE_CHUNK_SIZE + INT_PARSER_PADDING);
+            ssize_t n = coro_read(fd, chunk.data, PIPELINE_CHUNK_SIZE);
+            if (n < 0 && errno == EINTR) {
+                free(chunk.data);
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("Error reading input file");
+                    chunk.is_failed = true;
+                    rc = 1;
+                }
+                free(chunk.data);
+                chunk.data = NULL;
+                chunk.size = 0;
+                chunk.is_last = true;
+                coro_chan_send(p->chunks, &chunk);
+                break;
+            }
+            chunk.size = n;
+            coro_chan_send(p->chunks, &chunk);
+        }
+        close(fd);
+    }
+    coro_chan_close(p->chunks);
+    pipeline_print_stats("reader");
+    return rc;
 }
 
+/** Parse the chunks into numbers, and send the files complete. */
+static int pipeline_parser_f(void *arg) {
+    struct pipeline *p = arg;
+    coro_set_budget(latency_budget);
+    struct int_parser parser;
+    int_parser_create(&parser);
+    struct file_numbers file;
+    int_array_create(&file.numbers);
+    struct text_chunk chunk;
+    int rc = 0;
+    // Файл, которому не хватило памяти, дочитывается, но не сортируется
+    bool is_failed = false;
+    while (coro_chan_recv(p->chunks, &chunk) == 0) {
+        if (!chunk.is_last) {
+            if (!is_failed && int_parser_feed(&parser, &file.numbers,
+                                              chunk.data, chunk.size) != 0) {
+                perror("Error parsing input file");
+                is_failed = true;
+                rc = 1;
+            }
+            free(chunk.data);
+            continue;
+        }
+        if (!is_failed && int_parser_finish(&parser, &file.numbers) != 0) {
+            perror("Error parsing input file");
+            is_failed = true;
+            rc = 1;
+        }
+        file.file = chunk.file;
+        if (chunk.is_failed || is_failed)
+            int_array_destroy(&file.numbers);
+        else
+            coro_chan_send(p->parsed, &file);
+        int_parser_create(&parser);
+        int_array_create(&file.numbers);
+        is_failed = false;
+    }
+    int_array_destroy(&file.numbers);
+    coro_chan_close(p->parsed);
+    pipeline_print_stats("parser");
+    return rc;
+}
+
+static int pipeline_sorter_f(void *arg) {
+    struct pipeline *p = arg;
+    coro_set_budget(latency_budget);
+    int rc = 0;
+    struct file_numbers file;
+    while (coro_chan_recv(p->parsed, &file) == 0) {
+        int *scratch = malloc(file.numbers.size * sizeof(int) + 1);
+        if (scratch == NULL) {
+            // Файл не отсортирован, писатель его не получит
+            perror("Error allocating sort buffer");
+            int_array_destroy(&file.numbers);
+            rc = 1;
+            continue;
+        }
+        if (use_radix_sort)
+            int_sort_radix(file.numbers.data, file.numbers.size, scratch, yield_unit);
+        else
+            int_sort_merge(file.numbers.data, file.numbers.size, scratch, yield_unit);
+        free(scratch);
+        coro_chan_send(p->sorted, &file);
+    }
+    coro_chan_close(p->sorted);
+    pipeline_print_stats("sorter");
+    return rc;
+}
 
-void merge(int arr[], int l, int m, int r, struct my_context *ctx) {
-    int i, j, k;
-    int n1 = m - l + 1;
-    int n2 = r - m;
+/** Save each sorted file back in place. */
+static int pipeline_writer_f(void *arg) {
+    struct pipeline *p = arg;
+    coro_set_budget(latency_budget);
+    int rc = 0;
+    struct file_numbers file;
+    while (coro_chan_recv(p->sorted, &file) == 0) {
+        const char *name = p->files[file.file];
+        int output_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd < 0 || int_io_write(output_fd, file.numbers.data, file.numbers.size) != 0) {
+            perror("Error writing output file");
+            rc = 1;
+        }
+        if (output_fd >= 0)
+            close(output_fd);
+        int_array_destroy(&file.numbers);
+    }
+    pipeline_print_stats("writer");
+    return rc;
+}
 
-    int *L = malloc(n1 * sizeof(int));
-    int *R = malloc(n2 * sizeof(int));
+/**
+ * Start the stages. If one of them can't start, the channels are
+ * closed, so the started ones don't wait for it forever.
+ */
+static int pipeline_start(struct pipeline *p, char **files, int count) {
+    p->files = files;
+    p->file_count = count;
+    p->chunks = coro_chan_new(sizeof(struct text_chunk), pipeline_depth);
+    p->parsed = coro_chan_new(sizeof(struct file_numbers), pipeline_depth);
+    p->sorted = coro_chan_new(sizeof(struct file_numbers), pipeline_depth);
+    coro_f stages[] = {pipeline_reader_f, pipeline_parser_f, pipeline_sorter_f, pipeline_writer_f};
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i) {
+        if (coro_new_ex(stages[i], p, stack_size) == NULL) {
+            perror("Error starting pipeline");
+            coro_chan_close(p->chunks);
+            coro_chan_close(p->parsed);
+            coro_chan_close(p->sorted);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    for (i = 0; i < n1; i++)
-        L[i] = arr[l + i];
-    for (j = 0; j < n2; j++)
-        R[j] = arr[m + 1 + j];
+/** Free the channels after all the stages have finished. */
+static void pipeline_destroy(struct pipeline *p) {
+    coro_chan_delete(p->chunks);
+    coro_chan_delete(p->parsed);
+    coro_chan_delete(p->sorted);
+}
 
-    i = 0; j = 0; k = l;
-    while (i < n1 && j < n2) {
-        yield_start(ctx);
-        coro_yield();
-        yield_end(ctx);
+/**
+ * Merge the runs of all the files into the output file in passes of at
+ * most fan_in runs, and report the work done.
+ */
+static int merge_runs(struct int_run_list *file_runs,
+                      struct int_ext_stats *file_stats, int count,
+                      const char *output) {
+    struct int_run_list runs;
+    int_run_list_create(&runs);
+    struct int_ext_stats stats = {0};
+    for (int i = 0; i < count; ++i) {
+        if (int_run_list_move(&runs, &file_runs[i]) != 0) {
+            perror("Error collecting runs");
+            int_run_list_destroy(&runs);
+            return -1;
+        }
+        stats.read_size += file_stats[i].read_size;
+        stats.written_size += file_stats[i].written_size;
+    }
+    int run_count = runs.count;
+    int rc = -1;
+    int output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("Error opening output file");
+    } else {
+        rc = int_ext_merge(&runs, fan_in, mem_limit, tmp_dir, output_fd,
+                           &stats);
+        if (rc != 0)
+            perror("Error merging runs");
+        close(output_fd);
+    }
+    int_run_list_destroy(&runs);
+    if (rc == 0) {
+        // Первый проход режет файлы на куски, остальные их сливают
+        printf("External sort into %s: %d runs of %zu numbers, %d passes\n", output, run_count, run_size, 1 + stats.merge_pass_count);
+        printf("I/O: %zu bytes read, %zu bytes written\n", stats.read_size, stats.written_size);
+    }
+    return rc;
+}
 
-        if (L[i] <= R[j]) {
-            arr[k] = L[i++];
+/**
+ * Sort the files in worker processes, each running a pool of
+ * coroutines over its share of the files. The sorted numbers stay in
+ * shared memory, and this process merges them into the output file.
+ */
+static int sort_in_processes(char **files, int count, int process_count,
+                             int coro_count, const char *output) {
+    char **valid_files = malloc(count * sizeof(*valid_files));
+    int valid_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (files[i][0] == '-')
+            printf("Skipping invalid argument: %s\n", files[i]);
+        else
+            valid_files[valid_count++] = files[i];
+    }
+    struct int_par_sort_opts opts = {
+        .worker_count = process_count,
+        .is_threads = false,
+        .coro_count = coro_count,
+        .sort = use_radix_sort ? int_sort_radix : int_sort_merge,
+        .unit = yield_unit,
+    };
+    int rc = -1;
+    int output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct int_writer writer;
+    if (output_fd < 0) {
+        perror("Error opening output file");
+    } else if (int_writer_create(&writer, output_fd, 0) == 0) {
+        struct int_par_sort_stats stats;
+        rc = int_par_sort(valid_files, valid_count, &opts, &writer, &stats);
+        if (rc != 0) {
+            perror("Error sorting in processes");
         } else {
-            arr[k] = R[j++];
+            printf("Sorted %zu numbers in %d processes: %.3f seconds\n", stats.count, stats.worker_count, (double)stats.sort_time / 1000000000);
+            printf("Merged %d files into %s: %.3f seconds\n", valid_count, output, (double)stats.merge_time / 1000000000);
         }
-        k++;
+        int_writer_destroy(&writer);
     }
+    if (output_fd >= 0)
+        close(output_fd);
+    free(valid_files);
+    return rc;
+}
+
+/** Print how often the coroutines waited longer than the target latency. */
+static void print_budget_stats(void) {
+    struct coro_sched_stats stats;
+    coro_sched_stats(&stats);
+    printf("Latency budget: %lld runs, %lld missed, worst %.3f ms late\n", stats.budget_dispatch_count, stats.budget_miss_count, (double)stats.max_lateness / 1000000);
+}
 
-    while (i < n1) {
-        yield_start(ctx);
-        coro_yield();
-        yield_end(ctx);
-        arr[k++] = L[i++];
+/** Print how many coroutines had their stack peak in each size range. */
+static void print_stack_hist(void) {
+    struct coro_stack_hist hist;
+    coro_stack_hist(&hist);
+    printf("Stack peaks of %lld coroutines, max %zu bytes:\n", hist.count, hist.max);
+    for (int i = 0; i < CORO_STACK_HIST_SIZE; ++i) {
+        if (hist.buckets[i] == 0)
+            continue;
+        // Последняя корзина без верхней границы
+        if (i == CORO_STACK_HIST_SIZE - 1)
+            printf("  > %zu: %lld\n", (size_t)1 << (CORO_STACK_HIST_MIN_LOG + i - 1), hist.buckets[i]);
+        else
+            printf("  <= %zu: %lld\n", (size_t)1 << (CORO_STACK_HIST_MIN_LOG + i), hist.buckets[i]);
     }
+    // Переполнение такого стека молча портит соседний вместо SIGSEGV
+    struct coro_stack_stats stats;
+    coro_stack_stats(&stats);
+    if (stats.unguarded_count > 0)
+        fprintf(stderr, "Warning: %lld stacks had no guard page, raise --stack-guards or vm.max_map_count\n",
+                stats.unguarded_count);
+}
 
-    while (j < n2) {
-        yield_start(ctx);
-        coro_yield();
-        yield_end(ctx);
-        arr[k++] = R[j++];
+static void print_total_time(const struct timespec *program_start) {
+    struct timespec program_end;
+    clock_gettime(CLOCK_MONOTONIC, &program_end);
+    long total_program_time = (program_end.tv_sec - program_start->tv_sec) * 1000000 +
+                              (program_end.tv_nsec - program_start->tv_nsec) / 1000;
+    printf("Total program execution time: %.3f seconds\n", (double)total_program_time / 1000000);
+}
+
+/**
+ * Parse a size in bytes with an optional K, M or G suffix.
+ */
+static size_t parse_size(const char *str) {
+    char *end;
+    size_t size = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        // fallthrough
+    case 'M': case 'm':
+        size *= 1024;
+        // fallthrough
+    case 'K': case 'k':
+        size *= 1024;
+        break;
     }
+    return size;
+}
 
-    free(L);
-    free(R);
+/** Save the sorted numbers into a new binary run of the file. */
+static int save_bin_run(struct my_context *ctx, const int *data, size_t count) {
+    int fd = int_run_list_add(ctx->runs, tmp_dir);
+    if (fd < 0)
+        return -1;
+    int rc = int_bin_write(fd, data, count, bin_format);
+    close(fd);
+    return rc;
 }
 
-void mergeSort(int arr[], int l, int r, struct my_context *ctx) {
-    if (l < r) {
-        int m = l + (r - l) / 2;
-        mergeSort(arr, l, m, ctx);
-        mergeSort(arr, m + 1, r, ctx);
-        merge(arr, l, m, r, ctx);
+/**
+ * Sort the whole file in memory and save it back to the same file, or
+ * into a binary run.
+ */
+static int sort_file_in_memory(struct my_context *ctx, int input_fd) {
+    // Read the whole file, other coroutines work while it is read
+    struct int_array numbers;
+    int_array_create(&numbers);
+    if (int_array_load(&numbers, input_fd) != 0) {
+        perror("Error reading input file");
+        int_array_destroy(&numbers);
+        return 1;
+    }
+    int *array = numbers.data;
+    size_t size = numbers.size;
+
+    // Sort the array, the scratch buffer is the only allocation
+    int *scratch = malloc(size * sizeof(int) + 1);
+    if (scratch == NULL) {
+        perror("Error allocating sort buffer");
+        int_array_destroy(&numbers);
+        return 1;
+    }
+    if (use_radix_sort)
+        int_sort_radix(array, size, scratch, yield_unit);
+    else
+        int_sort_merge(array, size, scratch, yield_unit);
+    free(scratch);
+
+    if (is_bin_runs) {
+        int rc = save_bin_run(ctx, array, size);
+        if (rc != 0)
+            perror("Error writing sorted run");
+        int_array_destroy(&numbers);
+        return rc == 0 ? 0 : 1;
+    }
+
+    // Save the sorted array to the same file
+    int output_fd = open(ctx->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0 || int_io_write(output_fd, array, size) != 0) {
+        perror("Error writing output file");
+        if (output_fd >= 0)
+            close(output_fd);
+        int_array_destroy(&numbers);
+        return 1;
     }
+    close(output_fd);
+
+    int_array_destroy(&numbers);
+    return 0;
 }
 
 /**
- * A function, called from inside of coroutines recursively. Just to demonstrate
- * the example. You can split your code into multiple functions, that usually
- * helps to keep the individual code blocks simple.
+ * Cut the file into sorted runs in temporary files, the file itself
+ * is not changed.
  */
-//static void
-//other_function(const char *name, int depth)
-//{
-//	printf("%s: entered function, depth = %d\n", name, depth);
-//	coro_yield();
-//	if (depth < 3)
-//		other_function(name, depth + 1);
-//}
+static int sort_file_external(struct my_context *ctx, int input_fd) {
+    int_sort_f sort = use_radix_sort ? int_sort_radix : int_sort_merge;
+    if (int_ext_split(input_fd, run_size, sort, yield_unit, tmp_dir,
+                      ctx->runs, ctx->stats) != 0) {
+        perror("Error splitting input file");
+        return 1;
+    }
+    return 0;
+}
 
 /**
  * Coroutine body. This code is executed by all the coroutines. Here you
@@ -134,102 +619,251 @@ static int coroutine_func_f(void *context) {
     struct my_context *ctx = context;
     char *name = ctx->name;
 
-    clock_gettime(CLOCK_MONOTONIC, &ctx->start_time);
     printf("Started coroutine %s\n", name);
-
-    // Open file and read numbers
-    FILE *input_file = fopen(name, "r");
-    if (!input_file) {
+    coro_set_budget(latency_budget);
+    // В пуле одна корутина сортирует несколько файлов, считаем разницу
+    struct coro *this = coro_this();
+    long long start_time = coro_work_time(this);
+    long long start_switches = coro_switch_count(this);
+
+    int input_fd = open(name, O_RDONLY);
+    if (input_fd < 0) {
         perror("Error opening input file");
         my_context_delete(ctx);
         return 1;
     }
-
-    int *array = NULL;
-    int size = 0, number;
-    while (fscanf(input_file, "%d", &number) == 1) {
-        array = realloc(array, (size + 1) * sizeof(int));
-        if (!array) {
-            perror("Error reallocating memory");
-            fclose(input_file);
-            my_context_delete(ctx);
-            return 1;
-        }
-        array[size++] = number;
-    }
-    fclose(input_file);
-
-    // Sort the array
-    mergeSort(array, 0, size - 1, ctx);
-
-    // Save the sorted array to the same file
-    FILE *output_file = fopen(name, "w");
-    if (!output_file) {
-        perror("Error opening output file");
-        free(array);
+    int rc;
+    if (mem_limit > 0)
+        rc = sort_file_external(ctx, input_fd);
+    else
+        rc = sort_file_in_memory(ctx, input_fd);
+    close(input_fd);
+    if (rc != 0) {
         my_context_delete(ctx);
-        return 1;
+        return rc;
     }
-    for (int i = 0; i < size; ++i) {
-        fprintf(output_file, "%d ", array[i]);
-    }
-    fclose(output_file);
-
-    free(array);
-
-    clock_gettime(CLOCK_MONOTONIC, &ctx->end_time);
-
-    // Вычисляем общее время выполнения корутины
-    long total_time = (ctx->end_time.tv_sec - ctx->start_time.tv_sec) * 1000000 +
-                      (ctx->end_time.tv_nsec - ctx->start_time.tv_nsec) / 1000;
-    // Вычитаем общее время простоя из общего времени выполнения для получения активного времени работы
-    ctx->active_work_time = total_time - ctx->total_idle_time;
 
-    printf("%s: Active execution time: %.3f seconds\n", ctx->name, (double)ctx->active_work_time / 1000000);
-    printf("Coroutine %s switch count: %d\n", ctx->name, ctx->switch_count);
+    // Время простоя в coro_yield() библиотека не учитывает сама
+    printf("%s: Active execution time: %.3f seconds\n", ctx->name, (double)(coro_work_time(this) - start_time) / 1000000000);
+    printf("Coroutine %s switch count: %lld\n", ctx->name, coro_switch_count(this) - start_switches);
+    print_stack_peak(ctx->name);
     my_context_delete(ctx);
     return 0;
 }
 
 int main(int argc, char **argv) {
-    struct timespec program_start, program_end;
+    struct timespec program_start;
     clock_gettime(CLOCK_MONOTONIC, &program_start);
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file1> [<file2> ...]\n", argv[0]);
+    // Целевая задержка T в микросекундах, каждой корутине достается T / N
+    long long target_latency = 0;
+    // Число потоков, в которых работают корутины. 0 - все в main
+    int thread_count = 0;
+    // Порядок готовых корутин: rr, prio или edf
+    enum coro_sched_policy policy = CORO_SCHED_RR;
+    // Размер пула корутин. 0 - по корутине на файл
+    int coro_count = 0;
+    // Число процессов, сортирующих файлы. 0 - все в этом процессе
+    int process_count = 0;
+    // Файл, куда сливаются все отсортированные файлы
+    const char *output = "result.txt";
+    // Неизвестное значение опции, печатаем подсказку
+    bool is_bad_option = false;
+    int first_file = 1;
+    while (first_file + 1 < argc) {
+        if (strcmp(argv[first_file], "-l") == 0)
+            target_latency = atoll(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "-t") == 0)
+            thread_count = atoi(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "-c") == 0)
+            coro_count = atoi(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "-p") == 0)
+            process_count = atoi(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "-s") == 0)
+            use_radix_sort = strcmp(argv[first_file + 1], "radix") == 0;
+        else if (strcmp(argv[first_file], "-g") == 0)
+            yield_unit = atol(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "-o") == 0)
+            output = argv[first_file + 1];
+        else if (strcmp(argv[first_file], "--mem-limit") == 0)
+            mem_limit = parse_size(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "--fan-in") == 0)
+            fan_in = atoi(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "--pipeline") == 0)
+            pipeline_depth = atol(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "--stack-size") == 0)
+            stack_size = parse_size(argv[first_file + 1]);
+        else if (strcmp(argv[first_file], "--run-format") == 0) {
+            is_bin_runs = strcmp(argv[first_file + 1], "text") != 0;
+            bin_format = strcmp(argv[first_file + 1], "varint") == 0 ? INT_BIN_VARINT : INT_BIN_RAW;
+        } else if (strcmp(argv[first_file], "--trace") == 0)
+            trace_path = argv[first_file + 1];
+        else if (strcmp(argv[first_file], "--policy") == 0) {
+            const char *name = argv[first_file + 1];
+            if (strcmp(name, "rr") == 0) {
+                policy = CORO_SCHED_RR;
+            } else if (strcmp(name, "prio") == 0) {
+                policy = CORO_SCHED_PRIORITY;
+            } else if (strcmp(name, "edf") == 0) {
+                policy = CORO_SCHED_EDF;
+            } else {
+                is_bad_option = true;
+                break;
+            }
+        } else if (strcmp(argv[first_file], "--stack-report") == 0)
+            is_stack_report = strcmp(argv[first_file + 1], "on") == 0;
+        else if (strcmp(argv[first_file], "--stack-guards") == 0)
+            stack_guard_limit = atoll(argv[first_file + 1]);
+        else
+            break;
+        first_file += 2;
+    }
+    if (is_bad_option || argc <= first_file) {
+        fprintf(stderr, "Usage: %s [-l <target latency usec>] [-t <threads>] [-c <coroutines>] [-p <processes>] [-s merge|radix] [-g <yield unit>] [-o <output>] [--mem-limit <bytes>[K|M|G]] [--fan-in <runs>] [--pipeline <depth>] [--stack-size <bytes>[K|M|G]] [--stack-report on|off] [--stack-guards <count>] [--policy rr|prio|edf] [--trace <file>] [--run-format text|raw|varint] <file1> [<file2> ...]\n", argv[0]);
         return 1;
     }
 
-    int num_files = argc - 1;
+    int num_files = argc - first_file;
+    if (is_bin_runs && (process_count > 0 || pipeline_depth > 0 || mem_limit > 0)) {
+        fprintf(stderr, "--run-format raw|varint works only with in-memory sorting by coroutines\n");
+        return 1;
+    }
+    if (process_count > 0) {
+        // Процессы сортируют свои файлы, каждый своим пулом корутин
+        int rc = sort_in_processes(argv + first_file, num_files, process_count, coro_count, output);
+        print_total_time(&program_start);
+        return rc == 0 ? 0 : 1;
+    }
+    if (pipeline_depth > 0 && mem_limit > 0) {
+        fprintf(stderr, "--pipeline and --mem-limit can't be used together\n");
+        return 1;
+    }
+    int concurrency = coro_count > 0 ? coro_count : num_files;
+    if (pipeline_depth > 0)
+        concurrency = 4;
+    if (mem_limit > 0) {
+        // Меньше буферов и самого короткого куска памяти не бывает
+        size_t mem_min = int_ext_split_mem_min() * concurrency;
+        if (mem_min < int_ext_merge_mem_min(fan_in))
+            mem_min = int_ext_merge_mem_min(fan_in);
+        if (mem_limit < mem_min) {
+            fprintf(stderr, "--mem-limit %zu is too small, %d coroutines with --fan-in %d need at least %zu bytes\n",
+                    mem_limit, concurrency, fan_in, mem_min);
+            return 1;
+        }
+        // Память делится между корутинами, которые режут файлы одновременно
+        run_size = int_ext_run_size(mem_limit / concurrency);
+    }
+    if ((mem_limit > 0 || is_bin_runs) && getenv("TMPDIR") != NULL)
+        tmp_dir = getenv("TMPDIR");
+    // У каждого файла свой список кусков, корутинам не нужны блокировки
+    struct int_run_list *file_runs = malloc(num_files * sizeof(*file_runs));
+    struct int_ext_stats *file_stats = calloc(num_files, sizeof(*file_stats));
+    for (int i = 0; i < num_files; ++i)
+        int_run_list_create(&file_runs[i]);
 
     // Initialize the coroutine global cooperative scheduler.
-    coro_sched_init();
+    if (thread_count > 0)
+        coro_sched_init_threads(thread_count);
+    else
+        coro_sched_init();
+    coro_sched_set_quantum(target_latency / concurrency);
+    coro_sched_set_policy(policy);
+    latency_budget = target_latency;
+    coro_stack_set_watermark(is_stack_report);
+    coro_stack_set_guard_limit(stack_guard_limit);
+    if (trace_path != NULL)
+        coro_trace_start(TRACE_EVENT_COUNT);
+
+    // Either a pool of coroutines takes the files, or each gets its own
+    struct coro_pool *pool = NULL;
+    if (coro_count > 0 && pipeline_depth == 0)
+        pool = coro_pool_new(coro_count, coroutine_func_f, stack_size);
 
     // Start coroutines for each valid file argument.
-    for (int i = 1; i <= num_files; ++i) {
+    char **sorted_files = malloc(num_files * sizeof(*sorted_files));
+    int sorted_count = 0;
+    int start_failed_count = 0;
+    for (int i = first_file; i < argc; ++i) {
         if (argv[i][0] == '-') {
             printf("Skipping invalid argument: %s\n", argv[i]);
             continue; // Skip arguments starting with '-'
         }
-        struct my_context *ctx = my_context_new(argv[i]); // Pass the file name to the context.
+        if (pipeline_depth > 0) {
+            sorted_files[sorted_count++] = argv[i];
+            continue;
+        }
+        struct my_context *ctx = my_context_new(argv[i], &file_runs[sorted_count], &file_stats[sorted_count]); // Pass the file name to the context.
         if (!ctx) {
             fprintf(stderr, "Failed to create context for: %s\n", argv[i]);
             continue;
         }
-        coro_new(coroutine_func_f, ctx);
+        sorted_files[sorted_count++] = argv[i];
+        if (pool) {
+            coro_pool_push(pool, ctx);
+        } else if (coro_new_ex(coroutine_func_f, ctx, stack_size) == NULL) {
+            perror("Error creating coroutine");
+            my_context_delete(ctx);
+            ++start_failed_count;
+        }
+    }
+    // Или все файлы проходят через один конвейер корутин
+    // Неотсортированные файлы сливать нельзя, считаем ошибки
+    int failed_count = start_failed_count;
+    struct pipeline pipeline;
+    if (pipeline_depth > 0 && pipeline_start(&pipeline, sorted_files, sorted_count) != 0)
+        ++failed_count;
+    if (pool) {
+        failed_count = coro_pool_join(pool);
+        printf("Failed %d\n", failed_count);
+        coro_pool_delete(pool);
     }
 
     // Wait for all the coroutines to end.
     struct coro *c;
     while ((c = coro_sched_wait()) != NULL) {
         printf("Finished %d\n", coro_status(c));
+        if (coro_status(c) != 0)
+            ++failed_count;
         coro_delete(c);
     }
+    if (latency_budget > 0)
+        print_budget_stats();
+    if (trace_path != NULL) {
+        if (coro_trace_dump(trace_path) == 0)
+            printf("Trace is written to %s\n", trace_path);
+        else
+            perror("Error writing trace");
+    }
+    coro_sched_destroy();
+    if (pipeline_depth > 0)
+        pipeline_destroy(&pipeline);
+    if (is_stack_report)
+        print_stack_hist();
+
+    int rc;
+    if (failed_count > 0) {
+        fprintf(stderr, "%d files are not sorted, nothing is merged\n", failed_count);
+        rc = -1;
+    } else if (mem_limit > 0) {
+        rc = merge_runs(file_runs, file_stats, sorted_count, output);
+    } else if (is_bin_runs) {
+        rc = merge_bin_runs(file_runs, sorted_count, output);
+        if (rc == 0)
+            printf("Merged %d binary runs into %s\n", sorted_count, output);
+    } else {
+        // Все файлы отсортированы на месте, осталось их слить
+        rc = merge_files(sorted_files, sorted_count, output);
+        if (rc == 0)
+            printf("Merged %d files into %s\n", sorted_count, output);
+    }
+    for (int i = 0; i < num_files; ++i)
+        int_run_list_destroy(&file_runs[i]);
+    free(file_runs);
+    free(file_stats);
+    free(sorted_files);
 
-    clock_gettime(CLOCK_MONOTONIC, &program_end);
-    long total_program_time = (program_end.tv_sec - program_start.tv_sec) * 1000000 +
-                              (program_end.tv_nsec - program_start.tv_nsec) / 1000;
-    printf("Total program execution time: %.3f seconds\n", (double)total_program_time / 1000000);
+    print_total_time(&program_start);
 
-    return 0;
+    return rc == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "libcoro.h"
+
+/**
+ * Stress test of the channels on the M:N scheduler. Many short-lived
+ * producers and consumers share a small channel, the last producer
+ * closes it. Any item lost, duplicated or a coroutine touched after its
+ * exit fails the test. Build with the sanitizers and run:
+ *
+ * $> make stress
+ * $> ./stress_chan [<thread count> [<round count>]]
+ */
+
+enum {
+	/** Producers and consumers in a round, each. */
+	STRESS_CORO_COUNT = 2000,
+	/** Items sent by a producer and received by a consumer. */
+	STRESS_ITEM_COUNT = 5,
+	STRESS_STACK_SIZE = 64 << 10,
+};
+
+struct stress_round {
+	struct coro_chan *chan;
+	int producers_left;
+	/** Sum of the sent items minus the received ones. */
+	long long balance;
+	long long received_count;
+};
+
+static int
+stress_producer_f(void *arg)
+{
+	struct stress_round *round = arg;
+	for (int i = 0; i < STRESS_ITEM_COUNT; ++i) {
+		long long item = i + 1;
+		if (coro_chan_send(round->chan, &item) != 0)
+			abort();
+		__atomic_add_fetch(&round->balance, item,
+				   __ATOMIC_RELAXED);
+	}
+	if (__atomic_sub_fetch(&round->producers_left, 1,
+			       __ATOMIC_ACQ_REL) == 0)
+		coro_chan_close(round->chan);
+	return 0;
+}
+
+static int
+stress_consumer_f(void *arg)
+{
+	struct stress_round *round = arg;
+	for (int i = 0; i < STRESS_ITEM_COUNT; ++i) {
+		long long item;
+		if (coro_chan_recv(round->chan, &item) != 0)
+			return 0;
+		__atomic_sub_fetch(&round->balance, item,
+				   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&round->received_count, 1,
+				   __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/** Start the producers and consumers in turns, yielding between. */
+static int
+stress_spawner_f(void *arg)
+{
+	struct stress_round *round = arg;
+	for (int i = 0; i < STRESS_CORO_COUNT; ++i) {
+		coro_new_ex(stress_consumer_f, round, STRESS_STACK_SIZE);
+		coro_new_ex(stress_producer_f, round, STRESS_STACK_SIZE);
+		if (i % 16 == 0)
+			coro_yield();
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count = argc > 1 ? atoi(argv[1]) : 4;
+	int round_count = argc > 2 ? atoi(argv[2]) : 20;
+	for (int r = 0; r < round_count; ++r) {
+		coro_sched_init_threads(thread_count);
+		struct stress_round round = {
+			.chan = coro_chan_new(sizeof(long long), 1 + r % 4),
+			.producers_left = STRESS_CORO_COUNT,
+		};
+		coro_new(stress_spawner_f, &round);
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		long long item = 0;
+		bool is_closed = coro_chan_send(round.chan, &item) == -1;
+		coro_sched_destroy();
+		if (!is_closed || round.received_count !=
+		    STRESS_CORO_COUNT * STRESS_ITEM_COUNT ||
+		    round.balance != 0) {
+			printf("Round %d failed: received %lld items, "
+			       "sum difference %lld\n", r, round.received_count,
+			       round.balance);
+			return 1;
+		}
+		coro_chan_delete(round.chan);
+	}
+	printf("%d rounds on %d threads passed\n", round_count, thread_count);
+	return 0;
+}
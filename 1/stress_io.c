@@ -0,0 +1,91 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "libcoro.h"
+
+/**
+ * Stress test of the coroutine I/O. Several coroutines read one
+ * non-blocking pipe at once, so with epoll the same descriptor is
+ * waited for many times and is registered through duplicates. A
+ * writer feeds it byte by byte, and all the bytes must be read. Build
+ * with the sanitizers, with io_uring and with epoll, and run:
+ *
+ * $> make stress
+ * $> ./stress_io [<thread count> [<round count>]]
+ */
+
+enum {
+	/** Coroutines reading the pipe at once. */
+	STRESS_READER_COUNT = 4,
+	/** Bytes written in a round. */
+	STRESS_BYTE_COUNT = 2000,
+};
+
+struct stress_round {
+	int fds[2];
+	long long read_count;
+};
+
+static int
+stress_reader_f(void *arg)
+{
+	struct stress_round *round = arg;
+	char c;
+	ssize_t rc;
+	while ((rc = coro_read(round->fds[0], &c, 1)) > 0)
+		__atomic_add_fetch(&round->read_count, 1, __ATOMIC_RELAXED);
+	return rc == 0 ? 0 : -1;
+}
+
+static int
+stress_writer_f(void *arg)
+{
+	struct stress_round *round = arg;
+	for (int i = 0; i < STRESS_BYTE_COUNT; ++i) {
+		if (coro_write(round->fds[1], "x", 1) != 1)
+			return -1;
+		/* Let the readers wait for the pipe again. */
+		if (i % 3 == 0)
+			coro_sleep(10);
+		else
+			coro_yield();
+	}
+	close(round->fds[1]);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count = argc > 1 ? atoi(argv[1]) : 0;
+	int round_count = argc > 2 ? atoi(argv[2]) : 5;
+	for (int r = 0; r < round_count; ++r) {
+		coro_sched_init_threads(thread_count);
+		struct stress_round round = {.read_count = 0};
+		if (pipe(round.fds) != 0 ||
+		    fcntl(round.fds[0], F_SETFL, O_NONBLOCK) != 0) {
+			perror("pipe");
+			return 1;
+		}
+		for (int i = 0; i < STRESS_READER_COUNT; ++i)
+			coro_new(stress_reader_f, &round);
+		coro_new(stress_writer_f, &round);
+		int failed_count = 0;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			failed_count += coro_status(c) != 0;
+			coro_delete(c);
+		}
+		coro_sched_destroy();
+		close(round.fds[0]);
+		if (failed_count > 0 || round.read_count != STRESS_BYTE_COUNT) {
+			printf("Round %d failed: %d coroutines failed, read %lld "
+			       "bytes\n", r, failed_count, round.read_count);
+			return 1;
+		}
+	}
+	printf("%d rounds on %d threads passed\n", round_count,
+	       thread_count);
+	return 0;
+}
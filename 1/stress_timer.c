@@ -0,0 +1,197 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "libcoro.h"
+
+/**
+ * Stress test of the timer wheel. A lone coroutine sleeps across the
+ * level borders, so its thread blocks exactly for the timeout computed
+ * from the wheel. Then a crowd of coroutines sleeps for random times,
+ * long enough for the timers to cascade from the upper levels. And the
+ * waiters with far deadlines are woken by other coroutines, so in the
+ * multi thread mode the timers are cancelled from other threads. No
+ * sleep may end early or much later than its deadline, and no waiter
+ * may time out. Build with the sanitizers, with io_uring and with
+ * epoll, and run:
+ *
+ * $> make stress
+ * $> ./stress_timer [<thread count> [<round count>]]
+ */
+
+enum {
+	/** Sleeping coroutines in a round. */
+	STRESS_SLEEPER_COUNT = 2000,
+	/** The longest sleep. The level 2 of the wheel starts at 409.6 ms. */
+	STRESS_SLEEP_MAX = 800000,
+	/** Pairs of a waiter and a coroutine waking it up. */
+	STRESS_PAIR_COUNT = 200,
+	/** Far deadline of the waiters, they must be woken before. */
+	STRESS_WAIT_TIMEOUT = 10000000,
+	/** The latest a sleep can end in the crowd. */
+	STRESS_LATE_MAX = 100000,
+	/** The latest a sleep can end, when nobody else runs. */
+	STRESS_LONE_LATE_MAX = 20000,
+	STRESS_STACK_SIZE = 64 << 10,
+};
+
+struct stress_round {
+	long long early_count;
+	long long late_count;
+	long long timeout_count;
+	long long max_lateness;
+};
+
+struct stress_sleeper {
+	struct stress_round *round;
+	unsigned seed;
+};
+
+struct stress_pair {
+	struct stress_round *round;
+	unsigned seed;
+	struct coro *waiter;
+	/** Set by the waker before waking the waiter up. */
+	bool is_woken;
+	/** Set by the waker after that, the waiter can exit then. */
+	bool is_done;
+};
+
+/** Sleep till the deadline and check it is not early or too late. */
+static void
+stress_sleep_until(struct stress_round *round, long long deadline,
+		   long long late_max)
+{
+	coro_sleep_until(deadline);
+	long long lateness = coro_time() - deadline;
+	if (lateness < 0)
+		__atomic_add_fetch(&round->early_count, 1, __ATOMIC_RELAXED);
+	else if (lateness > late_max)
+		__atomic_add_fetch(&round->late_count, 1, __ATOMIC_RELAXED);
+	long long max = __atomic_load_n(&round->max_lateness,
+					__ATOMIC_RELAXED);
+	while (lateness > max &&
+	       !__atomic_compare_exchange_n(&round->max_lateness, &max,
+					    lateness, false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+	}
+}
+
+/** Sleep alone through the levels of the wheel. */
+static int
+stress_lone_sleeper_f(void *arg)
+{
+	struct stress_round *round = arg;
+	static const long long sleeps[] = {
+		50, 1000, 6500, 70000, 410000, 700000,
+	};
+	for (size_t i = 0; i < sizeof(sleeps) / sizeof(sleeps[0]); ++i) {
+		stress_sleep_until(round, coro_time() + sleeps[i],
+				   STRESS_LONE_LATE_MAX);
+	}
+	return 0;
+}
+
+/** A long sleep to cascade, and a short one in the level 0. */
+static int
+stress_sleeper_f(void *arg)
+{
+	struct stress_sleeper *s = arg;
+	long long deadline = coro_time() +
+			     rand_r(&s->seed) % STRESS_SLEEP_MAX;
+	stress_sleep_until(s->round, deadline, STRESS_LATE_MAX);
+	deadline = coro_time() + rand_r(&s->seed) % 5000;
+	stress_sleep_until(s->round, deadline, STRESS_LATE_MAX);
+	return 0;
+}
+
+static int
+stress_waiter_f(void *arg)
+{
+	struct stress_pair *p = arg;
+	long long deadline = coro_time() + STRESS_WAIT_TIMEOUT;
+	while (!__atomic_load_n(&p->is_woken, __ATOMIC_ACQUIRE)) {
+		if (!coro_suspend_until(deadline)) {
+			__atomic_add_fetch(&p->round->timeout_count, 1,
+					   __ATOMIC_RELAXED);
+			return -1;
+		}
+	}
+	/* The waker can still be inside coro_wakeup(). */
+	while (!__atomic_load_n(&p->is_done, __ATOMIC_ACQUIRE))
+		coro_yield();
+	return 0;
+}
+
+static int
+stress_waker_f(void *arg)
+{
+	struct stress_pair *p = arg;
+	coro_sleep(rand_r(&p->seed) % 50000);
+	__atomic_store_n(&p->is_woken, true, __ATOMIC_RELEASE);
+	coro_wakeup(p->waiter);
+	__atomic_store_n(&p->is_done, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/** Run the coroutines till all of them finish. */
+static int
+stress_wait_all(void)
+{
+	int failed_count = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		failed_count += coro_status(c) != 0;
+		coro_delete(c);
+	}
+	return failed_count;
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count = argc > 1 ? atoi(argv[1]) : 0;
+	int round_count = argc > 2 ? atoi(argv[2]) : 2;
+	static struct stress_sleeper sleepers[STRESS_SLEEPER_COUNT];
+	static struct stress_pair pairs[STRESS_PAIR_COUNT];
+	for (int r = 0; r < round_count; ++r) {
+		coro_sched_init_threads(thread_count);
+		struct stress_round round = {.max_lateness = 0};
+		coro_new(stress_lone_sleeper_f, &round);
+		int failed_count = stress_wait_all();
+		long long lone_lateness = round.max_lateness;
+		round.max_lateness = 0;
+
+		for (int i = 0; i < STRESS_SLEEPER_COUNT; ++i) {
+			sleepers[i].round = &round;
+			sleepers[i].seed = r * STRESS_SLEEPER_COUNT + i;
+			coro_new_ex(stress_sleeper_f, &sleepers[i],
+				    STRESS_STACK_SIZE);
+		}
+		for (int i = 0; i < STRESS_PAIR_COUNT; ++i) {
+			struct stress_pair *p = &pairs[i];
+			p->round = &round;
+			p->seed = r * STRESS_PAIR_COUNT + i;
+			p->is_woken = false;
+			p->is_done = false;
+			p->waiter = coro_new_ex(stress_waiter_f, p,
+						STRESS_STACK_SIZE);
+			coro_new_ex(stress_waker_f, p, STRESS_STACK_SIZE);
+		}
+		failed_count += stress_wait_all();
+		coro_sched_destroy();
+		if (failed_count > 0 || round.early_count > 0 ||
+		    round.late_count > 0 || round.timeout_count > 0) {
+			printf("Round %d failed: %d coroutines failed, %lld "
+			       "sleeps early, %lld late, %lld waits timed "
+			       "out, max lateness %lld us\n", r, failed_count,
+			       round.early_count, round.late_count,
+			       round.timeout_count, round.max_lateness);
+			return 1;
+		}
+		printf("Round %d: max lateness %lld us alone, %lld us in the "
+		       "crowd\n", r, lone_lateness, round.max_lateness);
+	}
+	printf("%d rounds on %d threads passed\n", round_count,
+	       thread_count);
+	return 0;
+}
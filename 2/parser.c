@@ -2,13 +2,49 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#if !defined(PARSER_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define PARSER_AVX2 1
+#elif !defined(PARSER_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define PARSER_SSE2 1
+#endif
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
+enum {
+	/** The first chunk of a line arena, enough for most lines. */
+	ARENA_CHUNK_SIZE = 1024,
+};
+
+struct arena_chunk {
+	/** The previously allocated chunk. */
+	struct arena_chunk *prev;
+	alignas(max_align_t) char data[];
+};
+
+/**
+ * Memory of one command line. All its parts are allocated from a few
+ * chunks, and are freed at once with them.
+ */
+struct arena {
+	/** The last chunk, the allocations go from it. */
+	struct arena_chunk *chunk;
+	char *pos;
+	char *end;
+	/** Size of the next chunk. */
+	size_t next_size;
+};
+
+/**
+ * The line is allocated together with its arena in the first chunk,
+ * so command_line_delete() can find the arena.
+ */
+struct command_line_mem {
+	struct command_line line;
+	struct arena arena;
 };
 
 enum token_type {
@@ -23,34 +59,200 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/** Where the lexer has stopped inside a token. */
+enum lexer_state {
+	/** Whitespace before the token. */
+	LEXER_STATE_START,
+	/** A word, maybe inside quotes. */
+	LEXER_STATE_WORD,
+	/** After a backslash in a word. */
+	LEXER_STATE_ESCAPE,
+	/** After &, | or >, which can be doubled. */
+	LEXER_STATE_OPERATOR,
+	/** Inside a comment. */
+	LEXER_STATE_COMMENT,
+};
+
+/**
+ * A token, maybe not complete yet. When the input ends in the middle
+ * of it, the lexer state is saved, and the next feed continues from
+ * there.
+ */
 struct token {
 	enum token_type type;
-	char *data;
+	enum lexer_state state;
+	/** Quote of the current string in the word, or 0. */
+	char quote;
+	/** The operator character of LEXER_STATE_OPERATOR. */
+	char op;
+	/**
+	 * Text of the token. Points right into the parser buffer while
+	 * the token is a contiguous part of it, otherwise into buf.
+	 */
+	const char *data;
 	uint32_t size;
+	/** True, if the text is unescaped into buf. */
+	bool is_copy;
+	char *buf;
 	uint32_t capacity;
 };
 
+/** What is expected in the current line. */
+enum parser_state {
+	/** Commands and operators between them. */
+	PARSER_STATE_EXPRS,
+	/** After > or >>, a file name. */
+	PARSER_STATE_OUT_FILE,
+	/** After the output file, & or the line end. */
+	PARSER_STATE_AFTER_OUT,
+	/** After &, the line end. */
+	PARSER_STATE_AFTER_BACKGROUND,
+	/** The line has an error, it is skipped until its end. */
+	PARSER_STATE_SKIP_LINE,
+};
+
+struct parser {
+	char *buffer;
+	/** Start of the not scanned yet data. */
+	uint32_t pos;
+	uint32_t size;
+	uint32_t capacity;
+	/**
+	 * The current token and line, parsed up to pos. They are kept
+	 * between the feeds, so each byte is scanned once.
+	 */
+	struct token token;
+	struct command_line *line;
+	enum parser_state state;
+	/** Error of the line being skipped. */
+	enum parser_error error;
+};
+
+static void *
+arena_alloc(struct arena *a, size_t size)
+{
+	size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	if ((size_t)(a->end - a->pos) < size) {
+		size_t chunk_size = a->next_size;
+		if (chunk_size < sizeof(struct arena_chunk) + size)
+			chunk_size = sizeof(struct arena_chunk) + size;
+		struct arena_chunk *c = malloc(chunk_size);
+		c->prev = a->chunk;
+		a->chunk = c;
+		a->pos = c->data;
+		a->end = (char *)c + chunk_size;
+		a->next_size = chunk_size * 2;
+	}
+	void *res = a->pos;
+	a->pos += size;
+	return res;
+}
+
+static void *
+arena_calloc(struct arena *a, size_t size)
+{
+	return memset(arena_alloc(a, size), 0, size);
+}
+
+/** Free all the chunks. The arena itself can be in one of them. */
+static void
+arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c = a->chunk;
+	while (c != NULL) {
+		struct arena_chunk *prev = c->prev;
+		free(c);
+		c = prev;
+	}
+}
+
 static char *
-token_strdup(const struct token *t)
+token_strdup(const struct token *t, struct arena *a)
 {
 	assert(t->type == TOKEN_TYPE_STR);
 	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
+	char *res = arena_alloc(a, t->size + 1);
 	memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
 }
 
 static void
-token_append(struct token *t, char c)
+token_reserve(struct token *t, uint32_t size)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
+	if (size <= t->capacity)
+		return;
+	t->capacity = (t->capacity + 1) * 2;
+	if (t->capacity < size)
+		t->capacity = size;
+	t->buf = realloc(t->buf, sizeof(*t->buf) * t->capacity);
+}
+
+/** Add the character at @a pos of the input to the token. */
+static inline void
+token_append(struct token *t, const char *pos)
+{
+	if (!t->is_copy) {
+		if (t->size == 0)
+			t->data = pos;
+		assert(t->data + t->size == pos);
+		++t->size;
+		return;
 	}
-	t->data[t->size++] = c;
+	token_reserve(t, t->size + 1);
+	t->buf[t->size++] = *pos;
+	t->data = t->buf;
+}
+
+/** Add @a size characters of the input at @a pos to the token. */
+static inline void
+token_append_run(struct token *t, const char *pos, uint32_t size)
+{
+	if (!t->is_copy) {
+		if (t->size == 0)
+			t->data = pos;
+		assert(t->data + t->size == pos);
+		t->size += size;
+		return;
+	}
+	token_reserve(t, t->size + size);
+	memcpy(t->buf + t->size, pos, size);
+	t->size += size;
+	t->data = t->buf;
+}
+
+/** Add a character, which is not in the input as is. */
+static void
+token_push(struct token *t, char c)
+{
+	assert(t->is_copy);
+	token_reserve(t, t->size + 1);
+	t->buf[t->size++] = c;
+	t->data = t->buf;
+}
+
+/**
+ * Copy the text into buf. The input is going to change, or the text
+ * is not a contiguous part of it anymore.
+ */
+static void
+token_detach(struct token *t)
+{
+	if (t->is_copy)
+		return;
+	token_reserve(t, t->size * 2);
+	if (t->size > 0)
+		memcpy(t->buf, t->data, t->size);
+	t->data = t->buf;
+	t->is_copy = true;
+}
+
+/** Input characters are dropped from the text, like quotes and escapes. */
+static void
+token_skip(struct token *t)
+{
+	if (t->size > 0)
+		token_detach(t);
 }
 
 static void
@@ -58,37 +260,47 @@ token_reset(struct token *t)
 {
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
+	t->state = LEXER_STATE_START;
+	t->quote = 0;
+	t->is_copy = false;
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct command *cmd, char *arg, struct arena *a)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
+		/* The old array stays in the arena until the line is freed. */
 		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		char **args = arena_alloc(a, sizeof(*cmd->args) * cmd->arg_capacity);
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, sizeof(*cmd->args) * cmd->arg_count);
+		cmd->args = args;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
 	cmd->args[cmd->arg_count++] = arg;
 }
 
+/** Create an empty line with its own arena. */
+static struct command_line *
+command_line_new(void)
+{
+	struct arena a = {.next_size = ARENA_CHUNK_SIZE};
+	struct command_line_mem *mem = arena_calloc(&a, sizeof(*mem));
+	mem->arena = a;
+	return &mem->line;
+}
+
+static struct arena *
+command_line_arena(struct command_line *line)
+{
+	return &((struct command_line_mem *)line)->arena;
+}
+
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
-	}
-	free(line->out_file);
-	free(line);
+	arena_destroy(command_line_arena(line));
 }
 
 static void
@@ -111,6 +323,17 @@ void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
+	/*
+	 * Move the not parsed data to the buffer start only when at
+	 * least a half of it is parsed, so each byte is moved O(1)
+	 * times on average.
+	 */
+	if (cap < len && p->pos > 0 && p->pos >= p->size - p->pos) {
+		memmove(p->buffer, p->buffer + p->pos, p->size - p->pos);
+		p->size -= p->pos;
+		p->pos = 0;
+		cap = p->capacity - p->size;
+	}
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -123,96 +346,155 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 	assert(p->size <= p->capacity);
 }
 
+/** Characters which end a run of ordinary ones in a word. */
+enum char_class {
+	/** Outside of quotes. */
+	CHAR_CLASS_UNQUOTED = 1,
+	/** Inside double quotes. */
+	CHAR_CLASS_DQUOTE = 2,
+	/** Inside single quotes. */
+	CHAR_CLASS_SQUOTE = 4,
+};
+
+static const uint8_t char_class[256] = {
+	[' '] = CHAR_CLASS_UNQUOTED,
+	['\t'] = CHAR_CLASS_UNQUOTED,
+	['\r'] = CHAR_CLASS_UNQUOTED,
+	['\n'] = CHAR_CLASS_UNQUOTED,
+	['&'] = CHAR_CLASS_UNQUOTED,
+	['|'] = CHAR_CLASS_UNQUOTED,
+	['>'] = CHAR_CLASS_UNQUOTED,
+	['#'] = CHAR_CLASS_UNQUOTED,
+	['\''] = CHAR_CLASS_UNQUOTED | CHAR_CLASS_SQUOTE,
+	['"'] = CHAR_CLASS_UNQUOTED | CHAR_CLASS_DQUOTE,
+	['\\'] = CHAR_CLASS_UNQUOTED | CHAR_CLASS_DQUOTE,
+};
+
+#if defined(PARSER_AVX2)
+
+typedef __m256i scan_vec;
+#define scan_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define scan_eq(v, c) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))
+#define scan_or(a, b) _mm256_or_si256((a), (b))
+#define scan_movemask(v) ((uint32_t)_mm256_movemask_epi8(v))
+
+#elif defined(PARSER_SSE2)
+
+typedef __m128i scan_vec;
+#define scan_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define scan_eq(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+#define scan_or(a, b) _mm_or_si128((a), (b))
+#define scan_movemask(v) ((uint32_t)_mm_movemask_epi8(v))
+
+#endif
+
+#if defined(PARSER_AVX2) || defined(PARSER_SSE2)
+
+/**
+ * Bit mask of the characters at @a p, which end a run of ordinary
+ * ones with the given quote. sizeof(scan_vec) bytes at @a p must be
+ * readable.
+ */
+static inline uint32_t
+scan_mask(const char *p, char quote)
+{
+	scan_vec v = scan_load(p);
+	if (quote == '\'')
+		return scan_movemask(scan_eq(v, '\''));
+	scan_vec m = scan_or(scan_eq(v, '"'), scan_eq(v, '\\'));
+	if (quote == '"')
+		return scan_movemask(m);
+	m = scan_or(m, scan_or(scan_eq(v, ' '), scan_eq(v, '\t')));
+	m = scan_or(m, scan_or(scan_eq(v, '\r'), scan_eq(v, '\n')));
+	m = scan_or(m, scan_or(scan_eq(v, '&'), scan_eq(v, '|')));
+	m = scan_or(m, scan_or(scan_eq(v, '>'), scan_eq(v, '#')));
+	m = scan_or(m, scan_eq(v, '\''));
+	return scan_movemask(m);
+}
+
+#endif
+
+/**
+ * Find the end of the run of ordinary characters of a word, which
+ * are added to the token as is. Vectors of 16 or 32 bytes are checked
+ * at once when SSE2 or AVX2 is available, and the tail byte by byte.
+ */
+static inline const char *
+scan_word(const char *pos, const char *end, char quote)
+{
+#if defined(PARSER_AVX2) || defined(PARSER_SSE2)
+	while (end - pos >= (ptrdiff_t)sizeof(scan_vec)) {
+		uint32_t mask = scan_mask(pos, quote);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += sizeof(scan_vec);
+	}
+#endif
+	uint8_t cls = quote == 0 ? CHAR_CLASS_UNQUOTED :
+		      quote == '"' ? CHAR_CLASS_DQUOTE : CHAR_CLASS_SQUOTE;
+	while (pos < end && (char_class[(uint8_t)*pos] & cls) == 0)
+		++pos;
+	return pos;
+}
+
+/** Move the scan position, the data before it is not needed anymore. */
 static void
-parser_consume(struct parser *p, uint32_t size)
+parser_set_pos(struct parser *p, const char *pos)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	p->pos = pos - p->buffer;
+	assert(p->pos <= p->size);
+	if (p->pos == p->size) {
+		p->pos = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
-static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+/**
+ * Continue the token from @a pos_ptr, which is moved past the scanned
+ * characters.
+ * @retval true The token is complete.
+ * @retval false The input has ended, the token is to be continued.
+ */
+static bool
+parse_token(const char **pos_ptr, const char *end, struct token *out)
 {
-	token_reset(out);
-	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
-		++pos;
-	}
-	char quote = 0;
+	if (out->type != TOKEN_TYPE_NONE)
+		token_reset(out);
+	const char *pos = *pos_ptr;
 	while (pos < end) {
 		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
-				++pos;
-				if (pos == end)
-					return 0;
+		switch (out->state) {
+		case LEXER_STATE_START:
+			if (!isspace(c)) {
+				out->state = LEXER_STATE_WORD;
 				continue;
 			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
-				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				token_append(out, '\\');
-				goto append_and_next;
-			}
-			assert(quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
 			if (c == '\n') {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				goto done;
+			}
+			continue;
+		case LEXER_STATE_ESCAPE:
+			out->state = LEXER_STATE_WORD;
+			if (c == '\n') {
+				token_skip(out);
 				++pos;
 				continue;
 			}
-			goto append_and_next;
-		case '&':
-		case '|':
-		case '>':
-			if (quote != 0)
+			if (out->quote == 0 || c == '\\' || c == '"') {
+				token_skip(out);
 				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
 			}
-			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
+			/* The backslash stays. */
+			if (out->is_copy)
+				token_push(out, '\\');
+			else
+				token_append(out, pos - 1);
+			goto append_and_next;
+		case LEXER_STATE_OPERATOR:
+			if (c == out->op) {
+				switch (c) {
 				case '&':
 					out->type = TOKEN_TYPE_AND;
 					break;
@@ -228,7 +510,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 				}
 				++pos;
 			} else {
-				switch(c) {
+				switch (out->op) {
 				case '&':
 					out->type = TOKEN_TYPE_BACKGROUND;
 					break;
@@ -243,7 +525,63 @@ parse_token(const char *pos, const char *end, struct token *out)
 					break;
 				}
 			}
-			return pos - begin;
+			goto done;
+		case LEXER_STATE_COMMENT: {
+			const char *new_line = memchr(pos, '\n', end - pos);
+			if (new_line == NULL) {
+				pos = end;
+				continue;
+			}
+			pos = new_line + 1;
+			out->type = TOKEN_TYPE_NEW_LINE;
+			goto done;
+		}
+		case LEXER_STATE_WORD: {
+			const char *stop = scan_word(pos, end, out->quote);
+			if (stop != pos) {
+				token_append_run(out, pos, stop - pos);
+				pos = stop;
+				if (pos == end)
+					continue;
+				c = *pos;
+			}
+			break;
+		}
+		}
+		char quote = out->quote;
+		switch(c) {
+		case '\'':
+		case '"':
+			if (quote == 0) {
+				out->quote = c;
+				token_skip(out);
+				++pos;
+				continue;
+			}
+			if (quote != c)
+				goto append_and_next;
+			out->type = TOKEN_TYPE_STR;
+			++pos;
+			goto done;
+		case '\\':
+			if (quote == '\'')
+				goto append_and_next;
+			out->state = LEXER_STATE_ESCAPE;
+			++pos;
+			continue;
+		case '&':
+		case '|':
+		case '>':
+			if (quote != 0)
+				goto append_and_next;
+			if (out->size > 0) {
+				out->type = TOKEN_TYPE_STR;
+				goto done;
+			}
+			out->state = LEXER_STATE_OPERATOR;
+			out->op = c;
+			++pos;
+			continue;
 		case ' ':
 		case '\t':
 		case '\r':
@@ -251,192 +589,191 @@ parse_token(const char *pos, const char *end, struct token *out)
 				goto append_and_next;
 			assert(out->size > 0);
 			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
+			++pos;
+			goto done;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
 			assert(out->size > 0);
 			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
+			goto done;
 		case '#':
 			if (quote != 0)
 				goto append_and_next;
 			if (out->size > 0) {
 				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+				goto done;
 			}
+			out->state = LEXER_STATE_COMMENT;
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			continue;
 		default:
 			goto append_and_next;
 		}
 	append_and_next:
-		token_append(out, c);
+		token_append(out, pos);
 		++pos;
 	}
-	return 0;
+	/* The text can't point into the input, it is going to move. */
+	if (out->size > 0 || out->state == LEXER_STATE_ESCAPE)
+		token_detach(out);
+	*pos_ptr = pos;
+	return false;
+done:
+	*pos_ptr = pos;
+	return true;
 }
 
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
+	const char *pos = p->buffer + p->pos;
+	const char *end = p->buffer + p->size;
+	struct token *token = &p->token;
 	enum parser_error res = PARSER_ERR_NONE;
+	*out = NULL;
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+	while (parse_token(&pos, end, token)) {
+		if (p->line == NULL)
+			p->line = command_line_new();
+		struct command_line *line = p->line;
+		struct arena *arena = command_line_arena(line);
 		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+		switch (p->state) {
+		case PARSER_STATE_EXPRS:
+			switch(token->type) {
+			case TOKEN_TYPE_STR:
+				if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
+					command_append_arg(&line->tail->cmd, token_strdup(token, arena), arena);
+					continue;
+				}
+				e = arena_calloc(arena, sizeof(*e));
+				e->type = EXPR_TYPE_COMMAND;
+				e->cmd.exe = token_strdup(token, arena);
+				command_line_append(line, e);
 				continue;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
+			case TOKEN_TYPE_NEW_LINE:
+				/* Skip new lines. */
+				if (line->tail == NULL)
+					continue;
+				goto line_end;
+			case TOKEN_TYPE_PIPE:
+				if (line->tail == NULL) {
+					res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+					goto line_error;
+				}
+				if (line->tail->type != EXPR_TYPE_COMMAND) {
+					res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
+					goto line_error;
+				}
+				e = arena_calloc(arena, sizeof(*e));
+				e->type = EXPR_TYPE_PIPE;
+				command_line_append(line, e);
+				continue;
+			case TOKEN_TYPE_AND:
+				if (line->tail == NULL) {
+					res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+					goto line_error;
+				}
+				if (line->tail->type != EXPR_TYPE_COMMAND) {
+					res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+					goto line_error;
+				}
+				e = arena_calloc(arena, sizeof(*e));
+				e->type = EXPR_TYPE_AND;
+				command_line_append(line, e);
+				continue;
+			case TOKEN_TYPE_OR:
+				if (line->tail == NULL) {
+					res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+					goto line_error;
+				}
+				if (line->tail->type != EXPR_TYPE_COMMAND) {
+					res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+					goto line_error;
+				}
+				e = arena_calloc(arena, sizeof(*e));
+				e->type = EXPR_TYPE_OR;
+				command_line_append(line, e);
+				continue;
+			case TOKEN_TYPE_OUT_NEW:
+				line->out_type = OUTPUT_TYPE_FILE_NEW;
+				p->state = PARSER_STATE_OUT_FILE;
+				continue;
+			case TOKEN_TYPE_OUT_APPEND:
+				line->out_type = OUTPUT_TYPE_FILE_APPEND;
+				p->state = PARSER_STATE_OUT_FILE;
+				continue;
+			case TOKEN_TYPE_BACKGROUND:
+				line->is_background = true;
+				p->state = PARSER_STATE_AFTER_BACKGROUND;
+				continue;
+			default:
+				assert(false);
 				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
 			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+		case PARSER_STATE_OUT_FILE:
+			if (token->type != TOKEN_TYPE_STR) {
+				res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+				goto line_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
+			line->out_file = token_strdup(token, arena);
+			p->state = PARSER_STATE_AFTER_OUT;
 			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+		case PARSER_STATE_AFTER_OUT:
+			if (token->type == TOKEN_TYPE_BACKGROUND) {
+				line->is_background = true;
+				p->state = PARSER_STATE_AFTER_BACKGROUND;
+				continue;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
-		default:
-			assert(false);
-		}
-	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+			/* fallthrough */
+		case PARSER_STATE_AFTER_BACKGROUND:
+			if (token->type == TOKEN_TYPE_NEW_LINE)
+				goto line_end;
+			res = PARSER_ERR_TOO_LATE_ARGUMENTS;
+			goto line_error;
+		case PARSER_STATE_SKIP_LINE:
+			if (token->type != TOKEN_TYPE_NEW_LINE)
+				continue;
+			res = p->error;
+			goto line_drop;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
+	line_error:
+		/*
+		 * Skip the whole current line, starting from the next token.
+		 * It can't be executed but can't just crash here because of
+		 * that. The error is returned when the line ends.
+		 */
+		p->error = res;
+		p->state = PARSER_STATE_SKIP_LINE;
+		res = PARSER_ERR_NONE;
+		continue;
+	line_end:
 		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
 		if (line->tail->type != EXPR_TYPE_COMMAND) {
 			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+			goto line_drop;
 		}
-		res = PARSER_ERR_NONE;
 		*out = line;
-		goto return_final;
+		p->line = NULL;
+		p->state = PARSER_STATE_EXPRS;
+		break;
+	line_drop:
+		command_line_delete(line);
+		p->line = NULL;
+		p->state = PARSER_STATE_EXPRS;
+		break;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
-		}
-	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
-
-return_no_line:
-	command_line_delete(line);
-	*out = NULL;
-
-return_final:
-	free(token.data);
+	parser_set_pos(p, pos);
 	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	if (p->line != NULL)
+		command_line_delete(p->line);
 	free(p->buffer);
+	free(p->token.buf);
 	free(p);
 }
@@ -54,6 +54,10 @@ struct command_line {
 	bool is_background;
 };
 
+/**
+ * Free the line with all its commands and strings. They are allocated
+ * from one arena of the line, so it takes a free() per arena chunk.
+ */
 void
 command_line_delete(struct command_line *line);
 
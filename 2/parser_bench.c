@@ -0,0 +1,153 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Parser throughput on multi-megabyte scripts, fed at once and in
+ * 1 KiB chunks like the shell reads its input. Build with -mavx2 to
+ * scan by 32 bytes instead of 16, or with -DPARSER_NO_SIMD to scan
+ * byte by byte.
+ *
+ * $> gcc -O2 parser.c parser_bench.c -o parser_bench
+ * $> ./parser_bench [<script size in MiB>]
+ */
+
+struct script {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+script_append(struct script *s, const char *str)
+{
+	size_t len = strlen(str);
+	if (s->size + len > s->capacity) {
+		s->capacity = (s->capacity + len) * 2;
+		s->data = realloc(s->data, s->capacity);
+	}
+	memcpy(s->data + s->size, str, len);
+	s->size += len;
+}
+
+/** Many short command lines, like a generated script. */
+static void
+script_gen_lines(struct script *s, size_t size)
+{
+	static const char *lines[] = {
+		"echo 123 456 789\n",
+		"cat file.txt | grep -v pattern | wc -l > out.txt\n",
+		"touch \"some file\" && ls -la 'dir with spaces' || echo fail\n",
+		"   printf \"%s\\n\" \"escaped \\\"quotes\\\"\" >> log.txt &\n",
+		"# a comment line | && ||\n",
+		"mkdir -p a/b/c\\ d && cd a/b\n",
+	};
+	int count = sizeof(lines) / sizeof(lines[0]);
+	for (int i = 0; s->size < size; ++i)
+		script_append(s, lines[i % count]);
+}
+
+/** Lines with long arguments, like paths and messages. */
+static void
+script_gen_long_words(struct script *s, size_t size)
+{
+	while (s->size < size) {
+		script_append(s, "cp /usr/share/some/deeply/nested/directory/"
+			      "with/a/long/path/to/file_name.txt ");
+		script_append(s, "\"/home/user/documents/a folder with "
+			      "spaces/and another one/target.txt\"\n");
+		script_append(s, "echo 'a long single quoted message, which "
+			      "has no escapes at all, just text' >> log.txt\n");
+	}
+}
+
+/** One command with a huge quoted argument spanning many lines. */
+static void
+script_gen_quoted(struct script *s, size_t size)
+{
+	script_append(s, "echo \"");
+	while (s->size < size)
+		script_append(s, "a line of a long quoted argument \\\" \\\\ 12345\n");
+	script_append(s, "\"\n");
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Parse the whole script fed in chunks, return the line count. */
+static size_t
+bench_parse(const struct script *s, size_t chunk_size)
+{
+	struct parser *p = parser_new();
+	size_t line_count = 0;
+	for (size_t pos = 0; pos < s->size; pos += chunk_size) {
+		size_t size = s->size - pos;
+		if (size > chunk_size)
+			size = chunk_size;
+		parser_feed(p, s->data + pos, size);
+		while (true) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			if (err != PARSER_ERR_NONE) {
+				printf("Error: %d\n", (int)err);
+				exit(1);
+			}
+			++line_count;
+			command_line_delete(line);
+		}
+	}
+	parser_delete(p);
+	return line_count;
+}
+
+static void
+bench_run(const char *name, const struct script *s, size_t chunk_size)
+{
+	/* The best of a few runs, the others are disturbed by noise. */
+	double duration = 0;
+	size_t line_count = 0;
+	for (int i = 0; i < 5; ++i) {
+		double start = bench_now();
+		line_count = bench_parse(s, chunk_size);
+		double d = bench_now() - start;
+		if (i == 0 || d < duration)
+			duration = d;
+	}
+	printf("%s, %zu byte chunks: %.1f MB/s, %zu lines in %.3f s\n",
+	       name, chunk_size, s->size / duration / 1e6, line_count,
+	       duration);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = (argc > 1 ? atol(argv[1]) : 8) << 20;
+	struct script lines = {0};
+	script_gen_lines(&lines, size);
+	struct script words = {0};
+	script_gen_long_words(&words, size);
+	struct script quoted = {0};
+	script_gen_quoted(&quoted, size / 8);
+	printf("script of %zu bytes, quoted argument of %zu bytes\n",
+	       lines.size, quoted.size);
+	bench_run("lines", &lines, lines.size);
+	bench_run("lines", &lines, 1024);
+	bench_run("long words", &words, words.size);
+	bench_run("long words", &words, 1024);
+	bench_run("quoted", &quoted, quoted.size);
+	bench_run("quoted", &quoted, 1024);
+	free(lines.data);
+	free(words.data);
+	free(quoted.data);
+	return 0;
+}
@@ -0,0 +1,291 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Differential fuzzer of the parser. Random scripts are parsed being
+ * fed at once, byte by byte and in random chunks, and the results must
+ * be the same. A digest of all the results is printed, so the builds
+ * with and without the vectorized scanner can be compared too:
+ *
+ * $> gcc -O2 parser.c parser_fuzz.c -o parser_fuzz
+ * $> gcc -O2 -DPARSER_NO_SIMD parser.c parser_fuzz.c -o parser_fuzz_scalar
+ * $> ./parser_fuzz 1 100000 > simd.txt
+ * $> ./parser_fuzz_scalar 1 100000 > scalar.txt
+ * $> cmp simd.txt scalar.txt
+ *
+ * The scripts are random, but valid enough not to hit the asserts of
+ * the parser, like an empty quoted string as a command.
+ */
+
+struct text {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+text_append(struct text *t, const char *str, size_t len)
+{
+	if (t->size + len > t->capacity) {
+		t->capacity = (t->capacity + len) * 2;
+		t->data = realloc(t->data, t->capacity);
+	}
+	memcpy(t->data + t->size, str, len);
+	t->size += len;
+}
+
+static void
+text_puts(struct text *t, const char *str)
+{
+	text_append(t, str, strlen(str));
+}
+
+static void
+text_putc(struct text *t, char c)
+{
+	text_append(t, &c, 1);
+}
+
+static unsigned fuzz_seed;
+
+static int
+fuzz_rand(int n)
+{
+	return rand_r(&fuzz_seed) % n;
+}
+
+static char
+fuzz_pick(const char *chars)
+{
+	return chars[fuzz_rand(strlen(chars))];
+}
+
+/**
+ * A word of plain characters, escapes and quoted strings. Long ones
+ * make the scanner go by whole vectors.
+ */
+static void
+fuzz_word(struct text *s)
+{
+	int len = 1 + fuzz_rand(fuzz_rand(4) == 0 ? 100 : 8);
+	switch (fuzz_rand(4)) {
+	case 0:
+		text_putc(s, '\'');
+		for (int i = 0; i < len; ++i)
+			text_putc(s, fuzz_pick(" ab\\\"|&>#\n\t\v"));
+		text_puts(s, "a'");
+		return;
+	case 1:
+		text_putc(s, '"');
+		for (int i = 0; i < len; ++i) {
+			if (fuzz_rand(6) == 0) {
+				text_putc(s, '\\');
+				text_putc(s, fuzz_pick("\\\"n\n'a"));
+				continue;
+			}
+			text_putc(s, fuzz_pick(" ab'|&>#\n\t\x80"));
+		}
+		text_puts(s, "b\"");
+		return;
+	default:
+		for (int i = 0; i < len; ++i) {
+			if (fuzz_rand(10) == 0) {
+				text_putc(s, '\\');
+				text_putc(s, fuzz_pick(" ab\\\"'|&>#\n"));
+				continue;
+			}
+			text_putc(s, fuzz_pick("abcxyz.-_/019\v\xff"));
+		}
+		/* A word can't be just an escaped new line. */
+		text_putc(s, 'z');
+		return;
+	}
+}
+
+static void
+fuzz_space(struct text *s)
+{
+	int len = 1 + fuzz_rand(3);
+	for (int i = 0; i < len; ++i)
+		text_putc(s, fuzz_pick(" \t"));
+}
+
+static void
+fuzz_command(struct text *s)
+{
+	fuzz_word(s);
+	int count = fuzz_rand(5);
+	for (int i = 0; i < count; ++i) {
+		fuzz_space(s);
+		fuzz_word(s);
+	}
+}
+
+static void
+fuzz_line(struct text *s)
+{
+	static const char *bad_lines[] = {
+		"| a\n", "a > &&\n", "a > f & b\n", "a |\n", "a && ||\n",
+		" || x y\n", "a >\nb c\n", "x > y z\n", "q &&\n",
+	};
+	static const char *ops[] = {"|", "&&", "||"};
+	switch (fuzz_rand(20)) {
+	case 0:
+	case 1:
+		text_puts(s, "# comment | && \" '\n");
+		return;
+	case 2:
+		text_puts(s, "  \n");
+		return;
+	case 3:
+		text_puts(s, bad_lines[fuzz_rand(9)]);
+		return;
+	default:
+		break;
+	}
+	if (fuzz_rand(3) != 0)
+		fuzz_space(s);
+	fuzz_command(s);
+	int count = fuzz_rand(4);
+	for (int i = 0; i < count; ++i) {
+		fuzz_space(s);
+		text_puts(s, ops[fuzz_rand(3)]);
+		fuzz_space(s);
+		fuzz_command(s);
+	}
+	if (fuzz_rand(4) == 0) {
+		fuzz_space(s);
+		text_puts(s, fuzz_rand(2) ? ">" : ">>");
+		fuzz_space(s);
+		fuzz_word(s);
+	}
+	if (fuzz_rand(4) == 0) {
+		fuzz_space(s);
+		text_putc(s, '&');
+	}
+	if (fuzz_rand(5) == 0) {
+		fuzz_space(s);
+		text_puts(s, "# tail comment\n");
+		return;
+	}
+	if (fuzz_rand(2) != 0)
+		fuzz_space(s);
+	text_putc(s, '\n');
+}
+
+/** Print a result of parser_pop_next() into @a out. */
+static void
+fuzz_dump(struct text *out, enum parser_error err,
+	  const struct command_line *line)
+{
+	char buf[64];
+	if (err != PARSER_ERR_NONE) {
+		snprintf(buf, sizeof(buf), "error %d\n", (int)err);
+		text_puts(out, buf);
+		return;
+	}
+	snprintf(buf, sizeof(buf), "line %d %d", (int)line->out_type,
+		 (int)line->is_background);
+	text_puts(out, buf);
+	if (line->out_file != NULL) {
+		text_puts(out, " > ");
+		text_puts(out, line->out_file);
+	}
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		snprintf(buf, sizeof(buf), " [%d", (int)e->type);
+		text_puts(out, buf);
+		if (e->type == EXPR_TYPE_COMMAND) {
+			text_puts(out, " <");
+			text_puts(out, e->cmd.exe);
+			text_puts(out, ">");
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+				text_puts(out, " <");
+				text_puts(out, e->cmd.args[i]);
+				text_puts(out, ">");
+			}
+		}
+		text_puts(out, "]");
+	}
+	text_puts(out, "\n");
+}
+
+/**
+ * Parse the script fed in chunks of random size up to @a max_chunk
+ * and print the results into @a out.
+ */
+static void
+fuzz_parse(const struct text *s, size_t max_chunk, struct text *out)
+{
+	struct parser *p = parser_new();
+	size_t pos = 0;
+	while (pos < s->size) {
+		size_t size = 1 + fuzz_rand(max_chunk);
+		if (size > s->size - pos)
+			size = s->size - pos;
+		parser_feed(p, s->data + pos, size);
+		pos += size;
+		while (true) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			fuzz_dump(out, err, line);
+			if (line != NULL)
+				command_line_delete(line);
+		}
+	}
+	parser_delete(p);
+}
+
+/** FNV-1a, to print a short digest of all the results. */
+static uint64_t
+fuzz_hash(uint64_t h, const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+int
+main(int argc, char **argv)
+{
+	fuzz_seed = argc > 1 ? atoi(argv[1]) : 1;
+	int count = argc > 2 ? atoi(argv[2]) : 10000;
+	uint64_t digest = 0xcbf29ce484222325ULL;
+	size_t total_size = 0;
+	struct text script = {0};
+	struct text whole = {0};
+	struct text chunked = {0};
+	for (int i = 0; i < count; ++i) {
+		script.size = 0;
+		int line_count = 1 + fuzz_rand(10);
+		for (int j = 0; j < line_count; ++j)
+			fuzz_line(&script);
+		total_size += script.size;
+		whole.size = 0;
+		fuzz_parse(&script, script.size, &whole);
+		/* Fed byte by byte, then in random chunks. */
+		static const size_t max_chunks[] = {1, 7, 64};
+		for (int j = 0; j < 3; ++j) {
+			chunked.size = 0;
+			fuzz_parse(&script, max_chunks[j], &chunked);
+			if (chunked.size == whole.size &&
+			    memcmp(chunked.data, whole.data, whole.size) == 0)
+				continue;
+			printf("Mismatch on script %d, chunks up to %zu bytes:\n",
+			       i, max_chunks[j]);
+			fwrite(script.data, 1, script.size, stdout);
+			return 1;
+		}
+		digest = fuzz_hash(digest, whole.data, whole.size);
+	}
+	printf("%d scripts, %zu bytes, digest %016llx\n", count, total_size,
+	       (unsigned long long)digest);
+	free(script.data);
+	free(whole.data);
+	free(chunked.data);
+	return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Throughput of a 5-stage pipeline run by the shell. All the stages
+# must run at once: with one stage at a time the first one blocks on
+# a full pipe, and the shell hangs until the timeout.
+#
+# $> gcc solution.c parser.c
+# $> ./pipeline_bench.sh [<gigabytes>] [<shell>]
+
+gigabytes=${1:-4}
+shell=${2:-./a.out}
+bytes=$((gigabytes * 1024 * 1024 * 1024))
+command="head -c $bytes /dev/zero | cat | tr '\\\\0' x | cat | wc -c"
+
+start=$(date +%s.%N)
+count=$(echo "$command" | timeout $((30 * gigabytes + 30)) "$shell")
+rc=$?
+end=$(date +%s.%N)
+
+if [ $rc -ne 0 ] || [ "$count" != "$bytes" ]; then
+	echo "Pipeline failed: exit code $rc, $count bytes instead of $bytes"
+	exit 1
+fi
+echo "$gigabytes GiB through 5 stages:" \
+	"$(echo "$start $end $bytes" | awk '{printf "%.2f s, %.2f GiB/s", $2 - $1, $3 / ($2 - $1) / 2^30}')"
@@ -1,92 +1,196 @@
 #include "parser.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <spawn.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
+extern char **environ;
+
 struct ExecutionResult {
     int exitCode;
     int forceExitCode;
 };
 
+// Launch commands by fork() + execvp() instead of posix_spawnp(), for comparison
+static bool useFork = false;
+
+static void build_argv(const struct command *cmd, char **args) {
+    args[0] = cmd->exe;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+        args[i + 1] = cmd->args[i];
+    }
+    args[cmd->arg_count + 1] = NULL;
+}
+
+/**
+ * Start a command in a forked copy of the shell. Its stdin is
+ * @a in_fd, if it is not -1. Its stdout is the write end of @a pipefd,
+ * if it is not NULL, otherwise the output file of the line.
+ */
+static pid_t fork_command(const struct command_line *line, const struct command *cmd,
+                          int in_fd, const int *pipefd) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid != 0) {
+        return pid;
+    }
+    // Child process
+    if (in_fd != -1) {
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+
+    int out_fd = STDOUT_FILENO; // Corrected this line
+    if (pipefd == NULL) {
+        if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
+            out_fd = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
+            out_fd = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        }
+        if (out_fd == -1) {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+        dup2(out_fd, STDOUT_FILENO);
+        if (out_fd != STDOUT_FILENO) {
+            close(out_fd);
+        }
+    } else {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[1]);
+    }
+
+    char *args[cmd->arg_count + 2];
+    build_argv(cmd, args);
+    execvp(args[0], args);
+    perror("execvp");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Same as fork_command(), but with posix_spawnp(). The redirections
+ * are done by file actions in the child, which shares the memory of
+ * the shell until exec, so the page tables are not copied.
+ * Returns -1, if the command can't be started.
+ */
+static pid_t spawn_command(const struct command_line *line, const struct command *cmd,
+                           int in_fd, const int *pipefd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, in_fd);
+    }
+    // The output file is opened here, so a failed open is reported with
+    // its name instead of as a failure of the command
+    int out_fd = -1;
+    if (pipefd == NULL && line->out_type != OUTPUT_TYPE_STDOUT) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+        out_fd = open(line->out_file, flags, 0644);
+        if (out_fd == -1) {
+            fprintf(stderr, "open: %s: %s\n", line->out_file, strerror(errno));
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    } else if (pipefd != NULL) {
+        posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+    }
+
+    char *args[cmd->arg_count + 2];
+    build_argv(cmd, args);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (out_fd != -1)
+        close(out_fd);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", args[0], strerror(rc));
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Wait for all the stages of a pipeline. They run concurrently, so a
+ * stage writing more than a pipe buffer doesn't block the others.
+ * Returns the status of the last stage, like bash does. A stage which
+ * couldn't start has pid -1 and fails like a child which couldn't exec.
+ */
+static int wait_pipeline(const pid_t *pids, int count) {
+    int exitCode = 0;
+    for (int i = 0; i < count; ++i) {
+        int status = EXIT_FAILURE << 8;
+        if (pids[i] != -1 && waitpid(pids[i], &status, 0) == -1) {
+            perror("waitpid");
+            continue;
+        }
+        if (i == count - 1)
+            exitCode = WEXITSTATUS(status);
+    }
+    return exitCode;
+}
+
 static struct ExecutionResult execute_command_line(const struct command_line *line) {
     assert(line != NULL);
 
-    int exitCode = 0;
     int pipefd[2], last_fd = -1;
     struct ExecutionResult execResult = {-1, -1};
 
+    // All the stages of a pipeline are started at once and waited at its end
+    int commandCount = 0;
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        if (e->type == EXPR_TYPE_COMMAND)
+            ++commandCount;
+    }
+    pid_t *pids = malloc(commandCount * sizeof(*pids));
+    if (pids == NULL && commandCount > 0) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int pidCount = 0;
+
     const struct expr *e = line->head;
     while (e != NULL) {
         if (e->type == EXPR_TYPE_COMMAND) {
-            if (e->next && e->next->type == EXPR_TYPE_PIPE) {
+            bool isPiped = e->next && e->next->type == EXPR_TYPE_PIPE;
+            if (isPiped) {
                 if (pipe(pipefd) == -1) {
                     perror("pipe");
                     exit(EXIT_FAILURE);
                 }
             }
 
-            pid_t pid = fork();
-            if (pid == -1) {
-                perror("fork");
-                exit(EXIT_FAILURE);
-            } else if (pid == 0) { // Child process
-                if (last_fd != -1) {
-                    dup2(last_fd, STDIN_FILENO);
-                    close(last_fd);
-                }
-
-                int out_fd = STDOUT_FILENO; // Corrected this line
-                if (e->next == NULL || e->next->type != EXPR_TYPE_PIPE) {
-                    if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-                        out_fd = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-                        out_fd = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-                    }
-                    if (out_fd == -1) {
-                        perror("open");
-                        exit(EXIT_FAILURE);
-                    }
-                    dup2(out_fd, STDOUT_FILENO);
-                    if (out_fd != STDOUT_FILENO) {
-                        close(out_fd);
-                    }
-                }
-
-                if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-                    close(pipefd[0]);
-                    dup2(pipefd[1], STDOUT_FILENO);
-                    close(pipefd[1]);
-                }
+            const int *out_pipe = isPiped ? pipefd : NULL;
+            if (useFork)
+                pids[pidCount++] = fork_command(line, &e->cmd, last_fd, out_pipe);
+            else
+                pids[pidCount++] = spawn_command(line, &e->cmd, last_fd, out_pipe);
 
-                // Ensure args is declared before any conditional logic
-                char *args[e->cmd.arg_count + 2];
-                args[0] = e->cmd.exe;
-                for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
-                    args[i + 1] = e->cmd.args[i];
-                }
-                args[e->cmd.arg_count + 1] = NULL;
-
-                execvp(args[0], args);
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            } else { // Parent process
-                if (last_fd != -1) {
-                    close(last_fd);
-                }
-                if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-                    last_fd = pipefd[0];
-                    close(pipefd[1]);
-                } else {
-                    last_fd = -1;
-                }
-                waitpid(pid, &exitCode, 0);
-                execResult.exitCode = WEXITSTATUS(exitCode);
+            if (last_fd != -1) {
+                close(last_fd);
+            }
+            if (isPiped) {
+                last_fd = pipefd[0];
+                close(pipefd[1]);
+            } else {
+                // The pipeline is complete, the next command waits for it
+                last_fd = -1;
+                execResult.exitCode = wait_pipeline(pids, pidCount);
+                pidCount = 0;
             }
         }
         e = e->next;
@@ -95,11 +199,13 @@ static struct ExecutionResult execute_command_line(const struct command_line *li
     if (last_fd != -1) {
         close(last_fd);
     }
+    free(pids);
 
     return execResult;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    useFork = argc > 1 && strcmp(argv[1], "--fork") == 0;
     struct parser *p = parser_new();
     char buf[1024];
     int rc;
@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Commands per second the shell starts with posix_spawnp(), the
+# default, and with fork() + execvp(). The script is many short
+# commands, a third of them with a redirection, a third in pipes.
+#
+# $> gcc solution.c parser.c
+# $> ./spawn_bench.sh [<line count>] [<shell>]
+
+lines=${1:-20000}
+shell=${2:-./a.out}
+script=$(mktemp)
+awk -v n="$lines" 'BEGIN {
+	for (i = 0; i < n; ++i) {
+		if (i % 3 == 0)
+			print "true";
+		else if (i % 3 == 1)
+			print "echo " i " > /dev/null";
+		else
+			print "true | true";
+	}
+}' > "$script"
+# Each third line starts two processes.
+commands=$((lines + lines / 3))
+
+for mode in spawn fork; do
+	flag=""
+	[ $mode = fork ] && flag="--fork"
+	start=$(date +%s.%N)
+	if ! "$shell" $flag < "$script"; then
+		echo "The shell failed in $mode mode"
+		rm -f "$script"
+		exit 1
+	fi
+	end=$(date +%s.%N)
+	echo "$start $end $commands $mode" | awk '{printf "%s: %d commands in %.2f s, %.0f commands/s\n", $4, $3, $2 - $1, $3 / ($2 - $1)}'
+done
+rm -f "$script"